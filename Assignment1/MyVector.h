@@ -19,6 +19,16 @@ MyVector* new_vector() {
 	return obj;
 }
 
+MyVector* vector_from_array(int* arr, int sz) {
+	// Takes ownership of arr, which must be allocated with malloc
+	MyVector* obj = malloc(sizeof(MyVector));
+	obj->sz = sz;
+	obj->max_sz = sz > 0 ? sz : 1;
+	obj->arr = arr;
+
+	return obj;
+}
+
 void push_back(MyVector* myVector, int x) {
 	while (myVector->sz >= myVector->max_sz) {
 		myVector->max_sz *= 2;
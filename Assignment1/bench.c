@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parser.h"
+#include "writer.h"
+#include "query.h"
+
+/**
+ * Benchmarks of the sort pipeline stages. Usage:
+ *
+ *     ./bench parse [count] [max_threads]
+ *     ./bench write [count] [path]
+ *     ./bench query [count]
+ *
+ * Each benchmark prints one line per configuration with the
+ * throughput in MB/s or the time.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Generate a text the same as generator.py does - random numbers
+ * separated by spaces.
+ */
+static char *
+bench_gen_text(size_t count, size_t *size)
+{
+	size_t cap = count * 12 + 1;
+	char *text = malloc(cap);
+	if (text == NULL)
+		return NULL;
+	size_t pos = 0;
+	srand(42);
+	for (size_t i = 0; i < count; ++i)
+		pos += sprintf(text + pos, "%d ", rand());
+	*size = pos;
+	return text;
+}
+
+static int
+bench_parse(size_t count, int max_threads)
+{
+	size_t size;
+	char *text = bench_gen_text(count, &size);
+	if (text == NULL) {
+		printf("Not enough memory for %zu numbers\n", count);
+		return 1;
+	}
+	printf("# parse %zu numbers, %.1f MB\n", count, size / 1e6);
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		int *numbers;
+		size_t parsed;
+		double best = 0;
+		for (int run = 0; run < 3; ++run) {
+			double start = bench_now();
+			if (parse_buffer(text, size, threads, &numbers,
+					 &parsed) != 0) {
+				printf("Parse failed\n");
+				free(text);
+				return 1;
+			}
+			double t = bench_now() - start;
+			free(numbers);
+			if (parsed != count) {
+				printf("Parsed %zu instead of %zu\n", parsed,
+				       count);
+				free(text);
+				return 1;
+			}
+			if (best == 0 || t < best)
+				best = t;
+		}
+		printf("parse threads=%d time=%.3f s throughput=%.1f MB/s\n",
+		       threads, best, size / 1e6 / best);
+	}
+	free(text);
+	return 0;
+}
+
+static int
+bench_write(size_t count, const char *path)
+{
+	int *numbers = malloc(count * sizeof(int));
+	if (numbers == NULL) {
+		printf("Not enough memory for %zu numbers\n", count);
+		return 1;
+	}
+	srand(42);
+	for (size_t i = 0; i < count; ++i)
+		numbers[i] = rand();
+	printf("# write %zu numbers into %s\n", count, path);
+
+	double start = bench_now();
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		printf("File %s didn't open correctly\n", path);
+		free(numbers);
+		return 1;
+	}
+	for (size_t i = 0; i < count; ++i)
+		fprintf(file, "%d ", numbers[i]);
+	long size = ftell(file);
+	fclose(file);
+	double t = bench_now() - start;
+	printf("write mode=fprintf time=%.3f s throughput=%.1f MB/s\n", t,
+	       size / 1e6 / t);
+
+	const char *names[] = {"buffered", "direct"};
+	const int flags[] = {0, NUM_WRITER_DIRECT};
+	for (int i = 0; i < 2; ++i) {
+		start = bench_now();
+		struct num_writer *w = num_writer_open(path, flags[i]);
+		if (w == NULL) {
+			printf("File %s didn't open correctly\n", path);
+			free(numbers);
+			return 1;
+		}
+		num_writer_put_array(w, numbers, count);
+		int rc = num_writer_close(w);
+		t = bench_now() - start;
+		if (rc != 0)
+			printf("Write failed\n");
+		printf("write mode=%s time=%.3f s throughput=%.1f MB/s\n",
+		       names[i], t, size / 1e6 / t);
+	}
+	remove(path);
+	free(numbers);
+	return 0;
+}
+
+static int
+bench_query(size_t count)
+{
+	int *orig = malloc(count * sizeof(int));
+	int *arr = malloc(count * sizeof(int));
+	if (orig == NULL || arr == NULL) {
+		printf("Not enough memory for %zu numbers\n", count);
+		free(orig);
+		free(arr);
+		return 1;
+	}
+	srand(42);
+	for (size_t i = 0; i < count; ++i)
+		orig[i] = rand();
+	printf("# query over %zu numbers\n", count);
+
+	memcpy(arr, orig, count * sizeof(int));
+	double start = bench_now();
+	query_sort(arr, count);
+	printf("query mode=full_sort time=%.3f s\n", bench_now() - start);
+
+	memcpy(arr, orig, count * sizeof(int));
+	start = bench_now();
+	query_smallest(arr, count, 1000);
+	printf("query mode=top_k_1000 time=%.3f s\n", bench_now() - start);
+
+	memcpy(arr, orig, count * sizeof(int));
+	size_t ranks[] = {count / 2, count / 100 * 90, count / 100 * 99};
+	int values[3];
+	start = bench_now();
+	query_ranks(arr, count, ranks, 3, values);
+	printf("query mode=quantiles_3 time=%.3f s\n", bench_now() - start);
+
+	memcpy(arr, orig, count * sizeof(int));
+	start = bench_now();
+	query_range(arr, count, 0, RAND_MAX / 100);
+	printf("query mode=range_1%% time=%.3f s\n", bench_now() - start);
+
+	free(orig);
+	free(arr);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: %s parse [count] [max_threads]\n", argv[0]);
+		printf("       %s write [count] [path]\n", argv[0]);
+		printf("       %s query [count]\n", argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[1], "parse") == 0) {
+		size_t count = argc > 2 ? atoll(argv[2]) : 10000000;
+		int max_threads = argc > 3 ? atoi(argv[3]) :
+				  parse_default_thread_count();
+		return bench_parse(count, max_threads);
+	}
+	if (strcmp(argv[1], "write") == 0) {
+		size_t count = argc > 2 ? atoll(argv[2]) : 10000000;
+		const char *path = argc > 3 ? argv[3] : "bench_write.txt";
+		return bench_write(count, path);
+	}
+	if (strcmp(argv[1], "query") == 0) {
+		size_t count = argc > 2 ? atoll(argv[2]) : 10000000;
+		return bench_query(count);
+	}
+	printf("Unknown benchmark %s\n", argv[1]);
+	return 1;
+}
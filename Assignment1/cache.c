@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+enum {
+	/** Number of buckets of the path index. Power of 2. */
+	SORT_CACHE_BUCKETS = 1024,
+};
+
+/** Header of a file with a stored run. */
+struct sort_cache_run_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+	/** Content hash of the source file, for verification. */
+	uint64_t hash;
+};
+
+static const char sort_cache_magic[4] = {'S', 'R', 'U', 'N'};
+
+struct sort_cache_entry {
+	/** Real path of the source file. */
+	char *path;
+	/** Size, mtime and content hash of the source file. */
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	/** Number of numbers in the run. */
+	uint64_t count;
+	/** Logical time of the last use, for LRU. */
+	uint64_t last_used;
+	/** Next entry in the same bucket, -1 is the end. */
+	int next;
+	/** True, if the entry is evicted or replaced. */
+	bool is_dead;
+};
+
+struct sort_cache {
+	char *dir;
+	size_t budget;
+	struct sort_cache_entry *entries;
+	int entry_count;
+	int entry_capacity;
+	/** First entry index in each bucket, -1 if empty. */
+	int buckets[SORT_CACHE_BUCKETS];
+	/** Logical clock. Persisted to keep LRU order between runs. */
+	uint64_t clock;
+	/** True, if the index has to be saved. */
+	bool is_dirty;
+};
+
+static inline uint64_t
+sort_cache_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+uint64_t
+sort_cache_hash(const void *data, size_t size)
+{
+	const unsigned char *pos = data;
+	const unsigned char *end = pos + size;
+	/* Two independent lanes to keep both multipliers busy. */
+	uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ size;
+	uint64_t h2 = 0xc2b2ae3d27d4eb4fULL;
+	for (; end - pos >= 16; pos += 16) {
+		uint64_t w1, w2;
+		memcpy(&w1, pos, 8);
+		memcpy(&w2, pos + 8, 8);
+		h1 = (h1 ^ w1) * 0x9e3779b97f4a7c15ULL;
+		h1 = (h1 << 31) | (h1 >> 33);
+		h2 = (h2 ^ w2) * 0xc2b2ae3d27d4eb4fULL;
+		h2 = (h2 << 29) | (h2 >> 35);
+	}
+	if (end - pos >= 8) {
+		uint64_t w;
+		memcpy(&w, pos, 8);
+		h2 = (h2 ^ w) * 0xc2b2ae3d27d4eb4fULL;
+		pos += 8;
+	}
+	uint64_t tail = 0;
+	if (pos != end)
+		memcpy(&tail, pos, end - pos);
+	h1 ^= tail;
+	return sort_cache_mix(h1 ^ sort_cache_mix(h2));
+}
+
+/** Hash of the whole content of an opened file. */
+static int
+sort_cache_hash_fd(int fd, size_t size, uint64_t *hash)
+{
+	if (size == 0) {
+		*hash = sort_cache_hash(NULL, 0);
+		return 0;
+	}
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise(data, size, MADV_SEQUENTIAL);
+	*hash = sort_cache_hash(data, size);
+	munmap(data, size);
+	return 0;
+}
+
+static uint64_t
+sort_cache_run_size(const struct sort_cache_entry *e)
+{
+	return sizeof(struct sort_cache_run_header) + e->count * sizeof(int);
+}
+
+/** Name of the run file of an entry. Free it with free(). */
+static char *
+sort_cache_run_path(const struct sort_cache *c, const char *path)
+{
+	size_t len = strlen(c->dir) + 32;
+	char *name = malloc(len);
+	if (name != NULL) {
+		snprintf(name, len, "%s/%016llx.run", c->dir,
+			 (unsigned long long)sort_cache_hash(path,
+							     strlen(path)));
+	}
+	return name;
+}
+
+static int
+sort_cache_bucket(const char *path)
+{
+	return sort_cache_hash(path, strlen(path)) &
+	       (SORT_CACHE_BUCKETS - 1);
+}
+
+static struct sort_cache_entry *
+sort_cache_find(struct sort_cache *c, const char *path)
+{
+	for (int i = c->buckets[sort_cache_bucket(path)]; i >= 0;
+	     i = c->entries[i].next) {
+		struct sort_cache_entry *e = &c->entries[i];
+		if (!e->is_dead && strcmp(e->path, path) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/** Add a new entry. Takes ownership of @a path. */
+static struct sort_cache_entry *
+sort_cache_add(struct sort_cache *c, char *path)
+{
+	if (c->entry_count == c->entry_capacity) {
+		int new_capacity = c->entry_capacity == 0 ? 16 :
+				   c->entry_capacity * 2;
+		struct sort_cache_entry *new_entries =
+			realloc(c->entries, new_capacity * sizeof(*new_entries));
+		if (new_entries == NULL)
+			return NULL;
+		c->entries = new_entries;
+		c->entry_capacity = new_capacity;
+	}
+	int bucket = sort_cache_bucket(path);
+	struct sort_cache_entry *e = &c->entries[c->entry_count];
+	memset(e, 0, sizeof(*e));
+	e->path = path;
+	e->next = c->buckets[bucket];
+	c->buckets[bucket] = c->entry_count++;
+	return e;
+}
+
+/** Index line: hash size mtime_sec mtime_nsec count last_used path. */
+static void
+sort_cache_load_index(struct sort_cache *c)
+{
+	size_t len = strlen(c->dir) + 16;
+	char *name = malloc(len);
+	if (name == NULL)
+		return;
+	snprintf(name, len, "%s/index", c->dir);
+	FILE *file = fopen(name, "r");
+	free(name);
+	if (file == NULL)
+		return;
+	unsigned long long clock;
+	if (fscanf(file, "sortcache 1 %llu\n", &clock) == 1) {
+		c->clock = clock;
+		unsigned long long hash, size, count, last_used;
+		long long sec, nsec;
+		char path[PATH_MAX + 1];
+		while (fscanf(file, "%llx %llu %lld %lld %llu %llu %4096[^\n]\n",
+			      &hash, &size, &sec, &nsec, &count, &last_used,
+			      path) == 7) {
+			char *path_copy = strdup(path);
+			struct sort_cache_entry *e = path_copy == NULL ? NULL :
+				sort_cache_add(c, path_copy);
+			if (e == NULL) {
+				free(path_copy);
+				break;
+			}
+			e->hash = hash;
+			e->size = size;
+			e->mtime_sec = sec;
+			e->mtime_nsec = nsec;
+			e->count = count;
+			e->last_used = last_used;
+		}
+	}
+	fclose(file);
+}
+
+struct sort_cache *
+sort_cache_open(const char *dir, size_t budget)
+{
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return NULL;
+	struct sort_cache *c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->dir = strdup(dir);
+	if (c->dir == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->budget = budget;
+	for (int i = 0; i < SORT_CACHE_BUCKETS; ++i)
+		c->buckets[i] = -1;
+	sort_cache_load_index(c);
+	return c;
+}
+
+/** Read and verify a run file. */
+static int
+sort_cache_load_run(struct sort_cache *c, const struct sort_cache_entry *e,
+		    int **arr, size_t *count)
+{
+	char *name = sort_cache_run_path(c, e->path);
+	if (name == NULL)
+		return -1;
+	int fd = open(name, O_RDONLY);
+	free(name);
+	if (fd < 0)
+		return -1;
+	struct sort_cache_run_header header;
+	int *numbers = NULL;
+	size_t size = e->count * sizeof(int);
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, sort_cache_magic, 4) != 0 ||
+	    header.version != 1 || header.count != e->count ||
+	    header.hash != e->hash)
+		goto error;
+	/* One extra element, so an empty run is not a NULL array. */
+	numbers = malloc(size + sizeof(int));
+	if (numbers == NULL)
+		goto error;
+	for (size_t done = 0; done < size;) {
+		ssize_t rc = read(fd, (char *)numbers + done, size - done);
+		if (rc <= 0)
+			goto error;
+		done += rc;
+	}
+	close(fd);
+	*arr = numbers;
+	*count = e->count;
+	return 0;
+error:
+	free(numbers);
+	close(fd);
+	return -1;
+}
+
+int
+sort_cache_lookup(struct sort_cache *c, const char *path, int **arr,
+		  size_t *count)
+{
+	char real[PATH_MAX];
+	if (realpath(path, real) == NULL)
+		return -1;
+	struct sort_cache_entry *e = sort_cache_find(c, real);
+	if (e == NULL)
+		return -1;
+	int fd = open(real, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	int rc = fstat(fd, &st);
+	if (rc == 0 && (uint64_t)st.st_size != e->size)
+		rc = -1;
+	if (rc == 0 && (st.st_mtim.tv_sec != e->mtime_sec ||
+			st.st_mtim.tv_nsec != e->mtime_nsec)) {
+		/* Touched, but maybe not changed. Check the content. */
+		uint64_t hash;
+		if (sort_cache_hash_fd(fd, st.st_size, &hash) != 0 ||
+		    hash != e->hash) {
+			rc = -1;
+		} else {
+			e->mtime_sec = st.st_mtim.tv_sec;
+			e->mtime_nsec = st.st_mtim.tv_nsec;
+		}
+	}
+	close(fd);
+	if (rc == 0)
+		rc = sort_cache_load_run(c, e, arr, count);
+	if (rc == 0) {
+		e->last_used = ++c->clock;
+		c->is_dirty = true;
+	}
+	return rc;
+}
+
+int
+sort_cache_store(struct sort_cache *c, const char *path, const int *arr,
+		 size_t count)
+{
+	char real[PATH_MAX];
+	if (realpath(path, real) == NULL)
+		return -1;
+	int fd = open(real, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	uint64_t hash;
+	if (fstat(fd, &st) != 0 ||
+	    sort_cache_hash_fd(fd, st.st_size, &hash) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	char *name = sort_cache_run_path(c, real);
+	if (name == NULL)
+		return -1;
+	size_t tmp_len = strlen(name) + 8;
+	char *tmp_name = malloc(tmp_len);
+	if (tmp_name == NULL) {
+		free(name);
+		return -1;
+	}
+	snprintf(tmp_name, tmp_len, "%s.tmp", name);
+	/* Write into a temporary file, so a crash leaves no broken run. */
+	FILE *file = fopen(tmp_name, "w");
+	int rc = -1;
+	if (file != NULL) {
+		struct sort_cache_run_header header;
+		memcpy(header.magic, sort_cache_magic, 4);
+		header.version = 1;
+		header.count = count;
+		header.hash = hash;
+		bool is_ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			     fwrite(arr, sizeof(int), count, file) == count;
+		if (fclose(file) == 0 && is_ok && rename(tmp_name, name) == 0)
+			rc = 0;
+		else
+			remove(tmp_name);
+	}
+	free(tmp_name);
+	free(name);
+	if (rc != 0)
+		return -1;
+
+	struct sort_cache_entry *e = sort_cache_find(c, real);
+	if (e == NULL) {
+		char *path_copy = strdup(real);
+		if (path_copy == NULL ||
+		    (e = sort_cache_add(c, path_copy)) == NULL) {
+			free(path_copy);
+			return -1;
+		}
+	}
+	e->size = st.st_size;
+	e->mtime_sec = st.st_mtim.tv_sec;
+	e->mtime_nsec = st.st_mtim.tv_nsec;
+	e->hash = hash;
+	e->count = count;
+	e->last_used = ++c->clock;
+	c->is_dirty = true;
+	return 0;
+}
+
+/** Drop least recently used entries until the runs fit the budget. */
+static void
+sort_cache_evict(struct sort_cache *c)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < c->entry_count; ++i) {
+		if (!c->entries[i].is_dead)
+			total += sort_cache_run_size(&c->entries[i]);
+	}
+	while (total > c->budget) {
+		struct sort_cache_entry *lru = NULL;
+		for (int i = 0; i < c->entry_count; ++i) {
+			struct sort_cache_entry *e = &c->entries[i];
+			if (!e->is_dead &&
+			    (lru == NULL || e->last_used < lru->last_used))
+				lru = e;
+		}
+		if (lru == NULL)
+			break;
+		char *name = sort_cache_run_path(c, lru->path);
+		if (name != NULL) {
+			remove(name);
+			free(name);
+		}
+		lru->is_dead = true;
+		total -= sort_cache_run_size(lru);
+		c->is_dirty = true;
+	}
+}
+
+static int
+sort_cache_save_index(struct sort_cache *c)
+{
+	size_t len = strlen(c->dir) + 16;
+	char *name = malloc(len);
+	char *tmp_name = malloc(len);
+	int rc = -1;
+	if (name == NULL || tmp_name == NULL)
+		goto out;
+	snprintf(name, len, "%s/index", c->dir);
+	snprintf(tmp_name, len, "%s/index.tmp", c->dir);
+	FILE *file = fopen(tmp_name, "w");
+	if (file == NULL)
+		goto out;
+	fprintf(file, "sortcache 1 %llu\n", (unsigned long long)c->clock);
+	for (int i = 0; i < c->entry_count; ++i) {
+		struct sort_cache_entry *e = &c->entries[i];
+		if (e->is_dead)
+			continue;
+		fprintf(file, "%016llx %llu %lld %lld %llu %llu %s\n",
+			(unsigned long long)e->hash,
+			(unsigned long long)e->size, (long long)e->mtime_sec,
+			(long long)e->mtime_nsec, (unsigned long long)e->count,
+			(unsigned long long)e->last_used, e->path);
+	}
+	if (fclose(file) == 0 && rename(tmp_name, name) == 0)
+		rc = 0;
+	else
+		remove(tmp_name);
+out:
+	free(name);
+	free(tmp_name);
+	return rc;
+}
+
+int
+sort_cache_close(struct sort_cache *c)
+{
+	sort_cache_evict(c);
+	int rc = c->is_dirty ? sort_cache_save_index(c) : 0;
+	for (int i = 0; i < c->entry_count; ++i)
+		free(c->entries[i].path);
+	free(c->entries);
+	free(c->dir);
+	free(c);
+	return rc;
+}
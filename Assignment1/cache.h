@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Persistent cache of sorted runs. Lets a rerun on a mostly
+ * unchanged set of files skip parsing, sorting and writing them.
+ *
+ * An entry is keyed by the real path of a file, its size, mtime
+ * and a fast hash of its content. The value is the sorted array
+ * of numbers in binary form. Entries are stored as files in a
+ * cache directory plus one text index file. When the total size
+ * of the runs is over the budget, least recently used entries
+ * are evicted.
+ */
+
+struct sort_cache;
+
+/**
+ * Open a cache in the directory @a dir, create it if necessary.
+ * @param budget Maximal total size of the stored runs in bytes.
+ * @retval NULL Can't create the directory, or no memory.
+ */
+struct sort_cache *
+sort_cache_open(const char *dir, size_t budget);
+
+/**
+ * Find the sorted run of a file. The file matches, when its size
+ * and mtime are the same as on store. If only the mtime differs,
+ * the content hash is compared.
+ * @param[out] arr Newly allocated sorted numbers, free() them.
+ * @param[out] count Number of elements in @a arr.
+ *
+ * @retval 0 Hit.
+ * @retval -1 Miss.
+ */
+int
+sort_cache_lookup(struct sort_cache *c, const char *path, int **arr,
+		  size_t *count);
+
+/**
+ * Store the sorted run of a file. Should be called after the
+ * sorted content is written into the file, so the key is taken
+ * from its final state.
+ * @retval 0 Success.
+ * @retval -1 Error, the cache is not changed.
+ */
+int
+sort_cache_store(struct sort_cache *c, const char *path, const int *arr,
+		 size_t count);
+
+/**
+ * Evict entries over the budget, save the index and free the
+ * cache.
+ * @retval 0 Success.
+ * @retval -1 The index can not be saved.
+ */
+int
+sort_cache_close(struct sort_cache *c);
+
+/** Fast non-cryptographic 64 bit hash. */
+uint64_t
+sort_cache_hash(const void *data, size_t size);
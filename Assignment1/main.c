@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,6 +7,11 @@
 #include <time.h>
 #include "libcoro.h"
 #include "MyVector.h"
+#include "trace.h"
+#include "parser.h"
+#include "writer.h"
+#include "cache.h"
+#include "query.h"
 
 char **fileNames;
 int64_t latency; 
@@ -13,6 +19,25 @@ int64_t numbOfCors;
 int64_t numbOfFiles;
 int64_t maxTimePerCor;
 int sorted_files = 0;
+int parseThreads = 0;
+int writerFlags = 0;
+char *cacheDir = NULL;
+size_t cacheBudget = (size_t)1024 * 1024 * 1024;
+struct sort_cache *sortCache = NULL;
+
+typedef enum {
+	QUERY_NONE,
+	QUERY_TOP_K,
+	QUERY_QUANTILES,
+	QUERY_RANGE,
+} QueryMode;
+
+QueryMode queryMode = QUERY_NONE;
+size_t topK;
+int rangeLo;
+int rangeHi;
+double *quantiles = NULL;
+int quantileCount = 0;
 
 MyVector **myVectors;
 
@@ -46,7 +71,9 @@ void checkCorExTime(CoroInfo* coroInfo)
 	
 	if (gotTime > maxTimePerCor) {
 		coroInfo->switchNum ++;
+		TRACE_BEGIN(coroInfo->id + 1, "yield");
 		coro_yield();
+		TRACE_END(coroInfo->id + 1, "yield");
 		clock_gettime(CLOCK_MONOTONIC, &coroInfo->startTime);
 	}
 }
@@ -108,62 +135,288 @@ void heapSort (MyVector* myVector, CoroInfo* coroInfo) {
 	checkCorExTime(coroInfo);
 }
 
+/**
+ * Keep in the vector only what the query needs. For top-K and
+ * range that is a small sorted part, the rest is freed.
+ */
+void reduceForQuery(MyVector* V)
+{
+	if (queryMode == QUERY_TOP_K)
+		V->sz = query_smallest(V->arr, V->sz, topK);
+	else if (queryMode == QUERY_RANGE)
+		V->sz = query_range(V->arr, V->sz, rangeLo, rangeHi);
+	else
+		return;
+
+	int new_max_sz = V->sz > 0 ? V->sz : 1;
+	int* arr = realloc(V->arr, sizeof(int) * new_max_sz);
+	if (arr != NULL) {
+		V->arr = arr;
+		V->max_sz = new_max_sz;
+	}
+}
+
 static int
 coroutine_func_f(void *context)
 {
 	CoroInfo *coroInfo = (CoroInfo *)context;
+	int lane = coroInfo->id + 1;
 	
 	//coroutine function
 	while(sorted_files < numbOfFiles) {
 	
 		char* name_of_file = strdup(fileNames[sorted_files]);
-		
-		FILE *file;
-		file = fopen(name_of_file, "r");
+		int *numbers;
+		size_t count;
 
-		if (file == NULL) {
+		// An unchanged file is already sorted, take its run from the cache
+		TRACE_BEGIN(lane, "cache_lookup");
+		if (sortCache != NULL &&
+		    sort_cache_lookup(sortCache, name_of_file, &numbers, &count) == 0) {
+			TRACE_END(lane, "cache_lookup");
+			MyVector* V = vector_from_array(numbers, count);
+			myVectors[sorted_files++] = V;
+			if (queryMode != QUERY_NONE)
+				reduceForQuery(V);
+			printf("> file %s taken from cache by coroutine %" PRId64 "\n", name_of_file, coroInfo->id);
+			free(name_of_file);
+			continue;
+		}
+		TRACE_END(lane, "cache_lookup");
+		
+		// The file is mapped and parsed by several threads at once
+		TRACE_BEGIN(lane, "parse");
+		if (parse_file(name_of_file, parseThreads, &numbers, &count) != 0) {
+			TRACE_END(lane, "parse");
 			printf("> file %s didn't open correctly\n", name_of_file);
-			free(file);
+			free(name_of_file);
 			break;
 		}
+		MyVector* V = vector_from_array(numbers, count);
+		TRACE_END(lane, "parse");
 		
 		printf("> file %s openned by coroutine %lld\n", name_of_file, coroInfo->id);
 
-		MyVector* V = new_vector();
-		char* token = (char*)malloc(sizeof(char) * 256);
-		while (fscanf(file, "%s", token) == 1) {
-			int num = atoi(token);
-			push_back(V, num);
-		}
-		free(token);
-		fclose(file);
-
 		myVectors[sorted_files++] = V;
+
+		// Queries don't need the whole file sorted, and the file stays untouched
+		if (queryMode != QUERY_NONE) {
+			TRACE_BEGIN(lane, "select");
+			reduceForQuery(V);
+			TRACE_END(lane, "select");
+			printf("> selection in file %s finished by coroutine %" PRId64 "\n", name_of_file, coroInfo->id);
+			free(name_of_file);
+			continue;
+		}
 		clock_gettime(CLOCK_MONOTONIC, &coroInfo->startTime);
+		TRACE_BEGIN(lane, "sort");
 		heapSort(V, coroInfo);
 		checkCorExTime(coroInfo);
+		TRACE_END(lane, "sort");
 		
-		file = fopen(name_of_file, "w");
-		for (int i = 0; i < size(V); ++i) {
-			fprintf(file, "%d ", get(V, i));
+		TRACE_BEGIN(lane, "write");
+		struct num_writer *writer = num_writer_open(name_of_file, writerFlags);
+		int rc = -1;
+		if (writer != NULL) {
+			num_writer_put_array(writer, V->arr, size(V));
+			rc = num_writer_close(writer);
 		}
+		if (rc != 0)
+			printf("> file %s didn't write correctly\n", name_of_file);
+		else if (sortCache != NULL)
+			sort_cache_store(sortCache, name_of_file, V->arr, size(V));
 
 		printf("> sorting of file %s finished by coroutine %lld\n", name_of_file, coroInfo->id);
 		free(name_of_file);
-		fclose(file);
+		TRACE_END(lane, "write");
 	}
 	
 	printf("> Coroutine with num %lld finished it's work because there is no files left\n", coroInfo->id);
 	return 0;
 }
 
+/** Parse a list like 0.5,0.9,0.99 into sorted quantiles. */
+int parseQuantiles(const char *list)
+{
+	free(quantiles);
+	quantileCount = 1;
+	for (const char *c = list; *c != 0; ++c)
+		quantileCount += *c == ',';
+	quantiles = malloc(quantileCount * sizeof(double));
+	if (quantiles == NULL)
+		return -1;
+
+	const char *pos = list;
+	for (int i = 0; i < quantileCount; ++i) {
+		char *end;
+		double q = strtod(pos, &end);
+		if (end == pos || q < 0 || q > 1 || (*end != ',' && *end != 0))
+			return -1;
+		// Insertion sort, so the ranks are found from left to right
+		int j = i;
+		for (; j > 0 && quantiles[j - 1] > q; --j)
+			quantiles[j] = quantiles[j - 1];
+		quantiles[j] = q;
+		pos = end + 1;
+	}
+	return 0;
+}
+
+/**
+ * Parse leading --name=value options. Returns how many arguments
+ * were consumed, or -1 on a bad option.
+ */
+int parseOptions(int argc, char **argv)
+{
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+		if (strncmp(argv[i], "--parse-threads=", 16) == 0) {
+			parseThreads = atoi(argv[i] + 16);
+			if (parseThreads <= 0) {
+				printf("Number of parse threads must be a positive integer\n");
+				return -1;
+			}
+		} else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+			cacheDir = argv[i] + 12;
+		} else if (strncmp(argv[i], "--cache-budget=", 15) == 0) {
+			cacheBudget = strtoull(argv[i] + 15, NULL, 10);
+		} else if (strncmp(argv[i], "--top-k=", 8) == 0) {
+			queryMode = QUERY_TOP_K;
+			topK = strtoull(argv[i] + 8, NULL, 10);
+			if (topK == 0) {
+				printf("K must be a positive integer\n");
+				return -1;
+			}
+		} else if (strncmp(argv[i], "--range=", 8) == 0) {
+			queryMode = QUERY_RANGE;
+			if (sscanf(argv[i] + 8, "%d:%d", &rangeLo, &rangeHi) != 2 || rangeLo > rangeHi) {
+				printf("Range must be LO:HI, LO <= HI\n");
+				return -1;
+			}
+		} else if (strncmp(argv[i], "--quantiles=", 12) == 0) {
+			queryMode = QUERY_QUANTILES;
+			if (parseQuantiles(argv[i] + 12) != 0) {
+				if (quantiles == NULL)
+					printf("Not enough memory for the quantiles\n");
+				else
+					printf("Quantiles must be a comma separated list of numbers from [0, 1]\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--direct-io") == 0) {
+			writerFlags |= NUM_WRITER_DIRECT;
+		} else {
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	return i - 1;
+}
+
+/**
+ * Merge the sorted vectors into a file. For top-K the lazy merge
+ * stops after K values.
+ */
+int mergeToFile(const char *name)
+{
+	struct num_writer *writer = num_writer_open(name, writerFlags);
+	int **runs = malloc(numbOfFiles * sizeof(int *));
+	size_t *sizes = malloc(numbOfFiles * sizeof(size_t));
+	for (int i = 0; i < numbOfFiles; ++i) {
+		runs[i] = myVectors[i]->arr;
+		sizes[i] = size(myVectors[i]);
+	}
+	struct query_merge *merge = query_merge_new(runs, sizes, numbOfFiles);
+	if (writer == NULL || merge == NULL) {
+		printf("%s didn't open correctly\n", name);
+		if (writer != NULL)
+			num_writer_close(writer);
+		if (merge != NULL)
+			query_merge_delete(merge);
+		free(runs);
+		free(sizes);
+		return 1;
+	}
+
+	size_t limit = queryMode == QUERY_TOP_K ? topK : SIZE_MAX;
+	int value;
+	for (size_t i = 0; i < limit && query_merge_next(merge, &value); ++i)
+		num_writer_put(writer, value);
+
+	query_merge_delete(merge);
+	free(runs);
+	free(sizes);
+	if (num_writer_close(writer) != 0) {
+		printf("%s didn't write correctly\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Find the quantiles with selection over all the numbers, without
+ * sorting them.
+ */
+int printQuantiles()
+{
+	size_t total = 0;
+	for (int i = 0; i < numbOfFiles; ++i)
+		total += size(myVectors[i]);
+	if (total == 0) {
+		printf("No numbers, no quantiles\n");
+		return 1;
+	}
+	int *all = malloc(total * sizeof(int));
+	size_t *ranks = malloc(quantileCount * sizeof(size_t));
+	int *values = malloc(quantileCount * sizeof(int));
+	if (all == NULL || ranks == NULL || values == NULL) {
+		printf("Not enough memory for the quantiles\n");
+		free(all);
+		free(ranks);
+		free(values);
+		return 1;
+	}
+	size_t pos = 0;
+	for (int i = 0; i < numbOfFiles; ++i) {
+		memcpy(all + pos, myVectors[i]->arr, size(myVectors[i]) * sizeof(int));
+		pos += size(myVectors[i]);
+		// Not needed anymore, don't keep two copies
+		freeMyVector(myVectors[i]);
+		myVectors[i] = NULL;
+	}
+	for (int i = 0; i < quantileCount; ++i)
+		ranks[i] = (size_t)(quantiles[i] * (total - 1));
+	query_ranks(all, total, ranks, quantileCount, values);
+
+	printf("\n> Quantiles of %zu numbers\n", total);
+	for (int i = 0; i < quantileCount; ++i)
+		printf("   -> %g: %d\n", quantiles[i], values[i]);
+
+	free(all);
+	free(ranks);
+	free(values);
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
+	int optCount = parseOptions(argc, argv);
+	if (optCount < 0)
+		return 1;
+	// Hide the options, so the positional arguments start from argv[1]
+	argv[optCount] = argv[0];
+	argv += optCount;
+	argc -= optCount;
+
+	if (parseThreads == 0)
+		parseThreads = parse_default_thread_count();
 	
 	if (argc < 4) {
 		printf("Not enough args, we need you to write number of coroutines\n");
 		printf("Then write Latency, and after list the names of files\n");
+		printf("Options: --parse-threads=N, --direct-io, --cache-dir=DIR,\n");
+		printf("         --cache-budget=BYTES, --top-k=K, --quantiles=Q1,Q2,...,\n");
+		printf("         --range=LO:HI before them\n");
 		return 1;
 	}
 
@@ -199,8 +452,15 @@ main(int argc, char **argv)
     	}
 	}
 
+	if (cacheDir != NULL) {
+		sortCache = sort_cache_open(cacheDir, cacheBudget);
+		if (sortCache == NULL)
+			printf("Cache directory %s can't be used, working without cache\n", cacheDir);
+	}
+
 	myVectors = malloc(numbOfFiles * sizeof(MyVector *));
 	CoroInfo** coroInfoArr = malloc(numbOfCors * sizeof(CoroInfo *));
+	TRACE_BEGIN(TRACE_MAIN_LANE, "sort_files");
 	/* Initialize our coroutine global cooperative scheduler. */
 	coro_sched_init();
 	/* Start several coroutines. */
@@ -229,6 +489,7 @@ main(int argc, char **argv)
 	}
 	free(c);
 	/* All coroutines have finished. */
+	TRACE_END(TRACE_MAIN_LANE, "sort_files");
 
 	for (int i = 0; i < numbOfCors; ++i) {
 		printf("\n> CoroInfo about coroutine with ID: %lld\n", coroInfoArr[i]->id);
@@ -240,41 +501,31 @@ main(int argc, char **argv)
 	}
 	free(coroInfoArr);
 
+	if (sortCache != NULL && sort_cache_close(sortCache) != 0)
+		printf("Cache index can't be saved\n");
+
 	/* IMPLEMENT MERGING OF THE SORTED ARRAYS HERE. */
-	FILE *file;
-	file = fopen("result.txt", "w");
-		
-	int *indexesOfVectors = malloc(numbOfFiles * sizeof(int));
-	for (int i = 0; i < numbOfFiles; ++i) {
-		indexesOfVectors[i] = 0;
-	}
-	
-	int minInd = -1;
-	while (1) {
-		minInd = -1;
-		for (int i = 0; i < numbOfFiles; ++i) {
-			if (indexesOfVectors[i] == myVectors[i]->sz)
-				continue;
-			
-			if (minInd == -1 || myVectors[i]->arr[indexesOfVectors[i]] < myVectors[minInd]->arr[indexesOfVectors[minInd]])
-				minInd = i;
-		}
-		
-		if (minInd == -1)
-			break;
-		
-		fprintf(file, "%d ", myVectors[minInd]->arr[indexesOfVectors[minInd]]);
-		++ indexesOfVectors[minInd];
+	int rc = 0;
+	if (queryMode == QUERY_QUANTILES) {
+		TRACE_BEGIN(TRACE_MAIN_LANE, "quantiles");
+		rc = printQuantiles();
+		TRACE_END(TRACE_MAIN_LANE, "quantiles");
+	} else {
+		TRACE_BEGIN(TRACE_MAIN_LANE, "merge");
+		rc = mergeToFile("result.txt");
+		TRACE_END(TRACE_MAIN_LANE, "merge");
 	}
 
+	TRACE_BEGIN(TRACE_MAIN_LANE, "cleanup");
 	for (int i = 0; i < numbOfFiles; ++i) {
-		freeMyVector(myVectors[i]);
+		if (myVectors[i] != NULL)
+			freeMyVector(myVectors[i]);
 		free(fileNames[i]);
 	}
-
-	fclose(file);
 	free(myVectors);
 	free(fileNames);
-	free(indexesOfVectors);
-	return 0;
+	free(quantiles);
+	TRACE_END(TRACE_MAIN_LANE, "cleanup");
+	TRACE_DUMP();
+	return rc;
 }
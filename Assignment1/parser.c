@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parser.h"
+
+/** One byte range of the input and numbers parsed from it. */
+struct parse_range {
+	const char *begin;
+	const char *end;
+	int *arr;
+	size_t sz;
+	size_t max_sz;
+	/** True, if the range's memory allocation failed. */
+	bool is_failed;
+	pthread_t thread;
+};
+
+static inline bool
+parse_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static void
+parse_range_push(struct parse_range *r, int x)
+{
+	if (r->sz == r->max_sz) {
+		size_t new_max_sz = r->max_sz * 2;
+		int *new_arr = realloc(r->arr, new_max_sz * sizeof(int));
+		if (new_arr == NULL) {
+			r->is_failed = true;
+			return;
+		}
+		r->arr = new_arr;
+		r->max_sz = new_max_sz;
+	}
+	r->arr[r->sz++] = x;
+}
+
+/**
+ * Thread function. Each token is converted like atoi() does it:
+ * an optional sign, then digits until the first non-digit. The
+ * rest of the token is ignored.
+ */
+static void *
+parse_range_f(void *arg)
+{
+	struct parse_range *r = arg;
+	const char *pos = r->begin, *end = r->end;
+	/*
+	 * A guess of about 8 bytes per number with its separator, the
+	 * array grows in parse_range_push() if the numbers are shorter.
+	 */
+	r->max_sz = (end - pos) / 8 + 16;
+	r->arr = malloc(r->max_sz * sizeof(int));
+	if (r->arr == NULL) {
+		r->is_failed = true;
+		return NULL;
+	}
+	while (!r->is_failed) {
+		while (pos < end && parse_is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		bool is_negative = false;
+		if (*pos == '-' || *pos == '+') {
+			is_negative = *pos == '-';
+			++pos;
+		}
+		unsigned value = 0;
+		while (pos < end && *pos >= '0' && *pos <= '9')
+			value = value * 10 + (*pos++ - '0');
+		while (pos < end && !parse_is_space(*pos))
+			++pos;
+		parse_range_push(r, is_negative ? -value : value);
+	}
+	return NULL;
+}
+
+int
+parse_default_thread_count(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+int
+parse_buffer(const char *data, size_t size, int thread_count, int **out,
+	     size_t *count)
+{
+	size_t max_thread_count = size / PARSE_MIN_RANGE_SIZE + 1;
+	if (thread_count < 1)
+		thread_count = 1;
+	if ((size_t)thread_count > max_thread_count)
+		thread_count = max_thread_count;
+
+	struct parse_range *ranges = calloc(thread_count, sizeof(*ranges));
+	if (ranges == NULL)
+		return -1;
+	/* Move each border forward to a whitespace to keep tokens whole. */
+	const char *end = data + size;
+	const char *begin = data;
+	for (int i = 0; i < thread_count; ++i) {
+		const char *border = i == thread_count - 1 ? end :
+				     data + size / thread_count * (i + 1);
+		if (border < begin)
+			border = begin;
+		while (border < end && !parse_is_space(*border))
+			++border;
+		ranges[i].begin = begin;
+		ranges[i].end = border;
+		begin = border;
+	}
+
+	int started = 1;
+	for (; started < thread_count; ++started) {
+		if (pthread_create(&ranges[started].thread, NULL, parse_range_f,
+				   &ranges[started]) != 0)
+			break;
+	}
+	/* The calling thread parses the first range itself. */
+	parse_range_f(&ranges[0]);
+	/* Ranges, which didn't get a thread, are parsed here too. */
+	for (int i = started; i < thread_count; ++i)
+		parse_range_f(&ranges[i]);
+	for (int i = 1; i < started; ++i)
+		pthread_join(ranges[i].thread, NULL);
+
+	int rc = 0;
+	size_t total = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		if (ranges[i].is_failed)
+			rc = -1;
+		total += ranges[i].sz;
+	}
+	int *arr = NULL;
+	if (rc == 0) {
+		if (thread_count == 1) {
+			/* Nothing to concatenate - steal the array. */
+			arr = ranges[0].arr;
+			ranges[0].arr = NULL;
+		} else if ((arr = malloc((total + 1) * sizeof(int))) != NULL) {
+			size_t pos = 0;
+			for (int i = 0; i < thread_count; ++i) {
+				memcpy(arr + pos, ranges[i].arr,
+				       ranges[i].sz * sizeof(int));
+				pos += ranges[i].sz;
+			}
+		} else {
+			rc = -1;
+		}
+	}
+	for (int i = 0; i < thread_count; ++i)
+		free(ranges[i].arr);
+	free(ranges);
+	if (rc == 0) {
+		*out = arr;
+		*count = total;
+	}
+	return rc;
+}
+
+int
+parse_file(const char *path, int thread_count, int **out, size_t *count)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		*count = 0;
+		*out = malloc(sizeof(int));
+		return *out == NULL ? -1 : 0;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	int rc = parse_buffer(data, st.st_size, thread_count, out, count);
+	munmap(data, st.st_size);
+	return rc;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Parallel parser of files with whitespace separated integers.
+ * The file is mapped into memory and split into byte ranges
+ * aligned on whitespace. Each range is parsed by its own thread
+ * into its own array, then the arrays are concatenated.
+ */
+
+enum {
+	/**
+	 * Ranges smaller than this are not worth a thread. Small
+	 * files are parsed by the calling thread only.
+	 */
+	PARSE_MIN_RANGE_SIZE = 1024 * 1024,
+};
+
+/**
+ * Parse all the numbers from a file. Each whitespace separated
+ * token becomes one number, the same as atoi() of it would give.
+ * @param path File name.
+ * @param thread_count Maximal number of parsing threads. Less
+ *        can be used for small files.
+ * @param[out] out Newly allocated array of numbers. Should be
+ *        freed with free(). Not NULL even for an empty file.
+ * @param[out] count Number of elements in @a out.
+ *
+ * @retval 0 Success.
+ * @retval -1 The file can not be opened or mapped, or not
+ *         enough memory.
+ */
+int
+parse_file(const char *path, int thread_count, int **out, size_t *count);
+
+/**
+ * Parse numbers from a memory buffer. The same as parse_file(),
+ * but for already loaded data.
+ */
+int
+parse_buffer(const char *data, size_t size, int thread_count, int **out,
+	     size_t *count);
+
+/** Number of online CPUs, at least 1. */
+int
+parse_default_thread_count(void);
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "query.h"
+
+enum {
+	/** Smaller parts are finished with the insertion sort. */
+	QUERY_INSERTION_THRESHOLD = 16,
+};
+
+static inline void
+query_swap(int *a, int *b)
+{
+	int tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+query_insertion_sort(int *arr, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		int x = arr[i];
+		size_t j = i;
+		for (; j > 0 && arr[j - 1] > x; --j)
+			arr[j] = arr[j - 1];
+		arr[j] = x;
+	}
+}
+
+static void
+query_sift_down(int *arr, size_t count, size_t parent)
+{
+	while (true) {
+		size_t max_child = parent;
+		size_t left = 2 * parent + 1, right = left + 1;
+		if (left < count && arr[left] > arr[max_child])
+			max_child = left;
+		if (right < count && arr[right] > arr[max_child])
+			max_child = right;
+		if (max_child == parent)
+			return;
+		query_swap(&arr[parent], &arr[max_child]);
+		parent = max_child;
+	}
+}
+
+/** Fallback against quadratic partitioning, O(N * log(N)) always. */
+static void
+query_heap_sort(int *arr, size_t count)
+{
+	for (size_t i = count / 2; i > 0; --i)
+		query_sift_down(arr, count, i - 1);
+	for (size_t i = count; i > 1; --i) {
+		query_swap(&arr[0], &arr[i - 1]);
+		query_sift_down(arr, i - 1, 0);
+	}
+}
+
+/**
+ * Hoare partition around the median of three. Returns a split
+ * point s, 0 < s < count, such that arr[0, s) <= arr[s, count).
+ */
+static size_t
+query_partition(int *arr, size_t count)
+{
+	size_t mid = (count - 1) / 2;
+	if (arr[mid] < arr[0])
+		query_swap(&arr[mid], &arr[0]);
+	if (arr[count - 1] < arr[0])
+		query_swap(&arr[count - 1], &arr[0]);
+	if (arr[count - 1] < arr[mid])
+		query_swap(&arr[count - 1], &arr[mid]);
+	int pivot = arr[mid];
+	size_t i = 0, j = count - 1;
+	while (true) {
+		while (arr[i] < pivot)
+			++i;
+		while (arr[j] > pivot)
+			--j;
+		if (i >= j)
+			return j + 1;
+		query_swap(&arr[i++], &arr[j--]);
+	}
+}
+
+static int
+query_depth_limit(size_t count)
+{
+	int depth = 0;
+	for (; count > 1; count >>= 1)
+		depth += 2;
+	return depth;
+}
+
+static void
+query_intro_sort(int *arr, size_t count, int depth)
+{
+	while (count > QUERY_INSERTION_THRESHOLD) {
+		if (depth-- == 0) {
+			query_heap_sort(arr, count);
+			return;
+		}
+		size_t split = query_partition(arr, count);
+		/* Recurse into the smaller part to bound the stack. */
+		if (split < count - split) {
+			query_intro_sort(arr, split, depth);
+			arr += split;
+			count -= split;
+		} else {
+			query_intro_sort(arr + split, count - split, depth);
+			count = split;
+		}
+	}
+	query_insertion_sort(arr, count);
+}
+
+void
+query_sort(int *arr, size_t count)
+{
+	query_intro_sort(arr, count, query_depth_limit(count));
+}
+
+void
+query_select(int *arr, size_t count, size_t k)
+{
+	int depth = query_depth_limit(count);
+	while (count > QUERY_INSERTION_THRESHOLD) {
+		if (depth-- == 0) {
+			query_heap_sort(arr, count);
+			return;
+		}
+		size_t split = query_partition(arr, count);
+		if (k < split) {
+			count = split;
+		} else {
+			arr += split;
+			count -= split;
+			k -= split;
+		}
+	}
+	query_insertion_sort(arr, count);
+}
+
+size_t
+query_smallest(int *arr, size_t count, size_t k)
+{
+	if (k >= count) {
+		query_sort(arr, count);
+		return count;
+	}
+	if (k == 0)
+		return 0;
+	query_select(arr, count, k - 1);
+	query_sort(arr, k);
+	return k;
+}
+
+size_t
+query_range(int *arr, size_t count, int lo, int hi)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (arr[i] >= lo && arr[i] <= hi)
+			arr[kept++] = arr[i];
+	}
+	query_sort(arr, kept);
+	return kept;
+}
+
+void
+query_ranks(int *arr, size_t count, const size_t *ranks, int rank_count,
+	    int *out)
+{
+	/*
+	 * After a selection everything to the right of the rank is
+	 * not smaller, so the next bigger rank is searched only there.
+	 */
+	size_t base = 0;
+	for (int i = 0; i < rank_count; ++i) {
+		query_select(arr + base, count - base, ranks[i] - base);
+		out[i] = arr[ranks[i]];
+		base = ranks[i];
+	}
+}
+
+struct query_merge {
+	int **runs;
+	size_t *sizes;
+	/** Position of the next value in each run. */
+	size_t *pos;
+	/** Min-heap of run indexes, ordered by their next values. */
+	int *heap;
+	int heap_size;
+};
+
+static inline int
+query_merge_head(const struct query_merge *m, int run)
+{
+	return m->runs[run][m->pos[run]];
+}
+
+static void
+query_merge_sift_down(struct query_merge *m, int parent)
+{
+	while (true) {
+		int min_child = parent;
+		int left = 2 * parent + 1, right = left + 1;
+		if (left < m->heap_size &&
+		    query_merge_head(m, m->heap[left]) <
+		    query_merge_head(m, m->heap[min_child]))
+			min_child = left;
+		if (right < m->heap_size &&
+		    query_merge_head(m, m->heap[right]) <
+		    query_merge_head(m, m->heap[min_child]))
+			min_child = right;
+		if (min_child == parent)
+			return;
+		int tmp = m->heap[parent];
+		m->heap[parent] = m->heap[min_child];
+		m->heap[min_child] = tmp;
+		parent = min_child;
+	}
+}
+
+struct query_merge *
+query_merge_new(int **runs, const size_t *sizes, int run_count)
+{
+	struct query_merge *m = malloc(sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	m->runs = runs;
+	/* +1 to never ask malloc() for 0 bytes. */
+	m->sizes = malloc((run_count + 1) * sizeof(size_t));
+	m->pos = calloc(run_count + 1, sizeof(size_t));
+	m->heap = malloc((run_count + 1) * sizeof(int));
+	if (m->sizes == NULL || m->pos == NULL || m->heap == NULL) {
+		query_merge_delete(m);
+		return NULL;
+	}
+	m->heap_size = 0;
+	for (int i = 0; i < run_count; ++i) {
+		m->sizes[i] = sizes[i];
+		if (sizes[i] > 0)
+			m->heap[m->heap_size++] = i;
+	}
+	for (int i = m->heap_size / 2; i > 0; --i)
+		query_merge_sift_down(m, i - 1);
+	return m;
+}
+
+bool
+query_merge_next(struct query_merge *m, int *value)
+{
+	if (m->heap_size == 0)
+		return false;
+	int run = m->heap[0];
+	*value = m->runs[run][m->pos[run]++];
+	if (m->pos[run] == m->sizes[run])
+		m->heap[0] = m->heap[--m->heap_size];
+	query_merge_sift_down(m, 0);
+	return true;
+}
+
+void
+query_merge_delete(struct query_merge *m)
+{
+	free(m->sizes);
+	free(m->pos);
+	free(m->heap);
+	free(m);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Partial selection and lazy merging of the numbers. Used by the
+ * query modes, which need only the smallest K values, several
+ * quantiles or values from a range, and so don't have to sort
+ * and write everything.
+ */
+
+/** Sort an array in ascending order. Introsort, O(N * log(N)). */
+void
+query_sort(int *arr, size_t count);
+
+/**
+ * Reorder an array so that arr[k] is the value, which would be
+ * there after sorting. All values before it are not bigger, all
+ * after it are not smaller. Introselect, O(N).
+ */
+void
+query_select(int *arr, size_t count, size_t k);
+
+/**
+ * Move the @a k smallest values into the beginning of the array
+ * and sort them.
+ * @return Number of the values, min(k, count).
+ */
+size_t
+query_smallest(int *arr, size_t count, size_t k);
+
+/**
+ * Move the values from [@a lo, @a hi] into the beginning of the
+ * array and sort them.
+ * @return Number of such values.
+ */
+size_t
+query_range(int *arr, size_t count, int lo, int hi);
+
+/**
+ * Find values of several ranks. The array is reordered.
+ * @param ranks Ranks in ascending order, each < @a count.
+ * @param[out] out Value of each rank.
+ */
+void
+query_ranks(int *arr, size_t count, const size_t *ranks, int rank_count,
+	    int *out);
+
+/** Lazy k-way merge of sorted arrays. */
+struct query_merge;
+
+/**
+ * Start merging. The arrays are not copied and should live until
+ * the merge is deleted.
+ * @retval NULL No memory.
+ */
+struct query_merge *
+query_merge_new(int **runs, const size_t *sizes, int run_count);
+
+/**
+ * Get the next smallest value of all the arrays. O(log(run_count)).
+ * @retval true The value is returned.
+ * @retval false All the arrays are exhausted.
+ */
+bool
+query_merge_next(struct query_merge *m, int *value);
+
+void
+query_merge_delete(struct query_merge *m);
@@ -0,0 +1,126 @@
+#ifdef ENABLE_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+enum {
+	/** Events kept per thread. Older ones are overwritten. */
+	TRACE_RING_SIZE = 1 << 16,
+};
+
+struct trace_record {
+	/** Monotonic time in nanoseconds. */
+	int64_t ts;
+	const char *name;
+	int lane;
+	/** 'B'egin, 'E'nd or 'i'nstant. */
+	char phase;
+};
+
+/** Ring buffer of one thread. */
+struct trace_ring {
+	struct trace_record records[TRACE_RING_SIZE];
+	/** Total number of recorded events, not wrapped. */
+	uint64_t count;
+	/** Sequential number of the thread, used as "pid". */
+	int thread_id;
+	/** Rings are linked into a list to be found by dump. */
+	struct trace_ring *next;
+};
+
+static __thread struct trace_ring *trace_ring_this = NULL;
+static struct trace_ring *trace_ring_list = NULL;
+static int trace_thread_count = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Time of the first event, to make timestamps small. */
+static int64_t trace_start_ts = -1;
+
+static inline int64_t
+trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Create a ring of the current thread and register it. */
+static struct trace_ring *
+trace_ring_new(void)
+{
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_start_ts < 0)
+		trace_start_ts = trace_now();
+	ring->thread_id = trace_thread_count++;
+	ring->next = trace_ring_list;
+	trace_ring_list = ring;
+	pthread_mutex_unlock(&trace_mutex);
+	return ring;
+}
+
+void
+trace_event(int lane, const char *name, char phase)
+{
+	struct trace_ring *ring = trace_ring_this;
+	if (ring == NULL) {
+		ring = trace_ring_this = trace_ring_new();
+		if (ring == NULL)
+			return;
+	}
+	struct trace_record *r =
+		&ring->records[ring->count++ % TRACE_RING_SIZE];
+	r->ts = trace_now();
+	r->name = name;
+	r->lane = lane;
+	r->phase = phase;
+}
+
+int
+trace_dump(const char *path)
+{
+	if (path == NULL)
+		path = getenv("TRACE_FILE");
+	if (path == NULL)
+		path = "trace.json";
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		printf("> trace file %s didn't open correctly\n", path);
+		return -1;
+	}
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool is_first = true;
+	pthread_mutex_lock(&trace_mutex);
+	for (struct trace_ring *ring = trace_ring_list; ring != NULL;
+	     ring = ring->next) {
+		uint64_t begin = 0;
+		if (ring->count > TRACE_RING_SIZE)
+			begin = ring->count - TRACE_RING_SIZE;
+		for (uint64_t i = begin; i < ring->count; ++i) {
+			struct trace_record *r =
+				&ring->records[i % TRACE_RING_SIZE];
+			int64_t ts = r->ts - trace_start_ts;
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%lld.%03lld,\"pid\":%d,\"tid\":%d%s}",
+				is_first ? "" : ",\n", r->name, r->phase,
+				(long long)(ts / 1000), (long long)(ts % 1000),
+				ring->thread_id, r->lane,
+				r->phase == 'i' ? ",\"s\":\"t\"" : "");
+			is_first = false;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	printf("> trace is written to %s\n", path);
+	return 0;
+}
+
+#endif
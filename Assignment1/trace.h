@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * Phase-level tracing of the sort pipeline. Trace points are
+ * recorded into per-thread ring buffers and dumped in the Chrome
+ * trace-event JSON format, which can be opened in
+ * chrome://tracing, Perfetto or converted into a flame graph.
+ *
+ * Each event belongs to a lane - an integer which becomes a
+ * separate row ("tid") in the viewer. Coroutines use their own
+ * lanes, so their interleaving is visible.
+ *
+ * Tracing is compiled in only with ENABLE_TRACE defined (see
+ * 'make TRACE=1'). Otherwise all the macros below expand to no
+ * code and cost zero, only the lanes are evaluated, so variables
+ * kept for them are not unused.
+ */
+
+#ifdef ENABLE_TRACE
+
+/** Lane of the main() code, outside of any coroutine. */
+#define TRACE_MAIN_LANE 0
+
+/** Open a span named @a name on the lane @a lane. */
+#define TRACE_BEGIN(lane, name) trace_event((lane), (name), 'B')
+/** Close the last span named @a name on the lane @a lane. */
+#define TRACE_END(lane, name) trace_event((lane), (name), 'E')
+/** Mark a single moment on the lane @a lane. */
+#define TRACE_INSTANT(lane, name) trace_event((lane), (name), 'i')
+/**
+ * Write all the collected events into the file from TRACE_FILE
+ * environment variable, or into trace.json.
+ */
+#define TRACE_DUMP() trace_dump(NULL)
+
+/**
+ * Record one event into the ring buffer of the current thread.
+ * @a name has to be a string literal or any other string living
+ * until trace_dump().
+ */
+void
+trace_event(int lane, const char *name, char phase);
+
+/**
+ * Dump events of all threads as Chrome trace-event JSON. Should
+ * be called when no other thread is recording.
+ * @retval 0 Success.
+ * @retval -1 The file can not be written.
+ */
+int
+trace_dump(const char *path);
+
+#else
+
+#define TRACE_MAIN_LANE 0
+#define TRACE_BEGIN(lane, name) ((void)(lane))
+#define TRACE_END(lane, name) ((void)(lane))
+#define TRACE_INSTANT(lane, name) ((void)(lane))
+#define TRACE_DUMP() ((void)0)
+
+#endif
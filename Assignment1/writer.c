@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "writer.h"
+
+enum {
+	/** Alignment of the buffers, required by O_DIRECT. */
+	NUM_WRITER_ALIGN = 4096,
+	/** "-2147483648 " is the longest formatted number. */
+	NUM_WRITER_MAX_NUM_LEN = 12,
+};
+
+struct num_writer {
+	int fd;
+	/** True, if the file is opened with O_DIRECT. */
+	bool is_direct;
+	/** Two buffers - one is filled, another is flushed. */
+	char *buffers[2];
+	/** Index of the buffer being filled. */
+	int cur;
+	/** How many bytes are in the current buffer. */
+	size_t len;
+	/** File offset of the current buffer. */
+	off_t offset;
+
+	/** Background flusher and its synchronization. */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Buffer handed over to the flusher, or NULL. */
+	const char *pending;
+	size_t pending_len;
+	off_t pending_offset;
+	/** True, while a buffer is pending or being written. */
+	bool is_busy;
+	/** True, when the flusher should exit after pending work. */
+	bool is_closing;
+	/** True, if any of the writes failed. */
+	bool is_failed;
+};
+
+static const char num_writer_digits[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+/** Format "%d " into @a out, return the length. */
+static inline size_t
+num_writer_format(char *out, int x)
+{
+	char tmp[NUM_WRITER_MAX_NUM_LEN];
+	char *pos = tmp + sizeof(tmp);
+	unsigned u = x < 0 ? -(unsigned)x : (unsigned)x;
+	while (u >= 100) {
+		unsigned i = (u % 100) * 2;
+		u /= 100;
+		*--pos = num_writer_digits[i + 1];
+		*--pos = num_writer_digits[i];
+	}
+	if (u >= 10) {
+		*--pos = num_writer_digits[u * 2 + 1];
+		*--pos = num_writer_digits[u * 2];
+	} else {
+		*--pos = '0' + u;
+	}
+	if (x < 0)
+		*--pos = '-';
+	size_t len = tmp + sizeof(tmp) - pos;
+	memcpy(out, pos, len);
+	out[len] = ' ';
+	return len + 1;
+}
+
+static bool
+num_writer_write_all(int fd, const char *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t rc = pwrite(fd, buf, len, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += rc;
+		len -= rc;
+		offset += rc;
+	}
+	return true;
+}
+
+static void *
+num_writer_flusher_f(void *arg)
+{
+	struct num_writer *w = arg;
+	pthread_mutex_lock(&w->mutex);
+	while (true) {
+		while (w->pending == NULL && !w->is_closing)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (w->pending == NULL)
+			break;
+		const char *buf = w->pending;
+		size_t len = w->pending_len;
+		off_t offset = w->pending_offset;
+		w->pending = NULL;
+		pthread_mutex_unlock(&w->mutex);
+
+		bool is_ok = num_writer_write_all(w->fd, buf, len, offset);
+
+		pthread_mutex_lock(&w->mutex);
+		if (!is_ok)
+			w->is_failed = true;
+		w->is_busy = false;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+/** Wait until the flusher has nothing to do. */
+static void
+num_writer_wait(struct num_writer *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	while (w->is_busy)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * Hand @a len bytes of the current buffer over to the flusher.
+ * Waits for the previous buffer first, so after return the other
+ * buffer is free.
+ */
+static void
+num_writer_submit(struct num_writer *w, size_t len)
+{
+	pthread_mutex_lock(&w->mutex);
+	while (w->is_busy)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	w->pending = w->buffers[w->cur];
+	w->pending_len = len;
+	w->pending_offset = w->offset;
+	w->is_busy = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	w->offset += len;
+}
+
+/**
+ * Flush exactly one full buffer and move its tail into the other
+ * buffer. Full-sized flushes keep all writes aligned.
+ */
+static void
+num_writer_spill(struct num_writer *w)
+{
+	num_writer_submit(w, NUM_WRITER_BUFFER_SIZE);
+	size_t tail = w->len - NUM_WRITER_BUFFER_SIZE;
+	memcpy(w->buffers[1 - w->cur],
+	       w->buffers[w->cur] + NUM_WRITER_BUFFER_SIZE, tail);
+	w->cur = 1 - w->cur;
+	w->len = tail;
+}
+
+struct num_writer *
+num_writer_open(const char *path, int flags)
+{
+	struct num_writer *w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+	w->fd = -1;
+	if ((flags & NUM_WRITER_DIRECT) != 0) {
+		w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+			     0644);
+		w->is_direct = w->fd >= 0;
+	}
+	if (w->fd < 0)
+		w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0)
+		goto error;
+	for (int i = 0; i < 2; ++i) {
+		if (posix_memalign((void **)&w->buffers[i], NUM_WRITER_ALIGN,
+				   NUM_WRITER_BUFFER_SIZE +
+				   NUM_WRITER_MAX_NUM_LEN) != 0)
+			goto error;
+	}
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, num_writer_flusher_f, w) != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mutex);
+		goto error;
+	}
+	return w;
+error:
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->buffers[0]);
+	free(w->buffers[1]);
+	free(w);
+	return NULL;
+}
+
+void
+num_writer_put(struct num_writer *w, int x)
+{
+	w->len += num_writer_format(w->buffers[w->cur] + w->len, x);
+	if (w->len >= NUM_WRITER_BUFFER_SIZE)
+		num_writer_spill(w);
+}
+
+void
+num_writer_put_array(struct num_writer *w, const int *arr, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		w->len += num_writer_format(w->buffers[w->cur] + w->len,
+					    arr[i]);
+		if (w->len >= NUM_WRITER_BUFFER_SIZE)
+			num_writer_spill(w);
+	}
+}
+
+int
+num_writer_close(struct num_writer *w)
+{
+	if (w->len > 0) {
+		if (w->is_direct) {
+			/* The tail is not aligned, O_DIRECT won't take it. */
+			num_writer_wait(w);
+			int fl = fcntl(w->fd, F_GETFL);
+			if (fl < 0 || fcntl(w->fd, F_SETFL, fl & ~O_DIRECT) < 0)
+				w->is_failed = true;
+		}
+		num_writer_submit(w, w->len);
+	}
+	pthread_mutex_lock(&w->mutex);
+	w->is_closing = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->thread, NULL);
+
+	int rc = w->is_failed ? -1 : 0;
+	if (close(w->fd) != 0)
+		rc = -1;
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	free(w->buffers[0]);
+	free(w->buffers[1]);
+	free(w);
+	return rc;
+}
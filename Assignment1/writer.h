@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Buffered writer of numbers in the "%d " text format. Numbers are
+ * formatted into big aligned buffers, which are flushed with
+ * pwrite() by a background thread. There are two buffers, so
+ * formatting of one overlaps with flushing of another.
+ */
+
+enum {
+	/** Size of one buffer, multiple of any sane disk block. */
+	NUM_WRITER_BUFFER_SIZE = 1024 * 1024,
+};
+
+enum num_writer_flags {
+	/**
+	 * Try to bypass the page cache with O_DIRECT. If the file
+	 * system does not support it, the normal mode is used.
+	 */
+	NUM_WRITER_DIRECT = 1,
+};
+
+struct num_writer;
+
+/**
+ * Create or truncate the file @a path and start a writer to it.
+ * @param flags Bitwise combination of num_writer_flags.
+ * @retval NULL The file can not be opened, or no memory.
+ */
+struct num_writer *
+num_writer_open(const char *path, int flags);
+
+/** Append one number followed by a space. */
+void
+num_writer_put(struct num_writer *w, int x);
+
+/** Append all numbers of an array, each followed by a space. */
+void
+num_writer_put_array(struct num_writer *w, const int *arr, size_t count);
+
+/**
+ * Flush everything, close the file and free the writer.
+ * @retval 0 Success.
+ * @retval -1 Some of the writes failed.
+ */
+int
+num_writer_close(struct num_writer *w);
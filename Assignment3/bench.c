@@ -0,0 +1,1648 @@
+#include "userfs.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmarks of userfs. Usage:
+ *
+ *     ./bench open [max_files]
+ *     ./bench fd [pairs]
+ *     ./bench random [reads]
+ *     ./bench seq [size_mb]
+ *     ./bench mt [ops_per_thread]
+ *     ./bench view [size_mb]
+ *     ./bench image [path] [total_mb]
+ *     ./bench clone [size_mb]
+ *     ./bench dedup [files]
+ *     ./bench compress [files]
+ *     ./bench resize [cycles]
+ *     ./bench sparse [files]
+ *     ./bench vec [records]
+ *     ./bench ring [ops]
+ *     ./bench quota [files]
+ *     ./bench suite [size_mb] [--json]
+ *     ./bench dirs [files]
+ *     ./bench journal [records] [path]
+ *     ./bench small [size_mb]
+ *
+ * Each benchmark prints one line per configuration with the cost
+ * of one operation.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define bench_fail_if(cond) do {					\
+	if (cond) {							\
+		printf("Benchmark failed, line %d\n", __LINE__);	\
+		exit(-1);						\
+	}								\
+} while (0)
+
+/**
+ * Cost of open/close and delete/create of a random file versus
+ * the number of files in the namespace.
+ */
+static void
+bench_open(int max_files)
+{
+	const int ops = 100000;
+	char name[32];
+	for (int count = 1000; count <= max_files; count *= 10) {
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "file%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		srand(42);
+		double start = bench_now();
+		for (int i = 0; i < ops; ++i) {
+			sprintf(name, "file%d", rand() % count);
+			int fd = ufs_open(name, 0);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		double open_ns = (bench_now() - start) * 1e9 / ops;
+
+		start = bench_now();
+		for (int i = 0; i < ops; ++i) {
+			sprintf(name, "file%d", rand() % count);
+			bench_fail_if(ufs_delete(name) != 0);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		double delete_ns = (bench_now() - start) * 1e9 / ops;
+		printf("open files=%d open_close=%.0f ns delete_create=%.0f ns\n",
+		       count, open_ns, delete_ns);
+
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "file%d", i);
+			bench_fail_if(ufs_delete(name) != 0);
+		}
+	}
+}
+
+/**
+ * Cost of an open/close pair while thousands of other descriptors
+ * are kept opened, and of mass closes.
+ */
+static void
+bench_fd(int pairs)
+{
+	const int held_counts[] = {0, 1000, 10000, 100000};
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	bench_fail_if(ufs_close(fd) != 0);
+	for (size_t c = 0; c < sizeof(held_counts) / sizeof(held_counts[0]); ++c) {
+		int held = held_counts[c];
+		int *fds = malloc((held + 1) * sizeof(int));
+		for (int i = 0; i < held; ++i) {
+			fds[i] = ufs_open("file", 0);
+			bench_fail_if(fds[i] == -1);
+		}
+		double start = bench_now();
+		for (int i = 0; i < pairs; ++i) {
+			fd = ufs_open("file", 0);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		double pair_ns = (bench_now() - start) * 1e9 / pairs;
+
+		start = bench_now();
+		for (int i = 0; i < held; ++i)
+			bench_fail_if(ufs_close(fds[i]) != 0);
+		double close_ns = held > 0 ?
+				  (bench_now() - start) * 1e9 / held : 0;
+		printf("fd held=%d open_close=%.0f ns mass_close=%.0f ns\n",
+		       held, pair_ns, close_ns);
+		free(fds);
+	}
+	bench_fail_if(ufs_delete("file") != 0);
+}
+
+/** Random 4 KiB reads with ufs_pread() over files of several sizes. */
+static void
+bench_random(int reads)
+{
+	const int sizes_mb[] = {1, 10, 100};
+	const int chunk = 4096;
+	int buf_size = 1024 * 1024;
+	char *buf = malloc(buf_size);
+	memset(buf, 'a', buf_size);
+	for (size_t c = 0; c < sizeof(sizes_mb) / sizeof(sizes_mb[0]); ++c) {
+		int fd = ufs_open("file", UFS_CREATE);
+		bench_fail_if(fd == -1);
+		for (int i = 0; i < sizes_mb[c]; ++i)
+			bench_fail_if(ufs_write(fd, buf, buf_size) != buf_size);
+		size_t size = (size_t)sizes_mb[c] * buf_size;
+		srand(42);
+		double start = bench_now();
+		for (int i = 0; i < reads; ++i) {
+			size_t offset = (size_t)rand() % (size - chunk);
+			bench_fail_if(ufs_pread(fd, buf, chunk, offset) != chunk);
+		}
+		double t = bench_now() - start;
+		printf("random file=%d MB read=%.0f ns throughput=%.1f MB/s\n",
+		       sizes_mb[c], t * 1e9 / reads,
+		       (double)reads * chunk / 1e6 / t);
+		bench_fail_if(ufs_close(fd) != 0);
+		bench_fail_if(ufs_delete("file") != 0);
+	}
+	free(buf);
+}
+
+/** Bytes taken from malloc, including its own overhead. */
+static size_t
+bench_heap_size(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+/**
+ * Sequential write and read throughput of one big file with
+ * chunks of several sizes, and memory used per stored byte for a
+ * big file and for many small ones.
+ */
+static void
+bench_seq(int size_mb)
+{
+	const int chunks[] = {64, 4096, 65536, 1024 * 1024};
+	size_t size = (size_t)size_mb * 1024 * 1024;
+	char *buf = malloc(chunks[3]);
+	memset(buf, 'a', chunks[3]);
+	size_t heap = bench_heap_size();
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+		int chunk = chunks[c];
+		int fd = ufs_open("file", UFS_CREATE);
+		bench_fail_if(fd == -1);
+		double start = bench_now();
+		for (size_t done = 0; done < size; done += chunk)
+			bench_fail_if(ufs_write(fd, buf, chunk) != chunk);
+		double write_t = bench_now() - start;
+		double overhead = (double)(bench_heap_size() - heap) / size - 1;
+
+		bench_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		bench_fail_if(fd == -1);
+		start = bench_now();
+		for (size_t done = 0; done < size; done += chunk)
+			bench_fail_if(ufs_read(fd, buf, chunk) != chunk);
+		double read_t = bench_now() - start;
+		printf("seq file=%d MB chunk=%d write=%.0f MB/s read=%.0f MB/s "
+		       "overhead=%.2f%%\n", size_mb, chunk, size / 1e6 / write_t,
+		       size / 1e6 / read_t, overhead * 100);
+		bench_fail_if(ufs_close(fd) != 0);
+		bench_fail_if(ufs_delete("file") != 0);
+	}
+
+	const int file_count = 10000, file_sizes[] = {100, 4000};
+	char name[32];
+	for (size_t c = 0; c < sizeof(file_sizes) / sizeof(file_sizes[0]); ++c) {
+		heap = bench_heap_size();
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_write(fd, buf, file_sizes[c]) !=
+				      file_sizes[c]);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		printf("seq files=%d size=%d memory_per_file=%zu bytes\n",
+		       file_count, file_sizes[c],
+		       (bench_heap_size() - heap) / file_count);
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", i);
+			bench_fail_if(ufs_delete(name) != 0);
+		}
+	}
+	free(buf);
+}
+
+struct bench_mt_arg {
+	int id;
+	int ops;
+	bool is_writer;
+};
+
+enum {
+	BENCH_MT_FILE_SIZE = 64 * 1024 * 1024,
+	BENCH_MT_CHUNK = 4096,
+};
+
+static void *
+bench_mt_worker(void *p)
+{
+	struct bench_mt_arg *arg = p;
+	char name[32], buf[BENCH_MT_CHUNK];
+	memset(buf, 'a', sizeof(buf));
+	unsigned seed = arg->id;
+	if (arg->is_writer) {
+		sprintf(name, "writer%d", arg->id);
+		int fd = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fd == -1);
+		for (int i = 0; i < arg->ops; ++i) {
+			size_t offset = (size_t)rand_r(&seed) %
+					(BENCH_MT_FILE_SIZE / 4 / BENCH_MT_CHUNK) *
+					BENCH_MT_CHUNK;
+			bench_fail_if(ufs_pwrite(fd, buf, sizeof(buf), offset) !=
+				      sizeof(buf));
+		}
+		bench_fail_if(ufs_close(fd) != 0);
+		bench_fail_if(ufs_delete(name) != 0);
+	} else {
+		int fd = ufs_open("shared", 0);
+		bench_fail_if(fd == -1);
+		for (int i = 0; i < arg->ops; ++i) {
+			size_t offset = (size_t)rand_r(&seed) %
+					(BENCH_MT_FILE_SIZE - BENCH_MT_CHUNK);
+			bench_fail_if(ufs_pread(fd, buf, sizeof(buf), offset) !=
+				      sizeof(buf));
+		}
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	return NULL;
+}
+
+/**
+ * Aggregate throughput of random 4 KiB reads of one shared file,
+ * and of writes into a separate file per thread, versus the
+ * number of threads.
+ */
+static void
+bench_mt(int ops)
+{
+	const int thread_counts[] = {1, 2, 4, 8};
+	enum { MAX_THREADS = 8 };
+	int fd = ufs_open("shared", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	char *buf = malloc(1024 * 1024);
+	memset(buf, 'a', 1024 * 1024);
+	for (int i = 0; i < BENCH_MT_FILE_SIZE / (1024 * 1024); ++i)
+		bench_fail_if(ufs_write(fd, buf, 1024 * 1024) != 1024 * 1024);
+	free(buf);
+
+	for (int w = 0; w <= 1; ++w) {
+		for (size_t c = 0; c < sizeof(thread_counts) / sizeof(thread_counts[0]); ++c) {
+			int count = thread_counts[c];
+			pthread_t threads[MAX_THREADS];
+			struct bench_mt_arg args[MAX_THREADS];
+			double start = bench_now();
+			for (int i = 0; i < count; ++i) {
+				args[i] = (struct bench_mt_arg){i + 1, ops, w};
+				bench_fail_if(pthread_create(&threads[i], NULL,
+							     bench_mt_worker,
+							     &args[i]) != 0);
+			}
+			for (int i = 0; i < count; ++i)
+				bench_fail_if(pthread_join(threads[i], NULL) != 0);
+			double t = bench_now() - start;
+			printf("mt %s threads=%d throughput=%.0f MB/s "
+			       "ops=%.2f M/s\n", w ? "write_own" : "read_shared",
+			       count, (double)count * ops * BENCH_MT_CHUNK / 1e6 / t,
+			       count * ops / 1e6 / t);
+		}
+	}
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("shared") != 0);
+}
+
+/** Sum of words, cheap enough to not hide the cost of a copy. */
+static uint64_t
+bench_checksum(const char *data, size_t size, uint64_t sum)
+{
+	uint64_t words[4] = {0};
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		uint64_t block[4];
+		memcpy(block, data + i, 32);
+		for (int j = 0; j < 4; ++j)
+			words[j] += block[j];
+	}
+	sum += words[0] + words[1] + words[2] + words[3];
+	for (; i < size; ++i)
+		sum += (unsigned char)data[i];
+	return sum;
+}
+
+/**
+ * Sequential transfer of a big file in 1 MiB steps with copying
+ * ufs_read()/ufs_write() versus zero-copy views. The reader
+ * checksums the data, the writer generates it, as a consumer and
+ * a producer would.
+ */
+static void
+bench_view(int size_mb)
+{
+	const size_t step = 64 * 1024, size = (size_t)size_mb * step;
+	char *buf = malloc(step);
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	/* Allocate the blocks first, to compare only the transfers. */
+	memset(buf, 0, step);
+	for (size_t done = 0; done < size; done += step)
+		bench_fail_if(ufs_write(fd, buf, step) != (ssize_t)step);
+
+	double start = bench_now();
+	for (size_t done = 0; done < size; done += step) {
+		memset(buf, done / step, step);
+		bench_fail_if(ufs_pwrite(fd, buf, step, done) != (ssize_t)step);
+	}
+	double copy_write = bench_now() - start;
+
+	start = bench_now();
+	for (size_t done = 0; done < size; done += step) {
+		struct ufs_view *view;
+		bench_fail_if(ufs_view_reserve(fd, done, step, &view) !=
+			      (ssize_t)step);
+		int iovcnt;
+		const struct iovec *iov = ufs_view_iov(view, &iovcnt);
+		for (int i = 0; i < iovcnt; ++i)
+			memset(iov[i].iov_base, done / step, iov[i].iov_len);
+		bench_fail_if(ufs_view_commit(view, step) != 0);
+	}
+	double view_write = bench_now() - start;
+
+	uint64_t copy_sum = 0, view_sum = 0;
+	start = bench_now();
+	bench_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	for (size_t done = 0; done < size; done += step) {
+		bench_fail_if(ufs_read(fd, buf, step) != (ssize_t)step);
+		copy_sum = bench_checksum(buf, step, copy_sum);
+	}
+	double copy_read = bench_now() - start;
+
+	start = bench_now();
+	for (size_t done = 0; done < size; done += step) {
+		struct ufs_view *view;
+		bench_fail_if(ufs_view_read(fd, done, step, &view) !=
+			      (ssize_t)step);
+		int iovcnt;
+		const struct iovec *iov = ufs_view_iov(view, &iovcnt);
+		for (int i = 0; i < iovcnt; ++i)
+			view_sum = bench_checksum(iov[i].iov_base,
+						  iov[i].iov_len, view_sum);
+		ufs_view_release(view);
+	}
+	double view_read = bench_now() - start;
+	bench_fail_if(copy_sum != view_sum);
+
+	printf("view file=%d MB write: copy=%.0f MB/s view=%.0f MB/s\n",
+	       size_mb, size / 1e6 / copy_write, size / 1e6 / view_write);
+	printf("view file=%d MB read: copy=%.0f MB/s view=%.0f MB/s\n",
+	       size_mb, size / 1e6 / copy_read, size / 1e6 / view_read);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("file") != 0);
+	free(buf);
+}
+
+/**
+ * Restart time: rebuilding a namespace by writing all the files
+ * versus restoring it from an image, with and without reading
+ * the whole data afterwards.
+ */
+static void
+bench_image(const char *path, int total_mb)
+{
+	const int file_count = 1000;
+	const size_t file_size = (size_t)total_mb * 1024 * 1024 / file_count;
+	char name[32];
+	char *buf = malloc(file_size);
+	memset(buf, 'a', file_size);
+
+	double start = bench_now();
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fd == -1);
+		bench_fail_if(ufs_write(fd, buf, file_size) != (ssize_t)file_size);
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	double rebuild = bench_now() - start;
+
+	start = bench_now();
+	bench_fail_if(ufs_save(path) != 0);
+	double save = bench_now() - start;
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+
+	start = bench_now();
+	bench_fail_if(ufs_load(path) != 0);
+	double load = bench_now() - start;
+	/* The first request after the restart. */
+	int fd = ufs_open("file500", 0);
+	bench_fail_if(fd == -1);
+	bench_fail_if(ufs_read(fd, buf, 4096) != 4096);
+	bench_fail_if(ufs_close(fd) != 0);
+	double first_read = bench_now() - start;
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		fd = ufs_open(name, 0);
+		bench_fail_if(fd == -1);
+		bench_fail_if(ufs_read(fd, buf, file_size) != (ssize_t)file_size);
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	double full_read = bench_now() - start;
+
+	printf("image files=%d total=%d MB rebuild=%.1f ms save=%.1f ms\n",
+	       file_count, total_mb, rebuild * 1e3, save * 1e3);
+	printf("image load=%.2f ms load_first_read=%.2f ms "
+	       "load_read_all=%.1f ms\n", load * 1e3, first_read * 1e3,
+	       full_read * 1e3);
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+	remove(path);
+	free(buf);
+}
+
+/**
+ * Cost and memory of a clone versus a copy by read and write, of
+ * writes into a fresh clone, and of a snapshot of many files.
+ */
+static void
+bench_clone(int size_mb)
+{
+	const size_t step = 1024 * 1024, size = (size_t)size_mb * step;
+	const int clones = 100, writes = 1000;
+	char *buf = malloc(step);
+	memset(buf, 'a', step);
+	int fd = ufs_open("src", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	for (size_t done = 0; done < size; done += step)
+		bench_fail_if(ufs_write(fd, buf, step) != (ssize_t)step);
+
+	double start = bench_now();
+	int copy = ufs_open("copy", UFS_CREATE);
+	bench_fail_if(copy == -1);
+	for (size_t done = 0; done < size; done += step) {
+		bench_fail_if(ufs_pread(fd, buf, step, done) != (ssize_t)step);
+		bench_fail_if(ufs_write(copy, buf, step) != (ssize_t)step);
+	}
+	bench_fail_if(ufs_close(copy) != 0);
+	double copy_t = bench_now() - start;
+	bench_fail_if(ufs_delete("copy") != 0);
+
+	char name[32];
+	size_t heap = bench_heap_size();
+	start = bench_now();
+	for (int i = 0; i < clones; ++i) {
+		sprintf(name, "dst%d", i);
+		bench_fail_if(ufs_clone("src", name) != 0);
+	}
+	double clone_t = (bench_now() - start) / clones;
+	size_t clone_mem = (bench_heap_size() - heap) / clones;
+	for (int i = 0; i < clones; ++i) {
+		sprintf(name, "dst%d", i);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+	bench_fail_if(ufs_clone("src", "dst") != 0);
+	printf("clone file=%d MB copy=%.1f ms clone=%.1f us "
+	       "clone_memory=%zu bytes\n", size_mb, copy_t * 1e3,
+	       clone_t * 1e6, clone_mem);
+
+	/* The first write into a block copies it, the next ones don't. */
+	int dst = ufs_open("dst", 0);
+	bench_fail_if(dst == -1);
+	for (int pass = 0; pass < 2; ++pass) {
+		srand(42);
+		heap = bench_heap_size();
+		start = bench_now();
+		for (int i = 0; i < writes; ++i) {
+			size_t offset = (size_t)rand() % (size - 4096);
+			bench_fail_if(ufs_pwrite(dst, buf, 4096, offset) != 4096);
+		}
+		double t = (bench_now() - start) / writes;
+		printf("clone %s 4 KiB writes=%d write=%.1f us memory_growth=%.1f MB\n",
+		       pass == 0 ? "first" : "repeated", writes, t * 1e6,
+		       (double)(bench_heap_size() - heap) / step);
+	}
+	bench_fail_if(ufs_close(dst) != 0);
+	bench_fail_if(ufs_delete("dst") != 0);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("src") != 0);
+
+	const int file_count = 10000;
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fd == -1);
+		bench_fail_if(ufs_write(fd, buf, 10000) != 10000);
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	heap = bench_heap_size();
+	start = bench_now();
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	bench_fail_if(snap == NULL);
+	double snap_t = bench_now() - start;
+	printf("clone snapshot files=%d time=%.1f ms memory=%.1f MB "
+	       "data=%.1f MB\n", file_count, snap_t * 1e3,
+	       (double)(bench_heap_size() - heap) / step,
+	       (double)file_count * 10000 / step);
+	ufs_snapshot_delete(snap);
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+	free(buf);
+}
+
+/**
+ * Files of 4 MB sharing a 3 MB common part, written with and
+ * without deduplication: throughput, memory, dedup ratio and the
+ * cost of hashing.
+ */
+static void
+bench_dedup(int file_count)
+{
+	const size_t file_size = 4 * 1024 * 1024, common = 3 * 1024 * 1024;
+	const size_t chunk = 64 * 1024;
+	char *data = malloc(file_size);
+	char name[32];
+	for (size_t i = 0; i < file_size; ++i)
+		data[i] = (i * 7) % 251;
+	for (int is_on = 0; is_on <= 1; ++is_on) {
+		ufs_set_dedup(is_on);
+		struct ufs_dedup_stats before, after;
+		ufs_get_dedup_stats(&before);
+		size_t heap = bench_heap_size();
+		double start = bench_now();
+		for (int i = 0; i < file_count; ++i) {
+			/* The tail is unique per file. */
+			memset(data + common, i, sizeof(int));
+			sprintf(name, "file%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			for (size_t done = 0; done < file_size; done += chunk)
+				bench_fail_if(ufs_write(fd, data + done, chunk) !=
+					      (ssize_t)chunk);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		double t = bench_now() - start;
+		double memory = bench_heap_size() - heap;
+		ufs_get_dedup_stats(&after);
+		double logical = (double)file_count * file_size;
+		double hash_t = (after.hash_time_ns - before.hash_time_ns) / 1e9;
+		printf("dedup %s files=%d write=%.0f MB/s memory=%.1f MB "
+		       "ratio=%.2f\n", is_on ? "on" : "off", file_count,
+		       logical / 1e6 / t, memory / 1e6, logical / memory);
+		if (is_on) {
+			printf("dedup hashed=%.1f MB hash_speed=%.0f MB/s "
+			       "hash_share_of_write=%.0f%% duplicates=%zu\n",
+			       (after.bytes_hashed - before.bytes_hashed) / 1e6,
+			       (after.bytes_hashed - before.bytes_hashed) / 1e6 /
+			       hash_t, hash_t / t * 100,
+			       after.duplicates - before.duplicates);
+		}
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", i);
+			bench_fail_if(ufs_delete(name) != 0);
+		}
+	}
+	free(data);
+}
+
+static double
+bench_read_all(int file_count, char *buf, size_t file_size)
+{
+	char name[32];
+	double start = bench_now();
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		bench_fail_if(fd == -1);
+		bench_fail_if(ufs_read(fd, buf, file_size) != (ssize_t)file_size);
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	return bench_now() - start;
+}
+
+/**
+ * Memory and read cost of cold files compressed under a budget of
+ * a quarter of the data, versus the same files kept as is.
+ */
+static void
+bench_compress(int file_count)
+{
+	const size_t file_size = 4 * 1024 * 1024;
+	char *data = malloc(file_size), *buf = malloc(file_size);
+	char name[32];
+	/* Text-like: words from a small dictionary, in a random order. */
+	static const char *words[] = {"userfs ", "block ", "file ",
+		"descriptor ", "memory ", "budget ", "read ", "write "};
+	uint64_t seed = 1;
+	for (size_t i = 0; i < file_size;) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		const char *w = words[seed >> 61];
+		for (; *w != 0 && i < file_size; ++w)
+			data[i++] = *w;
+	}
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fd == -1);
+		memcpy(data, &i, sizeof(i));
+		bench_fail_if(ufs_write(fd, data, file_size) != (ssize_t)file_size);
+		bench_fail_if(ufs_close(fd) != 0);
+	}
+	double logical = (double)file_count * file_size;
+	struct ufs_compression_stats before, after;
+	ufs_get_compression_stats(&before);
+	double hot = bench_read_all(file_count, buf, file_size);
+	printf("compress off memory=%.1f MB read=%.0f MB/s\n",
+	       before.memory_used / 1e6, logical / 1e6 / hot);
+
+	double start = bench_now();
+	ufs_set_memory_budget(file_count * file_size / 4);
+	double t = bench_now() - start;
+	ufs_get_compression_stats(&after);
+	size_t packed = after.compressed_bytes - before.compressed_bytes;
+	size_t original = after.original_bytes - before.original_bytes;
+	printf("compress on budget=%.1f MB memory=%.1f MB packed=%.1f MB "
+	       "ratio=%.2f compress=%.0f MB/s\n",
+	       file_count * file_size / 4 / 1e6,
+	       (after.memory_used + packed) / 1e6, packed / 1e6,
+	       (double)original / packed, original / 1e6 / t);
+
+	/* Each read unpacks a file, each close packs the coldest one. */
+	ufs_get_compression_stats(&before);
+	double cold = bench_read_all(file_count, buf, file_size);
+	ufs_get_compression_stats(&after);
+	size_t blocks = after.decompressions - before.decompressions;
+	double unpack_t = (after.decompress_time_ns -
+			   before.decompress_time_ns) / 1e9;
+	printf("compress cold read=%.0f MB/s (%.1fx slower) "
+	       "unpacked_blocks=%zu unpack=%.0f MB/s\n",
+	       logical / 1e6 / cold, cold / hot, blocks,
+	       blocks > 0 ? logical / 1e6 / unpack_t : 0.0);
+
+	ufs_set_memory_budget(0);
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+	free(data);
+	free(buf);
+}
+
+/**
+ * Grow/shrink cycles of a 100 MiB file with ufs_resize(), versus
+ * growth by writing zeros and shrink by recreation of the file.
+ */
+static void
+bench_resize(int cycles)
+{
+	const size_t size = 100 * 1024 * 1024, chunk = 1024 * 1024;
+	char *zeros = calloc(1, chunk);
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	double grow = 0, shrink = 0;
+	for (int i = 0; i < cycles; ++i) {
+		double start = bench_now();
+		for (size_t done = 0; done < size; done += chunk)
+			bench_fail_if(ufs_write(fd, zeros, chunk) != (ssize_t)chunk);
+		grow += bench_now() - start;
+		start = bench_now();
+		bench_fail_if(ufs_close(fd) != 0);
+		bench_fail_if(ufs_delete("file") != 0);
+		fd = ufs_open("file", UFS_CREATE);
+		bench_fail_if(fd == -1);
+		shrink += bench_now() - start;
+	}
+	printf("resize write grow=%.2f ms shrink=%.2f ms\n",
+	       grow * 1e3 / cycles, shrink * 1e3 / cycles);
+	/* Other descriptors are clamped on shrink. */
+	int others[16];
+	for (int i = 0; i < 16; ++i) {
+		others[i] = ufs_open("file", 0);
+		bench_fail_if(others[i] == -1);
+	}
+	grow = shrink = 0;
+	for (int i = 0; i < cycles; ++i) {
+		double start = bench_now();
+		bench_fail_if(ufs_resize(fd, size) != 0);
+		grow += bench_now() - start;
+		start = bench_now();
+		bench_fail_if(ufs_resize(fd, 0) != 0);
+		shrink += bench_now() - start;
+	}
+	printf("resize ufs_resize grow=%.2f ms shrink=%.2f ms "
+	       "descriptors=17\n", grow * 1e3 / cycles,
+	       shrink * 1e3 / cycles);
+	for (int i = 0; i < 16; ++i)
+		bench_fail_if(ufs_close(others[i]) != 0);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("file") != 0);
+	free(zeros);
+}
+
+/**
+ * Memory of files reserved with ufs_resize() to 64 MiB or by a
+ * write at 64 MiB, and filled by 1 MiB only.
+ */
+static void
+bench_sparse(int file_count)
+{
+	const size_t reserve = 64 * 1024 * 1024, used = 1024 * 1024;
+	char *data = malloc(used);
+	char name[32];
+	memset(data, 'x', used);
+	for (int by_write = 0; by_write <= 1; ++by_write) {
+		size_t heap = bench_heap_size();
+		struct ufs_file_stats total = {0, 0, 0}, stats;
+		double start = bench_now();
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			if (by_write)
+				bench_fail_if(ufs_pwrite(fd, "x", 1, reserve - 1) != 1);
+			else
+				bench_fail_if(ufs_resize(fd, reserve) != 0);
+			bench_fail_if(ufs_pwrite(fd, data, used, 0) != (ssize_t)used);
+			bench_fail_if(ufs_file_stats(fd, &stats) != 0);
+			total.logical_bytes += stats.logical_bytes;
+			total.physical_bytes += stats.physical_bytes;
+			total.hole_bytes += stats.hole_bytes;
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		double t = bench_now() - start;
+		printf("sparse %s files=%d time_per_file=%.1f us logical=%.0f MB "
+		       "physical=%.1f MB holes=%.0f MB heap=%.1f MB\n",
+		       by_write ? "far_write" : "resize", file_count,
+		       t * 1e6 / file_count, total.logical_bytes / 1e6,
+		       total.physical_bytes / 1e6, total.hole_bytes / 1e6,
+		       (bench_heap_size() - heap) / 1e6);
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", i);
+			bench_fail_if(ufs_delete(name) != 0);
+		}
+	}
+	free(data);
+}
+
+/**
+ * Small records written and read one per call with ufs_pwrite()/
+ * ufs_pread(), versus batches of one ufs_pwritev()/ufs_preadv().
+ */
+static void
+bench_vec(int records)
+{
+	enum { REC = 64, BATCH = 64 };
+	char data[BATCH][REC], out[BATCH][REC];
+	struct iovec iov[BATCH], iov_out[BATCH];
+	for (int i = 0; i < BATCH; ++i) {
+		memset(data[i], 'a' + i % 26, REC);
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = REC;
+		iov_out[i].iov_base = out[i];
+		iov_out[i].iov_len = REC;
+	}
+	records -= records % BATCH;
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	double start = bench_now();
+	for (int i = 0; i < records; ++i)
+		bench_fail_if(ufs_pwrite(fd, data[i % BATCH], REC,
+					 (size_t)i * REC) != REC);
+	double write1 = bench_now() - start;
+	start = bench_now();
+	for (int i = 0; i < records; ++i)
+		bench_fail_if(ufs_pread(fd, out[i % BATCH], REC,
+					(size_t)i * REC) != REC);
+	double read1 = bench_now() - start;
+	start = bench_now();
+	for (int i = 0; i < records; i += BATCH)
+		bench_fail_if(ufs_pwritev(fd, iov, BATCH, (size_t)i * REC) !=
+			      BATCH * REC);
+	double writev = bench_now() - start;
+	start = bench_now();
+	for (int i = 0; i < records; i += BATCH)
+		bench_fail_if(ufs_preadv(fd, iov_out, BATCH, (size_t)i * REC) !=
+			      BATCH * REC);
+	double readv = bench_now() - start;
+	printf("vec records=%d size=%d single: write=%.0f ns read=%.0f ns, "
+	       "batch of %d: write=%.0f ns read=%.0f ns per record\n",
+	       records, REC, write1 * 1e9 / records, read1 * 1e9 / records,
+	       BATCH, writev * 1e9 / records, readv * 1e9 / records);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("file") != 0);
+}
+
+/** Write or read @a ops records by a ring, in batches. */
+static double
+bench_ring_run(struct ufs_ring *ring, int fd, enum ufs_ring_op op,
+	       char *rec, size_t size, int ops, int batch)
+{
+	struct ufs_cqe cqes[256];
+	double start = bench_now();
+	for (int done = 0; done < ops; done += batch) {
+		for (int i = 0; i < batch; ++i) {
+			struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+			bench_fail_if(sqe == NULL);
+			sqe->op = op;
+			sqe->fd = fd;
+			sqe->buf = rec;
+			sqe->size = size;
+		}
+		bench_fail_if(ufs_ring_submit(ring) != (unsigned)batch);
+		for (int got = 0; got < batch;) {
+			unsigned n = ufs_ring_wait(ring, cqes, 256, batch - got);
+			for (unsigned i = 0; i < n; ++i)
+				bench_fail_if(cqes[i].result != (ssize_t)size);
+			got += n;
+		}
+	}
+	return bench_now() - start;
+}
+
+/**
+ * Throughput of 64 byte writes and reads by the synchronous API,
+ * versus batches of 64 by a ring executed inline and by a thread.
+ */
+static void
+bench_ring(int ops)
+{
+	enum { REC = 64, BATCH = 64 };
+	char rec[REC];
+	memset(rec, 'x', REC);
+	ops -= ops % BATCH;
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	double start = bench_now();
+	for (int i = 0; i < ops; ++i)
+		bench_fail_if(ufs_write(fd, rec, REC) != REC);
+	double write_t = bench_now() - start;
+	bench_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	start = bench_now();
+	for (int i = 0; i < ops; ++i)
+		bench_fail_if(ufs_read(fd, rec, REC) != REC);
+	double read_t = bench_now() - start;
+	printf("ring sync write=%.1f Mops/s read=%.1f Mops/s\n",
+	       ops / write_t / 1e6, ops / read_t / 1e6);
+	for (int is_threaded = 0; is_threaded <= 1; ++is_threaded) {
+		struct ufs_ring *ring = ufs_ring_new(BATCH, is_threaded);
+		bench_fail_if(ring == NULL);
+		bench_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+		write_t = bench_ring_run(ring, fd, UFS_OP_WRITE, rec, REC,
+					 ops, BATCH);
+		bench_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+		read_t = bench_ring_run(ring, fd, UFS_OP_READ, rec, REC,
+					ops, BATCH);
+		printf("ring %s batch=%d write=%.1f Mops/s read=%.1f Mops/s\n",
+		       is_threaded ? "thread" : "inline", BATCH,
+		       ops / write_t / 1e6, ops / read_t / 1e6);
+		ufs_ring_delete(ring);
+	}
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("file") != 0);
+}
+
+/** Cache of closed files, the oldest is evicted first. */
+struct bench_cache {
+	int head;
+	int tail;
+};
+
+static void
+bench_cache_evict(size_t need, void *ctx)
+{
+	struct bench_cache *cache = ctx;
+	char name[32];
+	/* Free a bit more than needed, so evictions are not per write. */
+	for (size_t freed = 0; freed <= need && cache->head != cache->tail;
+	     freed += 1024 * 1024) {
+		sprintf(name, "file%d", cache->head++);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+}
+
+/**
+ * A cache of files of 1 MiB written without a limit, versus under
+ * ufs_set_quota() of 64 MiB with the oldest files evicted by the
+ * handler. And the cost of small file create/write/delete, which
+ * is charged and uncharged on each step.
+ */
+static void
+bench_quota(int file_count)
+{
+	const size_t size = 1024 * 1024;
+	char *data = malloc(size);
+	char name[32];
+	memset(data, 'x', size);
+	for (int is_limited = 0; is_limited <= 1; ++is_limited) {
+		struct bench_cache cache = {0, 0};
+		if (is_limited)
+			ufs_set_quota(64 * size, bench_cache_evict, &cache);
+		struct ufs_memory_stats before, after;
+		ufs_get_memory_stats(&before);
+		double start = bench_now();
+		for (int i = 0; i < file_count; ++i) {
+			sprintf(name, "file%d", cache.tail);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_write(fd, data, size) != (ssize_t)size);
+			bench_fail_if(ufs_close(fd) != 0);
+			++cache.tail;
+		}
+		double t = bench_now() - start;
+		ufs_get_memory_stats(&after);
+		printf("quota %s files=%d time_per_file=%.1f us used=%.1f MB "
+		       "metadata=%.1f KB evictions=%zu failures=%zu\n",
+		       is_limited ? "64MB" : "none", file_count,
+		       t * 1e6 / file_count, after.used / 1e6,
+		       after.metadata_bytes / 1e3,
+		       after.evictions - before.evictions,
+		       after.quota_failures - before.quota_failures);
+		ufs_set_quota(0, NULL, NULL);
+		bench_cache_evict(SIZE_MAX - 1, &cache);
+	}
+	const int ops = 100000;
+	for (int is_limited = 0; is_limited <= 1; ++is_limited) {
+		ufs_set_quota(is_limited ? 64 * size : 0, NULL, NULL);
+		double start = bench_now();
+		for (int i = 0; i < ops; ++i) {
+			int fd = ufs_open("small", UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_write(fd, data, 100) != 100);
+			bench_fail_if(ufs_close(fd) != 0);
+			bench_fail_if(ufs_delete("small") != 0);
+		}
+		double t = bench_now() - start;
+		printf("quota small_file %s time_per_cycle=%.1f ns\n",
+		       is_limited ? "64MB" : "none", t * 1e9 / ops);
+	}
+	ufs_set_quota(0, NULL, NULL);
+	free(data);
+}
+
+/** Latencies of the operations of one suite case. */
+struct bench_lat {
+	uint64_t *ns;
+	size_t count;
+	size_t capacity;
+};
+
+struct bench_suite {
+	bool is_json;
+	int case_count;
+	struct bench_lat lat;
+	/** Start of the current case. */
+	double start;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_lat_add(struct bench_lat *lat, uint64_t ns)
+{
+	if (lat->count == lat->capacity) {
+		lat->capacity = lat->capacity ? lat->capacity * 2 : 1024;
+		lat->ns = realloc(lat->ns, lat->capacity * sizeof(*lat->ns));
+		bench_fail_if(lat->ns == NULL);
+	}
+	lat->ns[lat->count++] = ns;
+}
+
+static int
+bench_lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Nearest-rank percentile of sorted latencies. */
+static uint64_t
+bench_lat_percentile(const struct bench_lat *lat, double p)
+{
+	size_t rank = (size_t)(p * lat->count + 0.999999);
+	return lat->ns[rank > 0 ? rank - 1 : 0];
+}
+
+/** Run @a op, adding its latency to the current case. */
+#define bench_timed(suite, op) do {					\
+	uint64_t bench_t0 = bench_now_ns();				\
+	op;								\
+	bench_lat_add(&(suite)->lat, bench_now_ns() - bench_t0);	\
+} while (0)
+
+static void
+bench_suite_begin(struct bench_suite *suite)
+{
+	suite->lat.count = 0;
+	suite->start = bench_now();
+}
+
+/**
+ * Print the case started by bench_suite_begin(), which moved
+ * @a bytes of data, 0 if it is not about data.
+ */
+static void
+bench_suite_end(struct bench_suite *suite, const char *name, size_t bytes)
+{
+	double t = bench_now() - suite->start;
+	struct bench_lat *lat = &suite->lat;
+	bench_fail_if(lat->count == 0);
+	qsort(lat->ns, lat->count, sizeof(*lat->ns), bench_lat_cmp);
+	double ops = lat->count / t, mbs = bytes / 1e6 / t;
+	uint64_t p50 = bench_lat_percentile(lat, 0.5);
+	uint64_t p99 = bench_lat_percentile(lat, 0.99);
+	uint64_t p999 = bench_lat_percentile(lat, 0.999);
+	uint64_t max = lat->ns[lat->count - 1];
+	if (suite->is_json) {
+		printf("%s\n    {\"name\": \"%s\", \"ops\": %zu, "
+		       "\"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+		       "\"mb_per_sec\": %.1f, \"p50_ns\": %llu, "
+		       "\"p99_ns\": %llu, \"p999_ns\": %llu, "
+		       "\"max_ns\": %llu}", suite->case_count ? "," : "",
+		       name, lat->count, t, ops, mbs,
+		       (unsigned long long)p50, (unsigned long long)p99,
+		       (unsigned long long)p999, (unsigned long long)max);
+	} else {
+		printf("suite %-20s ops=%-8zu ops/s=%-10.0f MB/s=%-8.1f "
+		       "p50=%llu p99=%llu p999=%llu max=%llu ns\n", name,
+		       lat->count, ops, mbs, (unsigned long long)p50,
+		       (unsigned long long)p99, (unsigned long long)p999,
+		       (unsigned long long)max);
+	}
+	++suite->case_count;
+}
+
+static void
+bench_suite_seq(struct bench_suite *suite, size_t size, char *buf)
+{
+	const int chunks[] = {64, 4096, 65536, 1024 * 1024};
+	char name[32];
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+		int chunk = chunks[c];
+		int fd = ufs_open("file", UFS_CREATE);
+		bench_fail_if(fd == -1);
+		ssize_t rc;
+		bench_suite_begin(suite);
+		for (size_t done = 0; done < size; done += chunk) {
+			bench_timed(suite, rc = ufs_write(fd, buf, chunk));
+			bench_fail_if(rc != chunk);
+		}
+		sprintf(name, "seq_write_%d", chunk);
+		bench_suite_end(suite, name, size);
+		bench_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+		bench_suite_begin(suite);
+		for (size_t done = 0; done < size; done += chunk) {
+			bench_timed(suite, rc = ufs_read(fd, buf, chunk));
+			bench_fail_if(rc != chunk);
+		}
+		sprintf(name, "seq_read_%d", chunk);
+		bench_suite_end(suite, name, size);
+		bench_fail_if(ufs_close(fd) != 0);
+		bench_fail_if(ufs_delete("file") != 0);
+	}
+}
+
+static void
+bench_suite_files(struct bench_suite *suite, char *buf)
+{
+	const int ops = 100000, file_count = 10000, small = 1024;
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	bench_fail_if(ufs_write(fd, buf, 4096) != 4096);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_suite_begin(suite);
+	for (int i = 0; i < ops; ++i) {
+		int rc;
+		bench_timed(suite, fd = ufs_open("file", 0);
+			    rc = ufs_close(fd));
+		bench_fail_if(fd == -1 || rc != 0);
+	}
+	bench_suite_end(suite, "open_close", 0);
+
+	/* The opened copy lives on, a new file takes the name. */
+	bench_suite_begin(suite);
+	for (int i = 0; i < file_count; ++i) {
+		int copy, rc;
+		ssize_t bytes;
+		bench_timed(suite, copy = ufs_open("file", 0);
+			    rc = ufs_delete("file");
+			    fd = ufs_open("file", UFS_CREATE);
+			    bytes = ufs_pread(copy, buf, 4096, 0) +
+				    ufs_write(fd, buf, 4096);
+			    rc |= ufs_close(copy) | ufs_close(fd));
+		bench_fail_if(copy == -1 || fd == -1 || rc != 0 ||
+			      bytes != 8192);
+	}
+	bench_suite_end(suite, "delete_while_open", 0);
+	bench_fail_if(ufs_delete("file") != 0);
+
+	char name[32];
+	bench_suite_begin(suite);
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		ssize_t bytes;
+		int rc;
+		bench_timed(suite, fd = ufs_open(name, UFS_CREATE);
+			    bytes = ufs_write(fd, buf, small);
+			    rc = ufs_close(fd));
+		bench_fail_if(fd == -1 || bytes != small || rc != 0);
+	}
+	bench_suite_end(suite, "create_small", (size_t)file_count * small);
+	bench_suite_begin(suite);
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		int rc;
+		bench_timed(suite, rc = ufs_delete(name));
+		bench_fail_if(rc != 0);
+	}
+	bench_suite_end(suite, "delete_small", 0);
+}
+
+/** 4 KiB writes and reads going round-robin over 8 descriptors. */
+static void
+bench_suite_interleaved(struct bench_suite *suite, size_t size, char *buf)
+{
+	enum { FILE_COUNT = 8, CHUNK = 4096 };
+	int fds[FILE_COUNT];
+	char name[32];
+	for (int i = 0; i < FILE_COUNT; ++i) {
+		sprintf(name, "file%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fds[i] == -1);
+	}
+	size_t steps = size / FILE_COUNT / CHUNK;
+	ssize_t rc;
+	bench_suite_begin(suite);
+	for (size_t s = 0; s < steps; ++s) {
+		for (int i = 0; i < FILE_COUNT; ++i) {
+			bench_timed(suite, rc = ufs_write(fds[i], buf, CHUNK));
+			bench_fail_if(rc != CHUNK);
+		}
+	}
+	bench_suite_end(suite, "interleaved_write", steps * FILE_COUNT * CHUNK);
+	for (int i = 0; i < FILE_COUNT; ++i)
+		bench_fail_if(ufs_seek(fds[i], 0, UFS_SEEK_SET) != 0);
+	bench_suite_begin(suite);
+	for (size_t s = 0; s < steps; ++s) {
+		for (int i = 0; i < FILE_COUNT; ++i) {
+			bench_timed(suite, rc = ufs_read(fds[i], buf, CHUNK));
+			bench_fail_if(rc != CHUNK);
+		}
+	}
+	bench_suite_end(suite, "interleaved_read", steps * FILE_COUNT * CHUNK);
+	for (int i = 0; i < FILE_COUNT; ++i) {
+		sprintf(name, "file%d", i);
+		bench_fail_if(ufs_close(fds[i]) != 0);
+		bench_fail_if(ufs_delete(name) != 0);
+	}
+}
+
+/**
+ * The common workloads with throughput and p50/p99/p999 latency
+ * of single calls, as text or JSON, to compare builds. A latency
+ * includes a clock read, ~20 ns.
+ */
+static void
+bench_suite(int size_mb, bool is_json)
+{
+	size_t size = (size_t)size_mb * 1024 * 1024;
+	char *buf = malloc(1024 * 1024);
+	memset(buf, 'a', 1024 * 1024);
+	struct bench_suite suite = {is_json, 0, {NULL, 0, 0}, 0};
+	if (is_json)
+		printf("{\"benchmark\": \"suite\", \"size_mb\": %d, "
+		       "\"results\": [", size_mb);
+	bench_suite_seq(&suite, size, buf);
+	bench_suite_files(&suite, buf);
+	bench_suite_interleaved(&suite, size, buf);
+	if (is_json)
+		printf("\n]}\n");
+	free(suite.lat.ns);
+	free(buf);
+}
+
+static int
+bench_dirs_match(const char *filename, void *ctx)
+{
+	int *count = ctx;
+	*count += strncmp(filename, "dir0/", 5) == 0;
+	return 0;
+}
+
+/**
+ * Cost of path lookup versus depth, and of listing and moving a
+ * directory of 100 files while the namespace has @a file_count
+ * files in directories of 100.
+ */
+static void
+bench_dirs(int file_count)
+{
+	enum { DEPTH = 16, PER_DIR = 100 };
+	const int ops = 1000000;
+	char path[256] = "";
+	char name[300];
+	for (int d = 1; d <= DEPTH; ++d) {
+		sprintf(path + strlen(path), "%sd%d", d > 1 ? "/" : "", d);
+		bench_fail_if(ufs_mkdir(path) != 0);
+		sprintf(name, "%s/file", path);
+		int fd = ufs_open(name, UFS_CREATE);
+		bench_fail_if(fd == -1);
+		bench_fail_if(ufs_close(fd) != 0);
+		if (d != 1 && d != 4 && d != DEPTH)
+			continue;
+		double start = bench_now();
+		for (int i = 0; i < ops; ++i) {
+			fd = ufs_open(name, 0);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+		printf("dirs depth=%d open_close=%.0f ns\n", d,
+		       (bench_now() - start) * 1e9 / ops);
+	}
+
+	int dir_count = file_count / PER_DIR;
+	for (int i = 0; i < dir_count; ++i) {
+		sprintf(path, "dir%d", i);
+		bench_fail_if(ufs_mkdir(path) != 0);
+		for (int j = 0; j < PER_DIR; ++j) {
+			sprintf(name, "dir%d/file%d", i, j);
+			int fd = ufs_open(name, UFS_CREATE);
+			bench_fail_if(fd == -1);
+			bench_fail_if(ufs_close(fd) != 0);
+		}
+	}
+	const int lists = 10000;
+	double start = bench_now();
+	for (int i = 0; i < lists; ++i) {
+		struct ufs_dir *dir = ufs_opendir("dir0");
+		bench_fail_if(dir == NULL);
+		int count = 0;
+		while (ufs_readdir(dir) != NULL)
+			++count;
+		bench_fail_if(count != PER_DIR);
+		ufs_closedir(dir);
+	}
+	double list_t = (bench_now() - start) / lists;
+	/* Listing by a scan of all paths, like without directories. */
+	start = bench_now();
+	int count = 0;
+	ufs_list(bench_dirs_match, &count);
+	bench_fail_if(count != PER_DIR);
+	double scan_t = bench_now() - start;
+	start = bench_now();
+	for (int i = 0; i < lists; ++i) {
+		sprintf(path, "moved%d", i);
+		bench_fail_if(ufs_rename(i ? name : "dir0", path) != 0);
+		strcpy(name, path);
+	}
+	double rename_t = (bench_now() - start) / lists;
+	printf("dirs files=%d list_100=%.1f us scan_all=%.1f us "
+	       "rename_dir_100=%.1f us\n", dir_count * PER_DIR,
+	       list_t * 1e6, scan_t * 1e6, rename_t * 1e6);
+	bench_fail_if(ufs_rename(name, "dir0") != 0);
+
+	for (int i = 0; i < dir_count; ++i) {
+		for (int j = 0; j < PER_DIR; ++j) {
+			sprintf(name, "dir%d/file%d", i, j);
+			bench_fail_if(ufs_delete(name) != 0);
+		}
+		sprintf(path, "dir%d", i);
+		bench_fail_if(ufs_rmdir(path) != 0);
+	}
+	/* The chain goes away from the deepest directory. */
+	sprintf(path, "d1");
+	for (int d = 2; d <= DEPTH; ++d)
+		sprintf(path + strlen(path), "/d%d", d);
+	for (int d = DEPTH; d >= 1; --d) {
+		sprintf(name, "%s/file", path);
+		bench_fail_if(ufs_delete(name) != 0);
+		bench_fail_if(ufs_rmdir(path) != 0);
+		if (d > 1)
+			*strrchr(path, '/') = 0;
+	}
+}
+
+struct bench_journal_arg {
+	int fd;
+	int id;
+	int ops;
+	size_t size;
+};
+
+static void *
+bench_journal_worker(void *p)
+{
+	struct bench_journal_arg *arg = p;
+	char buf[4096];
+	memset(buf, 'a' + arg->id, sizeof(buf));
+	/* Each thread overwrites its own MiB in a loop. */
+	size_t base = (size_t)arg->id * 1024 * 1024;
+	for (int i = 0; i < arg->ops; ++i) {
+		size_t offset = base + (size_t)i * arg->size % (1024 * 1024);
+		bench_fail_if(ufs_pwrite(arg->fd, buf, arg->size, offset) !=
+			      (ssize_t)arg->size);
+	}
+	return NULL;
+}
+
+/**
+ * Run @a threads writers of @a ops records of @a size each, and
+ * print the throughput. @a group_size 0 is without a journal.
+ */
+static void
+bench_journal_run(const char *path, unsigned group_size, int threads,
+		  int ops, size_t size)
+{
+	enum { MAX_THREADS = 16 };
+	bench_fail_if(threads > MAX_THREADS);
+	if (group_size > 0)
+		bench_fail_if(ufs_journal_open(path, group_size, 0) != 0);
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_fail_if(fd == -1);
+	pthread_t tids[MAX_THREADS];
+	struct bench_journal_arg args[MAX_THREADS];
+	double start = bench_now();
+	for (int i = 0; i < threads; ++i) {
+		args[i] = (struct bench_journal_arg){fd, i, ops, size};
+		bench_fail_if(pthread_create(&tids[i], NULL,
+					     bench_journal_worker,
+					     &args[i]) != 0);
+	}
+	for (int i = 0; i < threads; ++i)
+		bench_fail_if(pthread_join(tids[i], NULL) != 0);
+	/* The tail of the last group is durable too. */
+	if (group_size > 0)
+		bench_fail_if(ufs_journal_sync() != 0);
+	double t = bench_now() - start;
+	struct ufs_journal_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	if (group_size > 0)
+		ufs_get_journal_stats(&stats);
+	size_t total = (size_t)threads * ops;
+	size_t commits = stats.commits > 0 ? stats.commits : 1;
+	printf("journal size=%zu group=%u threads=%d ops=%.0f/s "
+	       "throughput=%.1f MB/s commits=%zu records/commit=%.1f\n",
+	       size, group_size, threads, total / t, total * size / 1e6 / t,
+	       group_size > 0 ? commits : 0,
+	       group_size > 0 ? (double)total / commits : 0);
+	bench_fail_if(ufs_close(fd) != 0);
+	bench_fail_if(ufs_delete("file") != 0);
+	if (group_size > 0)
+		bench_fail_if(ufs_journal_close() != 0);
+	char log_path[256];
+	snprintf(log_path, sizeof(log_path), "%s.log", path);
+	remove(path);
+	remove(log_path);
+}
+
+/**
+ * Throughput of durable writes: every ufs_pwrite() is durable with
+ * a group of 1, and is one fdatasync(). Larger groups share one
+ * write and sync, and concurrent writers share a sync even with a
+ * group of 1. The log is in @a path.log, it must be on a real disk.
+ */
+static void
+bench_journal(int records, const char *path)
+{
+	const unsigned groups[] = {0, 1, 8, 64, 512};
+	const size_t sizes[] = {4096, 64};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); ++g) {
+			/* Without a journal it is too fast to measure. */
+			int ops = groups[g] == 0 ? records * 100 :
+				  groups[g] == 1 ? records : records * 10;
+			bench_journal_run(path, groups[g], 1, ops, sizes[s]);
+		}
+	}
+	for (int threads = 2; threads <= 16; threads *= 2)
+		bench_journal_run(path, 1, threads, records / 2, 4096);
+}
+
+/** Size of the next record of the small record workloads. */
+static size_t
+bench_small_record(size_t offset, size_t size)
+{
+	size_t rec = offset % 123 + 1;
+	return rec < size - offset ? rec : size - offset;
+}
+
+struct bench_small_arg {
+	size_t size;
+	bool is_sequential;
+	double t;
+};
+
+/**
+ * Read the file "file" by records. Sequential reads of one
+ * descriptor are read ahead. Otherwise the records go to two
+ * descriptors in turn, so each one sees gaps, and reads without
+ * a read ahead.
+ */
+static void *
+bench_small_reader(void *p)
+{
+	struct bench_small_arg *arg = p;
+	int fds[2] = {ufs_open("file", 0), ufs_open("file", 0)};
+	bench_fail_if(fds[0] == -1 || fds[1] == -1);
+	char rec[128];
+	double start = bench_now();
+	int k = 0;
+	for (size_t offset = 0; offset < arg->size; ++k) {
+		size_t size = bench_small_record(offset, arg->size);
+		int fd = arg->is_sequential ? fds[0] : fds[k & 1];
+		bench_fail_if(ufs_pread(fd, rec, size, offset) != (ssize_t)size);
+		offset += size;
+	}
+	arg->t = bench_now() - start;
+	bench_fail_if(ufs_close(fds[0]) != 0 || ufs_close(fds[1]) != 0);
+	return NULL;
+}
+
+/**
+ * Records of 1 to 123 bytes, like in test_io, written sequentially
+ * by ufs_write() through a plain and a UFS_BUFFERED descriptor,
+ * and read sequentially by ufs_pread() with and without a read
+ * ahead, by 1 and 4 threads.
+ */
+static void
+bench_small(int size_mb)
+{
+	size_t size = (size_t)size_mb * 1024 * 1024;
+	char *data = malloc(size);
+	bench_fail_if(data == NULL);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	size_t records = 0;
+	for (size_t offset = 0; offset < size; ++records)
+		offset += bench_small_record(offset, size);
+
+	for (int is_buffered = 0; is_buffered <= 1; ++is_buffered) {
+		int fd = ufs_open("file", UFS_CREATE |
+				  (is_buffered ? UFS_BUFFERED : 0));
+		bench_fail_if(fd == -1);
+		double start = bench_now();
+		for (size_t offset = 0; offset < size;) {
+			size_t rec = bench_small_record(offset, size);
+			bench_fail_if(ufs_write(fd, data + offset, rec) !=
+				      (ssize_t)rec);
+			offset += rec;
+		}
+		bench_fail_if(ufs_close(fd) != 0);
+		double t = bench_now() - start;
+		printf("small write %s records=%zu %.1f ns/record %.0f MB/s\n",
+		       is_buffered ? "buffered" : "plain", records,
+		       t * 1e9 / records, size / 1e6 / t);
+		if (!is_buffered)
+			bench_fail_if(ufs_delete("file") != 0);
+	}
+
+	for (int threads = 1; threads <= 4; threads *= 4) {
+		for (int is_sequential = 0; is_sequential <= 1; ++is_sequential) {
+			pthread_t tids[4];
+			struct bench_small_arg args[4];
+			for (int i = 0; i < threads; ++i) {
+				args[i] = (struct bench_small_arg){size, is_sequential, 0};
+				bench_fail_if(pthread_create(&tids[i], NULL,
+							     bench_small_reader,
+							     &args[i]) != 0);
+			}
+			double t = 0;
+			for (int i = 0; i < threads; ++i) {
+				bench_fail_if(pthread_join(tids[i], NULL) != 0);
+				t = args[i].t > t ? args[i].t : t;
+			}
+			printf("small read %s threads=%d %.1f ns/record "
+			       "%.0f MB/s\n", is_sequential ? "read_ahead" :
+			       "no_read_ahead", threads, t * 1e9 / records,
+			       threads * size / 1e6 / t);
+		}
+	}
+	bench_fail_if(ufs_delete("file") != 0);
+	free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: %s open [max_files]\n", argv[0]);
+		printf("       %s fd [pairs]\n", argv[0]);
+		printf("       %s random [reads]\n", argv[0]);
+		printf("       %s seq [size_mb]\n", argv[0]);
+		printf("       %s mt [ops_per_thread]\n", argv[0]);
+		printf("       %s view [size_mb]\n", argv[0]);
+		printf("       %s image [path] [total_mb]\n", argv[0]);
+		printf("       %s clone [size_mb]\n", argv[0]);
+		printf("       %s dedup [files]\n", argv[0]);
+		printf("       %s compress [files]\n", argv[0]);
+		printf("       %s resize [cycles]\n", argv[0]);
+		printf("       %s sparse [files]\n", argv[0]);
+		printf("       %s vec [records]\n", argv[0]);
+		printf("       %s ring [ops]\n", argv[0]);
+		printf("       %s quota [files]\n", argv[0]);
+		printf("       %s suite [size_mb] [--json]\n", argv[0]);
+		printf("       %s dirs [files]\n", argv[0]);
+		printf("       %s journal [records] [path]\n", argv[0]);
+		printf("       %s small [size_mb]\n", argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[1], "open") == 0) {
+		bench_open(argc > 2 ? atoi(argv[2]) : 100000);
+		return 0;
+	}
+	if (strcmp(argv[1], "fd") == 0) {
+		bench_fd(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "random") == 0) {
+		bench_random(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "seq") == 0) {
+		bench_seq(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "mt") == 0) {
+		bench_mt(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "view") == 0) {
+		bench_view(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "image") == 0) {
+		bench_image(argc > 2 ? argv[2] : "/tmp/userfs_bench.img",
+			    argc > 3 ? atoi(argv[3]) : 1000);
+		return 0;
+	}
+	if (strcmp(argv[1], "clone") == 0) {
+		bench_clone(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "dedup") == 0) {
+		bench_dedup(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "compress") == 0) {
+		bench_compress(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "resize") == 0) {
+		bench_resize(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "sparse") == 0) {
+		bench_sparse(argc > 2 ? atoi(argv[2]) : 100);
+		return 0;
+	}
+	if (strcmp(argv[1], "vec") == 0) {
+		bench_vec(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "ring") == 0) {
+		bench_ring(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "quota") == 0) {
+		bench_quota(argc > 2 ? atoi(argv[2]) : 1000);
+		return 0;
+	}
+	if (strcmp(argv[1], "suite") == 0) {
+		bool is_json = strcmp(argv[argc - 1], "--json") == 0;
+		bench_suite(argc > 2 + is_json ? atoi(argv[2]) : 64, is_json);
+		return 0;
+	}
+	if (strcmp(argv[1], "dirs") == 0) {
+		bench_dirs(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "journal") == 0) {
+		bench_journal(argc > 2 ? atoi(argv[2]) : 2000,
+			      argc > 3 ? argv[3] : "/tmp/userfs_bench.img");
+		return 0;
+	}
+	if (strcmp(argv[1], "small") == 0) {
+		bench_small(argc > 2 ? atoi(argv[2]) : 64);
+		return 0;
+	}
+	printf("Unknown benchmark %s\n", argv[1]);
+	return 1;
+}
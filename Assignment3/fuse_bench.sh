@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Compare userfs mounted by ufs_fuse with tmpfs: fio sequential and
+# random 4 KiB I/O, and the Assignment1 sorter. Needs libfuse3 and fio.
+# Usage: ./fuse_bench.sh [size_mb]
+set -e
+
+SIZE=${1:-256}
+HERE=$(cd "$(dirname "$0")" && pwd)
+SORTER="$HERE/../Assignment1"
+MNT=$(mktemp -d)
+TMPFS=$(mktemp -d -p /dev/shm)
+trap 'fusermount3 -u "$MNT" 2>/dev/null; rmdir "$MNT"; rm -rf "$TMPFS"' EXIT
+
+make -C "$HERE" fuse
+make -C "$SORTER"
+(cd "$SORTER" && bash generate.sh)
+
+run_fio() {
+	for rw in write read randwrite randread; do
+		echo "== $1 $rw"
+		fio --name=$rw --directory="$2" --rw=$rw --bs=4k --size=${SIZE}M \
+		    --ioengine=psync --fallocate=none --fsync_on_close=0 \
+		    --group_reporting | grep -E "(READ|WRITE): bw|^ +clat \(|99.00th"
+		rm -f "$2"/$rw.*
+	done
+}
+
+run_sorter() {
+	echo "== $1 sorter"
+	cp "$SORTER"/test[1-6].txt "$2"
+	(cd "$2" && time "$SORTER"/a.out 4 100 test1.txt test2.txt test3.txt \
+		test4.txt test5.txt test6.txt > /dev/null)
+	rm -f "$2"/*
+}
+
+# The page cache is out of the way, each call reaches userfs.
+"$HERE"/ufs_fuse -o direct_io "$MNT"
+run_fio userfs "$MNT"
+fusermount3 -u "$MNT"
+run_fio tmpfs "$TMPFS"
+
+# The sorter maps its input, which needs the page cache.
+"$HERE"/ufs_fuse "$MNT"
+run_sorter userfs "$MNT"
+run_sorter tmpfs "$TMPFS"
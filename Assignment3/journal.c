@@ -0,0 +1,404 @@
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "UFSLOG\0\1"
+
+struct journal_file_header {
+	char magic[8];
+	uint32_t epoch;
+	uint32_t reserved;
+};
+
+struct journal_record_header {
+	/** Size of the body, which follows the header. */
+	uint32_t size;
+	/** Checksum of the size and the body. */
+	uint32_t checksum;
+};
+
+struct journal_buf {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+struct journal {
+	char *path;
+	int fd;
+	uint32_t epoch;
+	unsigned group_size;
+	/** Records appended and not taken by a commit yet. */
+	struct journal_buf buf;
+	/** Records being written by a commit, or an empty buffer. */
+	struct journal_buf spare;
+	/** Number of the last appended record. */
+	uint64_t lsn;
+	/** Number of the last durable record. */
+	uint64_t committed_lsn;
+	bool is_committing;
+	/** errno of the failure which broke the log, or 0. */
+	int error;
+	struct journal_stats stats;
+	/** Protects all the members, except the spare buffer in a commit. */
+	pthread_mutex_t lock;
+	/** Signaled when a commit ends. */
+	pthread_cond_t committed;
+};
+
+/** Fast non-cryptographic hash, 8 bytes per step. */
+static uint32_t
+journal_checksum(const char *body, uint32_t size)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ size;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, body + i, 8);
+		h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	for (; i < size; ++i)
+		h = (h ^ (unsigned char)body[i]) * 0x100000001B3ULL;
+	return (uint32_t)(h ^ (h >> 29));
+}
+
+static int
+journal_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	while (size > 0) {
+		ssize_t rc = pwrite(fd, buf, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -1;
+		buf += rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+int
+journal_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = slash == NULL ? strdup(".") :
+		    slash == path ? strdup("/") : strndup(path, slash - path);
+	if (dir == NULL)
+		return -1;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0)
+		return -1;
+	int rc = fsync(fd);
+	int error = errno;
+	close(fd);
+	errno = error;
+	return rc;
+}
+
+/**
+ * Make a file with only the header of @a epoch, and put it in
+ * place of the log by a rename.
+ * @return Descriptor of the new file, or -1.
+ */
+static int
+journal_create_file(const char *path, uint32_t epoch)
+{
+	char *tmp_path = malloc(strlen(path) + 5);
+	if (tmp_path == NULL)
+		return -1;
+	sprintf(tmp_path, "%s.tmp", path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(tmp_path);
+		return -1;
+	}
+	struct journal_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.epoch = epoch;
+	if (journal_pwrite(fd, (const char *)&header, sizeof(header), 0) != 0 ||
+	    fsync(fd) != 0 || rename(tmp_path, path) != 0 ||
+	    journal_sync_dir(path) != 0) {
+		int error = errno;
+		close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		errno = error;
+		return -1;
+	}
+	free(tmp_path);
+	return fd;
+}
+
+struct journal *
+journal_new(const char *path, unsigned group_size)
+{
+	struct journal *journal = calloc(1, sizeof(*journal));
+	if (journal == NULL)
+		return NULL;
+	journal->path = strdup(path);
+	if (journal->path == NULL) {
+		free(journal);
+		return NULL;
+	}
+	journal->fd = -1;
+	journal->group_size = group_size > 0 ? group_size : 1;
+	journal->stats.size = sizeof(struct journal_file_header);
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_cond_init(&journal->committed, NULL);
+	return journal;
+}
+
+void
+journal_delete(struct journal *journal)
+{
+	if (journal->fd >= 0)
+		close(journal->fd);
+	pthread_mutex_destroy(&journal->lock);
+	pthread_cond_destroy(&journal->committed);
+	free(journal->buf.data);
+	free(journal->spare.data);
+	free(journal->path);
+	free(journal);
+}
+
+static int
+journal_buf_reserve(struct journal_buf *buf, size_t size)
+{
+	if (size <= buf->capacity)
+		return 0;
+	size_t capacity = buf->capacity > 0 ? buf->capacity : 64 * 1024;
+	while (capacity < size)
+		capacity *= 2;
+	char *data = realloc(buf->data, capacity);
+	if (data == NULL)
+		return -1;
+	buf->data = data;
+	buf->capacity = capacity;
+	return 0;
+}
+
+uint64_t
+journal_append(struct journal *journal, const void *head, size_t head_size,
+	       const struct iovec *iov, int iovcnt)
+{
+	size_t size = head_size;
+	for (int i = 0; i < iovcnt; ++i)
+		size += iov[i].iov_len;
+	pthread_mutex_lock(&journal->lock);
+	uint64_t lsn = ++journal->lsn;
+	struct journal_buf *buf = &journal->buf;
+	size_t end = buf->size + sizeof(struct journal_record_header) + size;
+	if (size > UINT32_MAX || journal_buf_reserve(buf, end) != 0) {
+		if (journal->error == 0)
+			journal->error = size > UINT32_MAX ? EFBIG : ENOMEM;
+		pthread_mutex_unlock(&journal->lock);
+		return lsn;
+	}
+	/* The checksum is made by the commit, out of the lock. */
+	struct journal_record_header header = {(uint32_t)size, 0};
+	char *pos = buf->data + buf->size;
+	memcpy(pos, &header, sizeof(header));
+	pos += sizeof(header);
+	memcpy(pos, head, head_size);
+	pos += head_size;
+	for (int i = 0; i < iovcnt; ++i) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	buf->size = end;
+	journal->stats.records++;
+	journal->stats.bytes += size;
+	pthread_mutex_unlock(&journal->lock);
+	return lsn;
+}
+
+/** Fill the checksums of the records of a group. */
+static void
+journal_seal(char *data, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size) {
+		struct journal_record_header header;
+		memcpy(&header, data + pos, sizeof(header));
+		pos += sizeof(header);
+		header.checksum = journal_checksum(data + pos, header.size);
+		memcpy(data + pos - sizeof(header), &header, sizeof(header));
+		pos += header.size;
+	}
+}
+
+/**
+ * Write and sync all the appended records as one group. The lock
+ * is held, and is released for the I/O.
+ */
+static void
+journal_write_group(struct journal *journal)
+{
+	struct journal_buf group = journal->buf;
+	journal->buf = journal->spare;
+	uint64_t lsn = journal->lsn;
+	size_t offset = journal->stats.size;
+	int fd = journal->fd;
+	journal->is_committing = true;
+	pthread_mutex_unlock(&journal->lock);
+
+	journal_seal(group.data, group.size);
+	int error = 0;
+	if (journal_pwrite(fd, group.data, group.size, offset) != 0 ||
+	    fdatasync(fd) != 0)
+		error = errno;
+
+	pthread_mutex_lock(&journal->lock);
+	journal->is_committing = false;
+	if (error != 0) {
+		if (journal->error == 0)
+			journal->error = error;
+	} else {
+		journal->committed_lsn = lsn;
+		journal->stats.size += group.size;
+		journal->stats.commits++;
+	}
+	group.size = 0;
+	journal->spare = group;
+	pthread_cond_broadcast(&journal->committed);
+}
+
+int
+journal_commit(struct journal *journal, uint64_t lsn, bool is_forced)
+{
+	pthread_mutex_lock(&journal->lock);
+	if (!is_forced && journal->error == 0 &&
+	    lsn < journal->committed_lsn + journal->group_size) {
+		pthread_mutex_unlock(&journal->lock);
+		return 0;
+	}
+	while (journal->committed_lsn < lsn && journal->error == 0) {
+		if (journal->is_committing)
+			pthread_cond_wait(&journal->committed, &journal->lock);
+		else
+			journal_write_group(journal);
+	}
+	int error = journal->committed_lsn >= lsn ? 0 : journal->error;
+	pthread_mutex_unlock(&journal->lock);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t
+journal_last_lsn(struct journal *journal)
+{
+	pthread_mutex_lock(&journal->lock);
+	uint64_t lsn = journal->lsn;
+	pthread_mutex_unlock(&journal->lock);
+	return lsn;
+}
+
+uint32_t
+journal_epoch(struct journal *journal)
+{
+	pthread_mutex_lock(&journal->lock);
+	uint32_t epoch = journal->epoch;
+	pthread_mutex_unlock(&journal->lock);
+	return epoch;
+}
+
+int
+journal_reset(struct journal *journal, uint32_t epoch)
+{
+	pthread_mutex_lock(&journal->lock);
+	/* The group in flight goes to the old file. */
+	while (journal->is_committing)
+		pthread_cond_wait(&journal->committed, &journal->lock);
+	int fd = journal_create_file(journal->path, epoch);
+	if (fd < 0) {
+		int error = errno;
+		if (journal->error == 0)
+			journal->error = error;
+		pthread_mutex_unlock(&journal->lock);
+		errno = error;
+		return -1;
+	}
+	if (journal->fd >= 0)
+		close(journal->fd);
+	journal->fd = fd;
+	journal->epoch = epoch;
+	journal->buf.size = 0;
+	journal->committed_lsn = journal->lsn;
+	journal->stats.size = sizeof(struct journal_file_header);
+	pthread_cond_broadcast(&journal->committed);
+	pthread_mutex_unlock(&journal->lock);
+	return 0;
+}
+
+void
+journal_get_stats(struct journal *journal, struct journal_stats *stats)
+{
+	pthread_mutex_lock(&journal->lock);
+	*stats = journal->stats;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+int
+journal_replay(const char *path, uint32_t epoch, journal_replay_f cb,
+	       void *ctx, size_t *count)
+{
+	*count = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	struct stat st;
+	struct journal_file_header header;
+	if (fstat(fd, &st) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (size < sizeof(header) ||
+	    pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.epoch > epoch) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if (header.epoch < epoch) {
+		close(fd);
+		return 0;
+	}
+	char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+	size_t pos = sizeof(header);
+	int rc = 0;
+	while (rc == 0 && size - pos >= sizeof(struct journal_record_header)) {
+		struct journal_record_header record;
+		memcpy(&record, base + pos, sizeof(record));
+		pos += sizeof(record);
+		if (record.size > size - pos ||
+		    record.checksum != journal_checksum(base + pos, record.size))
+			break;
+		rc = cb(base + pos, record.size, ctx);
+		if (rc == 0)
+			++*count;
+		pos += record.size;
+	}
+	munmap(base, size);
+	return rc;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Redo log: an append-only file of records with checksums. A
+ * record is a body of bytes, the user of the log gives it a
+ * meaning. Records are numbered from 1 in the order of appending.
+ *
+ * Records are appended into a memory buffer, and written into the
+ * file by groups: one write() and one fdatasync() for all the
+ * records appended since the last commit, by all the threads. The
+ * thread which needs its record durable writes the group if no
+ * other group is in flight, else waits for that one. Meanwhile the
+ * other threads append into a second buffer, and their records go
+ * with the next group.
+ *
+ * The file starts with an epoch, which ties it to a checkpoint of
+ * the state the records are applied to. A torn record at the end,
+ * left by a crash in the middle of a write, fails its checksum and
+ * ends the log.
+ *
+ * All the functions can be called from several threads.
+ */
+
+struct journal;
+
+struct journal_stats {
+	/** Records appended, and bytes of their bodies. */
+	size_t records;
+	size_t bytes;
+	/** Groups written and synced. */
+	size_t commits;
+	/** Size of the file. */
+	size_t size;
+};
+
+/**
+ * Create a log in the file @a path. The file is made by the first
+ * journal_reset(), an old one stays until then. A commit is needed
+ * when @a group_size records are not durable.
+ * @retval NULL No memory.
+ */
+struct journal *
+journal_new(const char *path, unsigned group_size);
+
+/** Free a log. Not committed records are lost. */
+void
+journal_delete(struct journal *journal);
+
+/**
+ * Append a record: @a head followed by the buffers. The record is
+ * not durable until it is committed.
+ * @return Number of the record. On failure the log is broken,
+ *     and commits fail.
+ */
+uint64_t
+journal_append(struct journal *journal, const void *head, size_t head_size,
+	       const struct iovec *iov, int iovcnt);
+
+/**
+ * Make the records up to @a lsn durable. Without @a is_forced it
+ * is done only if there are group_size records not durable, and
+ * the smaller groups wait for more records.
+ * @retval 0 Success.
+ * @retval -1 The log is broken by a failed write, sync or append,
+ *     errno has the reason.
+ */
+int
+journal_commit(struct journal *journal, uint64_t lsn, bool is_forced);
+
+/** Number of the last appended record. */
+uint64_t
+journal_last_lsn(struct journal *journal);
+
+uint32_t
+journal_epoch(struct journal *journal);
+
+/**
+ * Replace the file with an empty one of @a epoch, atomically. The
+ * records appended before are dropped and count as durable: the
+ * caller has a checkpoint of their changes. It must be done with
+ * the appends of the changes in the checkpoint stopped.
+ * @retval -1 Error, errno has the reason, the log is broken.
+ */
+int
+journal_reset(struct journal *journal, uint32_t epoch);
+
+void
+journal_get_stats(struct journal *journal, struct journal_stats *stats);
+
+/** Callback of journal_replay(), -1 stops the replay. */
+typedef int (*journal_replay_f)(const char *body, size_t size, void *ctx);
+
+/**
+ * Call @a cb for each record of a log file in order, up to the end
+ * or the first torn or corrupted record. A missing file is an
+ * empty log. A log of an epoch older than @a epoch is empty too,
+ * its records are in the checkpoint of @a epoch.
+ * @param[out] count Number of replayed records.
+ * @retval 0 Success.
+ * @retval -1 Can't read the file, errno has the reason. EINVAL -
+ *     not a log, or a log of a newer epoch. Or @a cb failed.
+ */
+int
+journal_replay(const char *path, uint32_t epoch, journal_replay_f cb,
+	       void *ctx, size_t *count);
+
+/** Sync the directory of @a path, making a rename in it durable. */
+int
+journal_sync_dir(const char *path);
@@ -0,0 +1,191 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	LZ_MIN_MATCH = 4,
+	LZ_MAX_OFFSET = 65535,
+	/** The last bytes are always literals, to simplify the ends. */
+	LZ_LAST_LITERALS = 5,
+	LZ_HASH_BITS = 12,
+	/** Misses in a row, after which the search steps faster. */
+	LZ_SKIP_TRIGGER = 6,
+};
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/** Write a length continuation: 255 per step and the remainder. */
+static inline uint8_t *
+lz_write_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+size_t
+lz_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/**
+ * Emit a sequence: literals and an optional match.
+ * @return The new output position or NULL if it does not fit.
+ */
+static uint8_t *
+lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t lit,
+	size_t offset, size_t match)
+{
+	/* Worst case of the length continuations and the offset. */
+	if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 +
+				  match / 255 + 1)
+		return NULL;
+	uint8_t *token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = lz_write_length(op, lit - 15);
+	memcpy(op, literals, lit);
+	op += lit;
+	if (match == 0)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match -= LZ_MIN_MATCH;
+	*token |= match < 15 ? match : 15;
+	if (match >= 15)
+		op = lz_write_length(op, match - 15);
+	return op;
+}
+
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t *op = (uint8_t *)dst, *oend = op + capacity;
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	size_t anchor = 0, pos = 0;
+	if (size > LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+		size_t limit = size - LZ_MIN_MATCH - LZ_LAST_LITERALS;
+		size_t misses = 0;
+		while (pos < limit) {
+			uint32_t seq = lz_read32(in + pos);
+			uint32_t h = lz_hash(seq);
+			size_t cand = table[h];
+			table[h] = pos;
+			if (cand >= pos || pos - cand > LZ_MAX_OFFSET ||
+			    lz_read32(in + cand) != seq) {
+				/* Incompressible data is skipped faster. */
+				pos += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+			size_t len = LZ_MIN_MATCH;
+			size_t max = size - LZ_LAST_LITERALS - pos;
+			while (len < max && in[cand + len] == in[pos + len])
+				++len;
+			op = lz_emit(op, oend, in + anchor, pos - anchor,
+				     pos - cand, len);
+			if (op == NULL)
+				return 0;
+			pos += len;
+			anchor = pos;
+		}
+	}
+	op = lz_emit(op, oend, in + anchor, size - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/** Copy 8 bytes, which may overlap by not less than 8. */
+static inline void
+lz_copy8(uint8_t *dst, const uint8_t *src)
+{
+	uint64_t v;
+	memcpy(&v, src, sizeof(v));
+	memcpy(dst, &v, sizeof(v));
+}
+
+/** Read a length continuation. */
+static inline int
+lz_read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int
+lz_decompress(const char *src, size_t size, char *dst, size_t dst_size)
+{
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + size;
+	uint8_t *op = (uint8_t *)dst, *oend = op + dst_size;
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && lz_read_length(&ip, iend, &lit) != 0)
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		/*
+		 * Short runs are copied with fixed size words, when both
+		 * buffers have room for the overshoot.
+		 */
+		if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+			lz_copy8(op, ip);
+			lz_copy8(op + 8, ip + 8);
+		} else {
+			memcpy(op, ip, lit);
+		}
+		ip += lit;
+		op += lit;
+		/* The last sequence has only literals. */
+		if (ip == iend)
+			break;
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t match = token & 15;
+		if (match == 15 && lz_read_length(&ip, iend, &match) != 0)
+			return -1;
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) ||
+		    match > (size_t)(oend - op))
+			return -1;
+		const uint8_t *from = op - offset;
+		if (offset >= 8 && (size_t)(oend - op) >= match + 8) {
+			for (size_t i = 0; i < match; i += 8)
+				lz_copy8(op + i, from + i);
+			op += match;
+		} else if (offset >= match) {
+			memcpy(op, from, match);
+			op += match;
+		} else {
+			/* Overlapped copy repeats the last offset bytes. */
+			for (size_t i = 0; i < match; ++i)
+				*op++ = from[i];
+		}
+	}
+	return op == oend ? 0 : -1;
+}
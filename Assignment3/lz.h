@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Small LZ77 codec in the spirit of LZ4: a byte oriented format of
+ * literal runs and matches of at least 4 bytes at distances up to
+ * 64 KiB, found with a single-entry hash table. It is fast rather
+ * than tight, and needs no memory besides the buffers.
+ */
+
+/** Size of a buffer, enough for compressed data of @a size bytes. */
+size_t
+lz_bound(size_t size);
+
+/**
+ * Compress @a size bytes of @a src into @a dst of @a capacity
+ * bytes.
+ * @return Compressed size, or 0 if it does not fit into @a dst.
+ */
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * Decompress data made by lz_compress(), which must unpack into
+ * exactly @a dst_size bytes.
+ * @retval 0 Success.
+ * @retval -1 The data is corrupted.
+ */
+int
+lz_decompress(const char *src, size_t size, char *dst, size_t dst_size);
@@ -0,0 +1,267 @@
+#include "userfs.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct ufs_ring {
+	/** Number of entries, a power of 2. */
+	unsigned capacity;
+	/**
+	 * Submissions and their completions. The completion of
+	 * sq[i] is cq[i], results are collected in order.
+	 */
+	struct ufs_sqe *sq;
+	struct ufs_cqe *cq;
+	/** Buffers of a coalesced call. */
+	struct iovec *iov;
+	unsigned iov_max;
+	/*
+	 * Free running counters, an entry index is a counter masked
+	 * by capacity - 1. Entries [cq_head, cq_tail) are completed,
+	 * [cq_tail, sq_submitted) are submitted, and
+	 * [sq_submitted, sq_tail) are being filled.
+	 */
+	unsigned sq_tail;
+	unsigned sq_submitted;
+	unsigned cq_head;
+	unsigned cq_tail;
+	/** Descriptor of the last open, for UFS_RING_LAST_FD. */
+	int last_fd;
+	bool has_worker;
+	bool is_stopping;
+	pthread_t worker;
+	/** Protects sq_submitted, cq_tail and is_stopping. */
+	pthread_mutex_t lock;
+	/** Signaled on a submission and on stop. */
+	pthread_cond_t submitted;
+	/** Signaled on completions. */
+	pthread_cond_t completed;
+};
+
+static inline struct ufs_sqe *
+ring_sqe(struct ufs_ring *ring, unsigned i)
+{
+	return &ring->sq[i & (ring->capacity - 1)];
+}
+
+static inline int
+ring_fd(struct ufs_ring *ring, const struct ufs_sqe *sqe)
+{
+	return sqe->fd == UFS_RING_LAST_FD ? ring->last_fd : sqe->fd;
+}
+
+static inline bool
+ring_op_is_io(enum ufs_ring_op op)
+{
+	return op == UFS_OP_READ || op == UFS_OP_WRITE ||
+	       op == UFS_OP_PREAD || op == UFS_OP_PWRITE;
+}
+
+/** Publish @a count completions, starting from cq_tail. */
+static void
+ring_complete(struct ufs_ring *ring, unsigned count)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->cq_tail += count;
+	pthread_cond_broadcast(&ring->completed);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void
+ring_set_result(struct ufs_ring *ring, unsigned i, ssize_t result)
+{
+	struct ufs_cqe *cqe = &ring->cq[i & (ring->capacity - 1)];
+	cqe->user_data = ring_sqe(ring, i)->user_data;
+	cqe->result = result;
+	cqe->error = result < 0 ? ufs_errno() : UFS_ERR_NO_ERR;
+}
+
+/**
+ * Execute entry @a i, together with the next ones of the same
+ * kind, reading or writing the same descriptor one after another.
+ * @return Number of executed entries.
+ */
+static unsigned
+ring_execute_run(struct ufs_ring *ring, unsigned i, unsigned end)
+{
+	const struct ufs_sqe *first = ring_sqe(ring, i);
+	enum ufs_ring_op op = first->op;
+	int fd = ring_fd(ring, first);
+	if (!ring_op_is_io(op)) {
+		ssize_t rc;
+		if (op == UFS_OP_OPEN) {
+			rc = ufs_open(first->filename, first->flags);
+			if (rc >= 0)
+				ring->last_fd = rc;
+		} else if (op == UFS_OP_CLOSE) {
+			rc = ufs_close(fd);
+		} else {
+			rc = ufs_delete(first->filename);
+		}
+		ring_set_result(ring, i, rc);
+		return 1;
+	}
+	bool is_positional = op == UFS_OP_PREAD || op == UFS_OP_PWRITE;
+	size_t next = first->offset + first->size;
+	unsigned count = 1;
+	ring->iov[0].iov_base = first->buf;
+	ring->iov[0].iov_len = first->size;
+	for (; i + count != end && count < ring->iov_max; ++count) {
+		const struct ufs_sqe *sqe = ring_sqe(ring, i + count);
+		if (sqe->op != op || ring_fd(ring, sqe) != fd ||
+		    (is_positional && sqe->offset != next))
+			break;
+		ring->iov[count].iov_base = sqe->buf;
+		ring->iov[count].iov_len = sqe->size;
+		next += sqe->size;
+	}
+	ssize_t rc;
+	switch (op) {
+	case UFS_OP_READ:
+		rc = ufs_readv(fd, ring->iov, count);
+		break;
+	case UFS_OP_WRITE:
+		rc = ufs_writev(fd, ring->iov, count);
+		break;
+	case UFS_OP_PREAD:
+		rc = ufs_preadv(fd, ring->iov, count, first->offset);
+		break;
+	default:
+		rc = ufs_pwritev(fd, ring->iov, count, first->offset);
+		break;
+	}
+	/* A read is split by the buffers, a write is all or nothing. */
+	for (unsigned k = 0; k < count; ++k) {
+		size_t size = ring->iov[k].iov_len;
+		if (rc < 0) {
+			ring_set_result(ring, i + k, -1);
+		} else {
+			size_t part = (size_t)rc < size ? (size_t)rc : size;
+			ring_set_result(ring, i + k, part);
+			rc -= part;
+		}
+	}
+	return count;
+}
+
+static void
+ring_execute(struct ufs_ring *ring, unsigned begin, unsigned end)
+{
+	while (begin != end) {
+		unsigned count = ring_execute_run(ring, begin, end);
+		ring_complete(ring, count);
+		begin += count;
+	}
+}
+
+static void *
+ring_worker_f(void *arg)
+{
+	struct ufs_ring *ring = arg;
+	pthread_mutex_lock(&ring->lock);
+	while (true) {
+		while (ring->cq_tail == ring->sq_submitted && !ring->is_stopping)
+			pthread_cond_wait(&ring->submitted, &ring->lock);
+		if (ring->cq_tail == ring->sq_submitted)
+			break;
+		unsigned begin = ring->cq_tail, end = ring->sq_submitted;
+		pthread_mutex_unlock(&ring->lock);
+		ring_execute(ring, begin, end);
+		pthread_mutex_lock(&ring->lock);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+struct ufs_ring *
+ufs_ring_new(unsigned entries, bool is_threaded)
+{
+	unsigned capacity = 1;
+	while (capacity < entries && capacity < (1u << 31))
+		capacity *= 2;
+	struct ufs_ring *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	ring->capacity = capacity;
+	ring->iov_max = capacity < UFS_IOV_MAX ? capacity : UFS_IOV_MAX;
+	ring->sq = malloc(capacity * sizeof(*ring->sq));
+	ring->cq = malloc(capacity * sizeof(*ring->cq));
+	ring->iov = malloc(ring->iov_max * sizeof(*ring->iov));
+	ring->last_fd = -1;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->submitted, NULL);
+	pthread_cond_init(&ring->completed, NULL);
+	if (ring->sq == NULL || ring->cq == NULL || ring->iov == NULL ||
+	    (is_threaded &&
+	     pthread_create(&ring->worker, NULL, ring_worker_f, ring) != 0)) {
+		ufs_ring_delete(ring);
+		return NULL;
+	}
+	ring->has_worker = is_threaded;
+	return ring;
+}
+
+void
+ufs_ring_delete(struct ufs_ring *ring)
+{
+	if (ring->has_worker) {
+		pthread_mutex_lock(&ring->lock);
+		ring->is_stopping = true;
+		pthread_cond_signal(&ring->submitted);
+		pthread_mutex_unlock(&ring->lock);
+		pthread_join(ring->worker, NULL);
+	}
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->submitted);
+	pthread_cond_destroy(&ring->completed);
+	free(ring->sq);
+	free(ring->cq);
+	free(ring->iov);
+	free(ring);
+}
+
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring)
+{
+	/* The waiting thread moves cq_head. */
+	unsigned head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_tail - head == ring->capacity)
+		return NULL;
+	return ring_sqe(ring, ring->sq_tail++);
+}
+
+unsigned
+ufs_ring_submit(struct ufs_ring *ring)
+{
+	/* Only the submitting thread changes sq_submitted. */
+	unsigned begin = ring->sq_submitted, end = ring->sq_tail;
+	if (begin == end)
+		return 0;
+	pthread_mutex_lock(&ring->lock);
+	ring->sq_submitted = end;
+	pthread_cond_signal(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+	if (!ring->has_worker)
+		ring_execute(ring, begin, end);
+	return end - begin;
+}
+
+unsigned
+ufs_ring_wait(struct ufs_ring *ring, struct ufs_cqe *cqes, unsigned max,
+	      unsigned min_count)
+{
+	pthread_mutex_lock(&ring->lock);
+	unsigned head = ring->cq_head;
+	unsigned submitted = ring->sq_submitted - head;
+	if (min_count > submitted)
+		min_count = submitted;
+	while (ring->cq_tail - head < min_count)
+		pthread_cond_wait(&ring->completed, &ring->lock);
+	unsigned count = ring->cq_tail - head;
+	pthread_mutex_unlock(&ring->lock);
+	if (count > max)
+		count = max;
+	for (unsigned i = 0; i < count; ++i)
+		cqes[i] = ring->cq[(head + i) & (ring->capacity - 1)];
+	__atomic_store_n(&ring->cq_head, head + count, __ATOMIC_RELEASE);
+	return count;
+}
@@ -0,0 +1,153 @@
+#include "slab.h"
+#include <stdlib.h>
+
+struct slab {
+	/** Objects memory. */
+	char *memory;
+	/** List of free objects, linked through their first bytes. */
+	void *free_list;
+	/** Number of objects never allocated, at the slab end. */
+	size_t untouched;
+	/** Number of used objects. */
+	size_t used;
+	/** Link in the pool's list of partial slabs. */
+	struct slab *next;
+	struct slab *prev;
+};
+
+void
+slab_pool_create(struct slab_pool *pool, size_t obj_size,
+		 size_t min_objs_per_slab, size_t min_slab_size)
+{
+	/* A free object keeps a pointer to the next one. */
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	size_t objs = (min_slab_size + obj_size - 1) / obj_size;
+	if (objs < min_objs_per_slab)
+		objs = min_objs_per_slab;
+	pool->obj_size = obj_size;
+	pool->objs_per_slab = objs;
+	pool->partial = NULL;
+	pool->spare = NULL;
+	pool->used = 0;
+	pool->allocated = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+}
+
+static void
+slab_list_add(struct slab **head, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head != NULL)
+		(*head)->prev = slab;
+	*head = slab;
+}
+
+static void
+slab_list_remove(struct slab **head, struct slab *slab)
+{
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		*head = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+}
+
+static struct slab *
+slab_new(struct slab_pool *pool)
+{
+	struct slab *slab = malloc(sizeof(*slab));
+	if (slab == NULL)
+		return NULL;
+	size_t size = pool->obj_size * pool->objs_per_slab;
+	slab->memory = malloc(size);
+	if (slab->memory == NULL) {
+		free(slab);
+		return NULL;
+	}
+	/*
+	 * Objects are taken from the untouched tail lazily, so a big
+	 * fresh slab is not paged in by building a free list.
+	 */
+	slab->free_list = NULL;
+	slab->untouched = pool->objs_per_slab;
+	slab->used = 0;
+	pool->allocated += size;
+	return slab;
+}
+
+static void
+slab_delete(struct slab_pool *pool, struct slab *slab)
+{
+	pool->allocated -= pool->obj_size * pool->objs_per_slab;
+	free(slab->memory);
+	free(slab);
+}
+
+void *
+slab_alloc(struct slab_pool *pool, struct slab **slab_out)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct slab *slab = pool->partial;
+	if (slab == NULL) {
+		if (pool->spare != NULL) {
+			slab = pool->spare;
+			pool->spare = NULL;
+		} else {
+			slab = slab_new(pool);
+			if (slab == NULL) {
+				pthread_mutex_unlock(&pool->lock);
+				return NULL;
+			}
+		}
+		slab_list_add(&pool->partial, slab);
+	}
+	void *obj;
+	if (slab->free_list != NULL) {
+		obj = slab->free_list;
+		slab->free_list = *(void **)obj;
+	} else {
+		size_t i = pool->objs_per_slab - slab->untouched--;
+		obj = slab->memory + i * pool->obj_size;
+	}
+	if (++slab->used == pool->objs_per_slab)
+		slab_list_remove(&pool->partial, slab);
+	pool->used++;
+	pthread_mutex_unlock(&pool->lock);
+	*slab_out = slab;
+	return obj;
+}
+
+void
+slab_free(struct slab_pool *pool, struct slab *slab, void *obj)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (slab->used-- == pool->objs_per_slab)
+		slab_list_add(&pool->partial, slab);
+	pool->used--;
+	if (slab->used == 0) {
+		slab_list_remove(&pool->partial, slab);
+		if (pool->spare != NULL)
+			slab_delete(pool, pool->spare);
+		/* Start from the clean tail, like a new slab. */
+		slab->free_list = NULL;
+		slab->untouched = pool->objs_per_slab;
+		pool->spare = slab;
+	} else {
+		*(void **)obj = slab->free_list;
+		slab->free_list = obj;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+size_t
+slab_pool_used_bytes(struct slab_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	size_t used = pool->used * pool->obj_size;
+	pthread_mutex_unlock(&pool->lock);
+	return used;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Slab allocator of fixed size objects. Objects are carved from
+ * big slabs, so many small allocations cost a few mallocs and
+ * have no per-object malloc header. A slab without used objects
+ * is returned to the system, except for one spare slab per pool,
+ * which protects from flapping on a border.
+ *
+ * The caller remembers from which slab an object was taken and
+ * gives it back on free. That keeps the slabs free of any
+ * alignment or lookup requirements.
+ *
+ * A pool can be used from several threads.
+ */
+
+struct slab;
+
+struct slab_pool {
+	/** Size of one object. */
+	size_t obj_size;
+	/** Number of objects in one slab. */
+	size_t objs_per_slab;
+	/** Slabs having free objects. */
+	struct slab *partial;
+	/** Empty slab kept for the next allocation, or NULL. */
+	struct slab *spare;
+	/** Total number of objects in use. */
+	size_t used;
+	/** Total bytes allocated for the slabs, used or not. */
+	size_t allocated;
+	pthread_mutex_t lock;
+};
+
+/**
+ * Initialize a pool of objects of size @a obj_size. Slabs have
+ * at least @a min_objs_per_slab objects and at least
+ * @a min_slab_size bytes.
+ */
+void
+slab_pool_create(struct slab_pool *pool, size_t obj_size,
+		 size_t min_objs_per_slab, size_t min_slab_size);
+
+/**
+ * Allocate an object.
+ * @param[out] slab Slab of the object, needed for slab_free().
+ * @retval NULL No memory.
+ */
+void *
+slab_alloc(struct slab_pool *pool, struct slab **slab);
+
+/** Return an object allocated by slab_alloc() from @a slab. */
+void
+slab_free(struct slab_pool *pool, struct slab *slab, void *obj);
+
+/** Bytes of the used objects. */
+size_t
+slab_pool_used_bytes(struct slab_pool *pool);
@@ -1,8 +1,15 @@
 #include "userfs.h"
 #include "unit.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +77,40 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_descriptor_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 5000;
+	int *fds = malloc(count * sizeof(int));
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_fail_if(ufs_close(fds[100]) != 0);
+	unit_fail_if(ufs_close(fds[4000]) != 0);
+	int fd = ufs_open("file", 0);
+	unit_check(fd == fds[100], "the lowest free descriptor is reused");
+	fds[100] = fd;
+	fd = ufs_open("file", 0);
+	unit_check(fd == fds[4000], "and then the next one");
+	fds[4000] = fd;
+
+	for (int i = count - 1; i >= 0; --i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_check(ufs_close(fds[count - 1]) == -1,
+		   "closed descriptor is invalid after the table shrinks");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	fd = ufs_open("file", 0);
+	unit_check(fd == fds[0], "after mass close numbering starts over");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(fds);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -213,6 +254,1446 @@ test_io(void)
 	unit_test_finish();
 }
 
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_pread(-1, NULL, 0, 0) == -1, "pread invalid fd");
+	unit_check(ufs_pwrite(-1, NULL, 0, 0) == -1, "pwrite invalid fd");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[3000];
+	for (int i = 0; i < (int)sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+
+	char out[100];
+	unit_check(ufs_pread(fd, out, 10, 2000) == 10, "pread in the middle");
+	unit_check(memcmp(out, buffer + 2000, 10) == 0, "correct data");
+	unit_check(ufs_pread(fd, out, 100, 2990) == 10, "pread at the end");
+	unit_check(ufs_pread(fd, out, 100, 5000) == 0, "pread beyond the end");
+	unit_check(ufs_pwrite(fd, "XYZ", 3, 1000) == 3, "pwrite");
+	unit_check(ufs_read(fd, out, 1) == 0, "position is not changed");
+
+	unit_check(ufs_seek(fd, 999, UFS_SEEK_SET) == 999, "seek set");
+	unit_check(ufs_read(fd, out, 5) == 5, "read after seek");
+	unit_check(memcmp(out, buffer + 999, 1) == 0 &&
+		   memcmp(out + 1, "XYZ", 3) == 0 && out[4] == buffer[1003],
+		   "pwrite data is there");
+	unit_check(ufs_seek(fd, -4, UFS_SEEK_CUR) == 1000, "seek cur");
+	unit_check(ufs_seek(fd, -2000, UFS_SEEK_CUR) == -1,
+		   "seek before the start");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == sizeof(buffer), "seek end");
+
+	unit_check(ufs_seek(fd, 1000, UFS_SEEK_END) == 4000,
+		   "seek beyond the end");
+	unit_check(ufs_write(fd, "end", 3) == 3, "write there");
+	unit_check(ufs_pread(fd, out, 100, 3990) == 13, "gap is readable");
+	bool ok = true;
+	for (int i = 0; i < 10; ++i)
+		ok = ok && out[i] == 0;
+	unit_check(ok && memcmp(out + 10, "end", 3) == 0, "gap is zeros");
+
+	/* Empty writes past the end don't move it. */
+	unit_check(ufs_pwrite(fd, "", 0, 10000) == 0, "empty pwrite");
+	unit_check(ufs_seek(fd, 5000, UFS_SEEK_SET) == 5000 &&
+		   ufs_write(fd, "", 0) == 0, "empty write");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 4003, "size is not changed");
+	int buffered = ufs_open("file", UFS_BUFFERED);
+	unit_fail_if(buffered == -1);
+	unit_fail_if(ufs_seek(buffered, 6000, UFS_SEEK_SET) != 6000);
+	unit_check(ufs_write(buffered, "", 0) == 0 && ufs_close(buffered) == 0,
+		   "empty buffered write");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 4003,
+		   "size is not changed by a flush");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_borders(void)
+{
+	unit_test_start();
+
+	/*
+	 * Chunks of odd sizes cross the borders of the growing blocks
+	 * at every possible point.
+	 */
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	const int size = 3 * 1024 * 1024 + 123;
+	char *data = malloc(size);
+	char *out = malloc(size);
+	unit_fail_if(data == NULL || out == NULL);
+	for (int i = 0; i < size; ++i)
+		data[i] = i * 7 + i / 4096;
+	int chunk = 1;
+	for (int pos = 0; pos < size;) {
+		int part = chunk < size - pos ? chunk : size - pos;
+		unit_fail_if(ufs_write(fd, data + pos, part) != part);
+		pos += part;
+		chunk = chunk > 100000 ? 1 : chunk * 3 + 1;
+	}
+	unit_check(ufs_pread(fd, out, size, 0) == size, "read all");
+	unit_check(memcmp(out, data, size) == 0, "data is correct");
+
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i) {
+		int offset = rand() % size;
+		int len = rand() % 300000;
+		ssize_t rc = ufs_pread(fd, out, len, offset);
+		int expected = len < size - offset ? len : size - offset;
+		ok = rc == expected && memcmp(out, data + offset, rc) == 0;
+	}
+	unit_check(ok, "random reads are correct");
+
+	free(data);
+	free(out);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_buffered(void)
+{
+	unit_test_start();
+
+	int fd1 = ufs_open("file", UFS_CREATE | UFS_BUFFERED);
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	char buf[4096];
+	unit_check(ufs_write(fd1, "abc", 3) == 3 && ufs_write(fd1, "def", 3) == 3,
+		   "buffered writes");
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 0,
+		   "they are not in the file yet");
+	unit_check(ufs_flush(fd1) == 0, "flush");
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 6 &&
+		   memcmp(buf, "abcdef", 6) == 0, "they are in the file");
+	unit_fail_if(ufs_write(fd1, "ghi", 3) != 3);
+	unit_fail_if(ufs_seek(fd1, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_read(fd1, buf, sizeof(buf)) == 9 &&
+		   memcmp(buf, "abcdefghi", 9) == 0,
+		   "the descriptor reads its own writes");
+	unit_fail_if(ufs_resize(fd1, 0) != 0);
+	unit_fail_if(ufs_seek(fd1, 0, UFS_SEEK_SET) != 0);
+
+	/*
+	 * Small sequential writes go through the buffer, and the
+	 * writes at other offsets are ordered with them.
+	 */
+	const size_t size = 300000;
+	char *data = malloc(size), *expected = malloc(size), *out = malloc(size);
+	unit_fail_if(data == NULL || expected == NULL || out == NULL);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	memcpy(expected, data, size);
+	size_t progress = 0;
+	bool ok = true;
+	for (int step = 0; progress < size && ok; ++step) {
+		size_t to_write = progress % 123 + 1;
+		if (to_write > size - progress)
+			to_write = size - progress;
+		ok = ufs_write(fd1, data + progress, to_write) ==
+		     (ssize_t)to_write;
+		progress += to_write;
+		if (step % 1000 == 999 && ok) {
+			ok = ufs_pwrite(fd1, "XY", 2, progress - 1) == 2;
+			expected[progress - 1] = 'X';
+		}
+	}
+	unit_check(ok && progress == size, "write in small parts");
+	unit_check(ufs_close(fd1) == 0, "close flushes");
+
+	/* Small sequential reads are served from data read ahead. */
+	progress = 0;
+	while (progress < size) {
+		ssize_t rc = ufs_read(fd2, out + progress, progress % 123 + 1);
+		if (rc <= 0)
+			break;
+		progress += rc;
+	}
+	unit_check(progress == size && memcmp(out, expected, size) == 0,
+		   "read in small parts");
+
+	/* The data read ahead is dropped by changes of the file. */
+	int fd3 = ufs_open("file", 0);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_seek(fd2, 0, UFS_SEEK_SET) != 0);
+	unit_fail_if(ufs_read(fd2, buf, 100) != 100);
+	unit_fail_if(ufs_read(fd2, buf, 100) != 100);
+	unit_fail_if(ufs_pwrite(fd3, "ZZZZ", 4, 250) != 4);
+	unit_check(ufs_read(fd2, buf, 100) == 100 && memcmp(buf + 50, "ZZZZ", 4) == 0,
+		   "a write is seen");
+	unit_fail_if(ufs_resize(fd3, 350) != 0);
+	unit_check(ufs_read(fd2, buf, 100) == 50, "a truncation is seen");
+	struct ufs_view *view;
+	unit_fail_if(ufs_view_reserve(fd3, 310, 4, &view) != 4);
+	int iovcnt;
+	memcpy(ufs_view_iov(view, &iovcnt)[0].iov_base, "VVVV", 4);
+	unit_fail_if(ufs_view_commit(view, 4) != 0);
+	unit_check(ufs_pread(fd2, buf, 10, 300) == 10 &&
+		   ufs_pread(fd2, buf, 10, 310) == 10 &&
+		   memcmp(buf, "VVVV", 4) == 0, "a view is seen");
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* Errors of the buffered writes come with the flush. */
+	fd1 = ufs_open("file", UFS_BUFFERED);
+	unit_fail_if(fd1 == -1);
+	unit_fail_if(ufs_resize(fd1, 0) != 0);
+	struct ufs_memory_stats stats;
+	ufs_get_memory_stats(&stats);
+	ufs_set_quota(stats.used, NULL, NULL);
+	unit_check(ufs_write(fd1, "abc", 3) == 3, "a write is buffered");
+	unit_check(ufs_flush(fd1) == -1 && ufs_errno() == UFS_ERR_NO_MEM,
+		   "the flush fails");
+	ufs_set_quota(0, NULL, NULL);
+	unit_check(ufs_flush(fd1) == 0, "the data is kept for the next flush");
+	fd2 = ufs_open("file", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "and is in the file");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	size_t max_size = 100 * 1024 * 1024;
+	unit_fail_if(ufs_seek(fd1, max_size - 2, UFS_SEEK_SET) < 0);
+	unit_fail_if(ufs_write(fd1, "a", 1) != 1);
+	unit_check(ufs_write(fd1, "bcd", 3) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM,
+		   "can not write over max file size");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(data);
+	free(expected);
+	free(out);
+
+	unit_test_finish();
+}
+
+static void
+test_views(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_view *view;
+	unit_check(ufs_view_read(-1, 0, 10, &view) == -1, "invalid fd");
+	unit_check(ufs_view_read(fd, 0, 10, &view) == 0, "empty file");
+	int iovcnt;
+	ufs_view_iov(view, &iovcnt);
+	unit_check(iovcnt == 0, "no pieces");
+	ufs_view_release(view);
+
+	/* Write a range crossing several blocks in place. */
+	const int size = 300 * 1000, offset = 1000;
+	unit_check(ufs_view_reserve(fd, offset, size, &view) == size,
+		   "reserve");
+	const struct iovec *iov = ufs_view_iov(view, &iovcnt);
+	unit_check(iovcnt > 1, "several pieces");
+	int pos = offset;
+	for (int i = 0; i < iovcnt; ++i) {
+		char *base = iov[i].iov_base;
+		for (size_t j = 0; j < iov[i].iov_len; ++j, ++pos)
+			base[j] = pos % 251;
+	}
+	unit_check(pos == offset + size, "pieces cover the range");
+	unit_check(ufs_view_commit(view, size) == 0, "commit");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == offset + size,
+		   "file grew");
+
+	char *out = malloc(size + offset);
+	unit_check(ufs_pread(fd, out, size + offset, 0) == size + offset,
+		   "read back");
+	bool ok = true;
+	for (int i = 0; i < offset; ++i)
+		ok = ok && out[i] == 0;
+	for (int i = offset; i < offset + size; ++i)
+		ok = ok && out[i] == (char)(i % 251);
+	unit_check(ok, "gap is zeros, data is correct");
+
+	/* Read view is clipped by the size. */
+	unit_check(ufs_view_read(fd, 5000, size, &view) == size + offset - 5000,
+		   "read view");
+	iov = ufs_view_iov(view, &iovcnt);
+	pos = 5000;
+	for (int i = 0; i < iovcnt; ++i) {
+		ok = ok && memcmp(iov[i].iov_base, out + pos,
+				  iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(ok && pos == size + offset, "read view data");
+	unit_check(ufs_view_commit(view, 0) == -1, "can't commit a read view");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	/* The view keeps a deleted file alive. */
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(memcmp(iov[0].iov_base, out + 5000, iov[0].iov_len) == 0,
+		   "view is valid after delete");
+	ufs_view_release(view);
+
+	/* Dropped reservation does not change the size. */
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_view_reserve(fd, 0, 100, &view) != 100);
+	ufs_view_release(view);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 0, "size is not changed");
+
+	int ro = ufs_open("file", UFS_READ_ONLY);
+	unit_check(ufs_view_reserve(ro, 0, 100, &view) == -1, "read-only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(ro) != 0);
+
+	free(out);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+struct view_call {
+	int (*f)(void);
+	int rc;
+};
+
+static void *
+view_call_f(void *arg)
+{
+	struct view_call *call = arg;
+	call->rc = call->f();
+	return NULL;
+}
+
+/**
+ * Make a call locking all the files in a thread, while a write view
+ * is held. The view holder creates a file meanwhile, and the call
+ * must not keep the namespace locked waiting for the view.
+ */
+static int
+call_under_view(int (*f)(void))
+{
+	int fd = ufs_open("viewed", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_view *view;
+	unit_fail_if(ufs_view_reserve(fd, 0, 10, &view) != 10);
+	struct view_call call = {f, -1};
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, view_call_f, &call) != 0);
+	/* Let the call reach the locked file. */
+	usleep(10000);
+	int other = ufs_open("other", UFS_CREATE);
+	unit_fail_if(other == -1);
+	unit_fail_if(ufs_view_commit(view, 10) != 0);
+	unit_fail_if(pthread_join(thread, NULL) != 0);
+	unit_fail_if(ufs_close(other) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("other") != 0);
+	unit_fail_if(ufs_delete("viewed") != 0);
+	return call.rc;
+}
+
+static int
+save_image(void)
+{
+	return ufs_save("/tmp/userfs_test.img");
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "/tmp/userfs_test.img";
+	const int count = 100;
+	char name[32], buf[5000], out[5000];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		/* Different sizes, some files have several blocks. */
+		for (int j = 0; j < i; ++j)
+			unit_fail_if(ufs_write(fd, buf, 1000 + i) != 1000 + i);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	/* A deleted file with an open descriptor is not saved. */
+	int deleted = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(deleted == -1);
+	unit_fail_if(ufs_delete("deleted") != 0);
+
+	unit_check(ufs_save(path) == 0, "save");
+	unit_check(ufs_load(path) == -1, "load into a non-empty namespace");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_load(path) == 0, "load");
+	unit_check(ufs_open("deleted", 0) == -1, "deleted file is not there");
+
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		ok = fd != -1;
+		ok = ok && ufs_seek(fd, 0, UFS_SEEK_END) == i * (1000 + i);
+		ok = ok && ufs_seek(fd, 0, UFS_SEEK_SET) == 0;
+		for (int j = 0; j < i && ok; ++j) {
+			ok = ufs_read(fd, out, 1000 + i) == 1000 + i;
+			for (int k = 0; k < 1000 + i && ok; ++k)
+				ok = out[k] == 'a' + i % 26;
+		}
+		/* Restored blocks are writable, and files can grow. */
+		memset(buf, 'z', sizeof(buf));
+		ok = ok && ufs_pwrite(fd, buf, 10, 0) == 10;
+		ok = ok && ufs_write(fd, buf, sizeof(buf)) == sizeof(buf);
+		ok = ok && ufs_pread(fd, out, 10, 0) == 10 && out[0] == 'z';
+		ok = ok && ufs_close(fd) == 0;
+	}
+	unit_check(ok, "restored files are correct");
+
+	/* The changes did not reach the image. */
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_fail_if(ufs_load(path) != 0);
+	int fd = ufs_open("file50", 0);
+	unit_check(fd != -1 && ufs_read(fd, out, 10) == 10 && out[0] == 'y',
+		   "image is not changed");
+	/* A write into a restored block takes memory under the quota. */
+	struct ufs_memory_stats stats;
+	ufs_get_memory_stats(&stats);
+	ufs_set_quota(stats.used, NULL, NULL);
+	unit_check(ufs_pwrite(fd, "x", 1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "restored blocks are in the quota");
+	ufs_set_quota(0, NULL, NULL);
+	unit_check(ufs_pwrite(fd, "x", 1, 0) == 1, "and are copied on write");
+	unit_fail_if(ufs_close(fd) != 0);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	FILE *f = fopen(path, "w");
+	unit_fail_if(f == NULL);
+	fprintf(f, "not an image at all, just some text");
+	fclose(f);
+	unit_check(ufs_load(path) == -1, "bad image");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_load("/nonexistent/image") == -1, "no image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+
+	unit_check(call_under_view(save_image) == 0,
+		   "save does not wait for a view under the namespace lock");
+
+	remove(path);
+	unit_fail_if(ufs_close(deleted) != 0);
+
+	unit_test_finish();
+}
+
+static int
+create_snapshot(void)
+{
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	if (snap == NULL)
+		return -1;
+	ufs_snapshot_delete(snap);
+	return 0;
+}
+
+static int
+clone_viewed(void)
+{
+	return ufs_clone("viewed", "viewed_copy");
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	const int size = 3 * 1024 * 1024;
+	char *data = malloc(size), *out = malloc(size);
+	unit_fail_if(data == NULL || out == NULL);
+	for (int i = 0; i < size; ++i)
+		data[i] = i % 253;
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+
+	unit_check(ufs_clone("none", "dst") == -1, "no source");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_clone("src", "src") == -1, "destination exists");
+	unit_check(ufs_errno() == UFS_ERR_EXISTS, "errno is set");
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+
+	int dst = ufs_open("dst", 0);
+	unit_fail_if(dst == -1);
+	unit_check(ufs_pread(dst, out, size, 0) == size &&
+		   memcmp(out, data, size) == 0, "clone has the data");
+
+	/* Writes into either of them are not visible in the other. */
+	unit_fail_if(ufs_pwrite(dst, "dst", 3, 1000) != 3);
+	unit_fail_if(ufs_pwrite(fd, "src", 3, 2 * 1024 * 1024) != 3);
+	unit_check(ufs_pread(fd, out, size, 0) == size &&
+		   memcmp(out, data, 1000) == 0 &&
+		   memcmp(out + 1000, data + 1000, 3) == 0 &&
+		   memcmp(out + 2 * 1024 * 1024, "src", 3) == 0,
+		   "source has only its change");
+	unit_check(ufs_pread(dst, out, size, 0) == size &&
+		   memcmp(out + 1000, "dst", 3) == 0 &&
+		   memcmp(out + 2 * 1024 * 1024, data + 2 * 1024 * 1024, 3) == 0,
+		   "clone has only its change");
+
+	/* Snapshot sees the files at its time only. */
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_fail_if(snap == NULL);
+	unit_fail_if(ufs_pwrite(fd, "new", 3, 0) != 3);
+	unit_fail_if(ufs_delete("dst") != 0);
+	int snap_fd = ufs_snapshot_open(snap, "src");
+	unit_check(snap_fd != -1, "open a snapshot file");
+	unit_check(ufs_pread(snap_fd, out, 3, 0) == 3 &&
+		   memcmp(out, data, 3) == 0, "snapshot has old data");
+	unit_check(ufs_write(snap_fd, "x", 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION,
+		   "snapshot file is read-only");
+	int snap_dst = ufs_snapshot_open(snap, "dst");
+	unit_check(snap_dst != -1, "deleted file is in the snapshot");
+	unit_check(ufs_snapshot_open(snap, "none") == -1, "no such file");
+	ufs_snapshot_delete(snap);
+	unit_check(ufs_pread(snap_dst, out, 3, 1000) == 3 &&
+		   memcmp(out, "dst", 3) == 0,
+		   "opened file outlives the snapshot");
+
+	/* A view holder can use the namespace while they wait for it. */
+	unit_check(call_under_view(create_snapshot) == 0,
+		   "snapshot does not wait for a view under the namespace lock");
+	unit_check(call_under_view(clone_viewed) == 0,
+		   "clone does not wait for a view under the namespace lock");
+	int copy = ufs_open("viewed_copy", 0);
+	unit_check(copy != -1 && ufs_seek(copy, 0, UFS_SEEK_END) == 10,
+		   "clone has the committed view");
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("viewed_copy") != 0);
+
+	unit_fail_if(ufs_close(snap_fd) != 0);
+	unit_fail_if(ufs_close(snap_dst) != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	free(data);
+	free(out);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	ufs_set_dedup(1);
+	struct ufs_dedup_stats before, after;
+	ufs_get_dedup_stats(&before);
+	const int size = 3 * 1024 * 1024;
+	char *data = malloc(size), *out = malloc(size);
+	unit_fail_if(data == NULL || out == NULL);
+	for (int i = 0; i < size; ++i)
+		data[i] = (i * 13) % 247;
+	int a = ufs_open("a", UFS_CREATE), b = ufs_open("b", UFS_CREATE);
+	unit_fail_if(a == -1 || b == -1);
+	/* Different write patterns, the same content. */
+	unit_fail_if(ufs_write(a, data, size) != size);
+	for (int pos = 0; pos < size; pos += 1000) {
+		int part = size - pos < 1000 ? size - pos : 1000;
+		unit_fail_if(ufs_write(b, data + pos, part) != part);
+	}
+	ufs_get_dedup_stats(&after);
+	unit_check(after.duplicates > before.duplicates, "duplicates found");
+	unit_check(after.bytes_saved - before.bytes_saved >= 2 * 1024 * 1024,
+		   "most of the second file is shared");
+	unit_check(after.bytes_hashed > before.bytes_hashed &&
+		   after.blocks_hashed > before.blocks_hashed, "hashing is counted");
+
+	/* Shared blocks are copied on write. */
+	unit_fail_if(ufs_pwrite(a, "changed", 7, 100) != 7);
+	unit_check(ufs_pread(b, out, size, 0) == size &&
+		   memcmp(out, data, size) == 0, "the other file is not changed");
+	unit_check(ufs_pread(a, out, size, 0) == size &&
+		   memcmp(out + 100, "changed", 7) == 0 &&
+		   memcmp(out + 107, data + 107, size - 107) == 0,
+		   "the changed file is correct");
+
+	unit_fail_if(ufs_close(a) != 0);
+	unit_fail_if(ufs_close(b) != 0);
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	ufs_get_dedup_stats(&after);
+	unit_check(after.unique_bytes == before.unique_bytes,
+		   "freed blocks leave the index");
+	ufs_set_dedup(0);
+	free(data);
+	free(out);
+
+	unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	const int far = 10 * 1024 * 1024;
+	char *out = malloc(far);
+	unit_fail_if(out == NULL);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "x", 1, far - 1) != 1);
+	struct ufs_file_stats stats;
+	unit_fail_if(ufs_file_stats(fd, &stats) != 0);
+	unit_check(stats.logical_bytes == (size_t)far &&
+		   stats.physical_bytes <= 1024 * 1024 &&
+		   stats.hole_bytes >= (size_t)far - 1024 * 1024,
+		   "a far write leaves a hole");
+	unit_fail_if(ufs_pread(fd, out, far, 0) != far);
+	int is_zero = 1;
+	for (int i = 0; i < far - 1 && is_zero; ++i)
+		is_zero = out[i] == 0;
+	unit_check(is_zero && out[far - 1] == 'x', "a hole reads as zeros");
+
+	/* A write into the middle of a hole. */
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, 5000000) != 3);
+	unit_fail_if(ufs_pread(fd, out, 5, 4999999) != 5);
+	unit_check(memcmp(out, "\0abc\0", 5) == 0,
+		   "a filled hole has zeros around the data");
+	struct ufs_view *view;
+	unit_fail_if(ufs_view_read(fd, 100, 5000, &view) != 5000);
+	int iovcnt;
+	const struct iovec *iov = ufs_view_iov(view, &iovcnt);
+	is_zero = 1;
+	for (int i = 0; i < iovcnt; ++i) {
+		for (size_t j = 0; j < iov[i].iov_len && is_zero; ++j)
+			is_zero = ((char *)iov[i].iov_base)[j] == 0;
+	}
+	ufs_view_release(view);
+	unit_check(is_zero, "a read view of a hole has zeros");
+
+	unit_fail_if(ufs_file_stats(fd, &stats) != 0);
+	size_t physical = stats.physical_bytes;
+	unit_fail_if(ufs_resize(fd, 50 * 1024 * 1024) != 0);
+	unit_fail_if(ufs_file_stats(fd, &stats) != 0);
+	unit_check(stats.physical_bytes == physical,
+		   "growth by resize takes no memory");
+
+	/* Holes survive an image and a clone. */
+	const char *path = "/tmp/userfs_sparse.img";
+	unit_fail_if(ufs_resize(fd, far) != 0);
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_save(path) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_load(path) != 0);
+	remove(path);
+	for (int i = 0; i < 2; ++i) {
+		fd = ufs_open(i == 0 ? "file" : "copy", 0);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_file_stats(fd, &stats) != 0);
+		unit_check(stats.physical_bytes == physical &&
+			   ufs_pread(fd, out, 5, 4999999) == 5 &&
+			   memcmp(out, "\0abc\0", 5) == 0 &&
+			   ufs_pread(fd, out, 1, far - 1) == 1 && out[0] == 'x',
+			   "holes are restored");
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	free(out);
+
+	unit_test_finish();
+}
+
+static void
+test_vectored(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Records crossing block borders, and an empty one. */
+	const int count = 100, rec = 150;
+	char data[100 * 150], out[100 * 150 + 10];
+	struct iovec iov[100];
+	for (int i = 0; i < count; ++i) {
+		memset(data + i * rec, 'a' + i % 26, rec);
+		iov[i].iov_base = data + i * rec;
+		iov[i].iov_len = i == 50 ? 0 : rec;
+	}
+	ssize_t total = (count - 1) * rec;
+	unit_check(ufs_pwritev(fd, iov, count, 4000) == total,
+		   "pwritev writes all the buffers");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 0, "position is not moved");
+	unit_fail_if(ufs_pread(fd, out, sizeof(out), 4000) != total);
+	unit_check(memcmp(out, data, 50 * rec) == 0 &&
+		   memcmp(out + 50 * rec, data + 51 * rec, 49 * rec) == 0,
+		   "the buffers go one after another");
+
+	/* Reading into smaller pieces, up to the file end. */
+	char a[7], b[1000], c[20000];
+	struct iovec in[3] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+	unit_check(ufs_preadv(fd, in, 3, 4000 + 10) == total - 10,
+		   "preadv stops at the file end");
+	unit_check(memcmp(a, out + 10, sizeof(a)) == 0 &&
+		   memcmp(b, out + 17, sizeof(b)) == 0 &&
+		   memcmp(c, out + 1017, total - 1017) == 0, "preadv data");
+	unit_check(ufs_preadv(fd, in, 3, 1000000) == 0, "preadv at EOF");
+
+	unit_check(ufs_pwritev(fd, iov, -1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "bad count");
+	in[0].iov_len = SIZE_MAX;
+	unit_check(ufs_preadv(fd, in, 3, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "too big total");
+	unit_check(ufs_preadv(-1, in, 3, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "bad descriptor");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_ring_mode(bool is_threaded)
+{
+	struct ufs_ring *ring = ufs_ring_new(100, is_threaded);
+	unit_fail_if(ring == NULL);
+	struct ufs_cqe cqes[128];
+	/* Open, write, read and close in one submission. */
+	char out[3][4] = {{0}};
+	const char *parts[] = {"abc", "def", "gh"};
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	*sqe = (struct ufs_sqe){.op = UFS_OP_OPEN, .filename = "file",
+				.flags = UFS_CREATE, .user_data = 1};
+	for (int i = 0; i < 3; ++i) {
+		sqe = ufs_ring_get_sqe(ring);
+		*sqe = (struct ufs_sqe){.op = UFS_OP_WRITE,
+					.fd = UFS_RING_LAST_FD,
+					.buf = (char *)parts[i],
+					.size = strlen(parts[i]),
+					.user_data = 10 + i};
+	}
+	for (int i = 0; i < 3; ++i) {
+		sqe = ufs_ring_get_sqe(ring);
+		*sqe = (struct ufs_sqe){.op = UFS_OP_PREAD,
+					.fd = UFS_RING_LAST_FD, .buf = out[i],
+					.size = 3, .offset = i * 3,
+					.user_data = 20 + i};
+	}
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = (struct ufs_sqe){.op = UFS_OP_CLOSE, .fd = UFS_RING_LAST_FD,
+				.user_data = 3};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = (struct ufs_sqe){.op = UFS_OP_WRITE, .fd = 100500,
+				.buf = out[0], .size = 1, .user_data = 4};
+	unit_check(ufs_ring_submit(ring) == 9, "submitted all");
+	unit_check(ufs_ring_wait(ring, cqes, 128, 9) == 9, "completed all");
+	unit_check(cqes[0].user_data == 1 && cqes[0].result >= 0,
+		   "open result");
+	unit_check(cqes[1].result == 3 && cqes[2].result == 3 &&
+		   cqes[3].result == 2 && cqes[3].user_data == 12,
+		   "coalesced writes have own results");
+	unit_check(cqes[4].result == 3 && cqes[5].result == 3 &&
+		   cqes[6].result == 2 && memcmp(out[0], "abc", 3) == 0 &&
+		   memcmp(out[1], "def", 3) == 0 &&
+		   memcmp(out[2], "gh", 2) == 0,
+		   "coalesced reads are split by the buffers");
+	unit_check(cqes[7].user_data == 3 && cqes[7].result == 0,
+		   "close result");
+	unit_check(cqes[8].result == -1 && cqes[8].error == UFS_ERR_NO_FILE,
+		   "error is returned in the completion");
+	unit_check(ufs_ring_wait(ring, cqes, 128, 1) == 0,
+		   "nothing to wait for");
+
+	/* The ring is full until completions are collected. */
+	int taken = 0;
+	while ((sqe = ufs_ring_get_sqe(ring)) != NULL) {
+		*sqe = (struct ufs_sqe){.op = UFS_OP_DELETE,
+					.filename = taken == 0 ? "file" : "none",
+					.user_data = taken};
+		++taken;
+	}
+	unit_check(taken == 128, "capacity is rounded up to a power of 2");
+	unit_check(ufs_ring_submit(ring) == 128, "full submission");
+	unsigned done = 0, n;
+	bool is_ok = true;
+	while (done < 128) {
+		n = ufs_ring_wait(ring, cqes, 50, 1);
+		for (unsigned i = 0; i < n; ++i, ++done) {
+			is_ok = is_ok && cqes[i].user_data == done &&
+				cqes[i].result == (done == 0 ? 0 : -1);
+		}
+	}
+	unit_check(is_ok, "completions are in order");
+	ufs_ring_delete(ring);
+}
+
+static void
+test_ring(void)
+{
+	unit_test_start();
+
+	test_ring_mode(false);
+	test_ring_mode(true);
+
+	unit_test_finish();
+}
+
+static void
+test_compression(void)
+{
+	unit_test_start();
+
+	struct ufs_compression_stats before, after;
+	ufs_get_compression_stats(&before);
+	const int size = 3 * 1024 * 1024;
+	char *data = malloc(size), *out = malloc(size);
+	unit_fail_if(data == NULL || out == NULL);
+	for (int i = 0; i < size; ++i)
+		data[i] = "compressible text "[i % 18] + (i / 4096) % 3;
+	ufs_set_memory_budget(1);
+	int fd = ufs_open("cold", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_get_compression_stats(&after);
+	unit_check(after.compressed_blocks > before.compressed_blocks,
+		   "a closed file is compressed");
+	unit_check(after.compressed_bytes - before.compressed_bytes <
+		   (after.original_bytes - before.original_bytes) / 4,
+		   "the data is smaller");
+
+	/* Reads and writes unpack the blocks. */
+	fd = ufs_open("cold", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, out, size, 0) == size &&
+		   memcmp(out, data, size) == 0, "the data is read back");
+	unit_fail_if(ufs_pwrite(fd, "changed", 7, 100) != 7);
+	memcpy(data + 100, "changed", 7);
+	ufs_get_compression_stats(&after);
+	unit_check(after.decompressions > before.decompressions,
+		   "decompressions are counted");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("cold", 0);
+	unit_check(ufs_pread(fd, out, size, 0) == size &&
+		   memcmp(out, data, size) == 0, "the change survives");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_delete("cold") != 0);
+	ufs_set_memory_budget(0);
+	ufs_get_compression_stats(&after);
+	unit_check(after.compressed_blocks == before.compressed_blocks &&
+		   after.compressed_bytes == before.compressed_bytes,
+		   "freed blocks leave the stats");
+	free(data);
+	free(out);
+
+	unit_test_finish();
+}
+
+struct quota_cache {
+	/** Closed files, the oldest first. */
+	char names[16][8];
+	int head;
+	int tail;
+};
+
+static void
+quota_evict(size_t need, void *ctx)
+{
+	(void)need;
+	struct quota_cache *cache = ctx;
+	if (cache->head != cache->tail)
+		ufs_delete(cache->names[cache->head++ % 16]);
+}
+
+static void
+test_quota(void)
+{
+	unit_test_start();
+
+	const int size = 256 * 1024;
+	char *data = malloc(size);
+	unit_fail_if(data == NULL);
+	memset(data, 'q', size);
+	struct ufs_memory_stats before, after;
+	ufs_get_memory_stats(&before);
+	ufs_set_quota(before.used + 1024 * 1024, NULL, NULL);
+
+	/* Without a handler the writes fail at the quota. */
+	int fd = ufs_open("quota", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int written = 0;
+	while (ufs_write(fd, data, size) == size)
+		++written;
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM && written > 0,
+		   "a write fails over the quota");
+	ufs_get_memory_stats(&after);
+	unit_check(after.used <= after.quota, "the memory is in the quota");
+	unit_check(after.quota_failures > before.quota_failures,
+		   "failures are counted");
+	unit_check(after.data_bytes + after.metadata_bytes == after.used,
+		   "data and metadata make all");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("quota") != 0);
+	ufs_get_memory_stats(&after);
+	unit_check(after.used == before.used, "a delete frees all");
+
+	/* A handler deleting the oldest files makes space for new ones. */
+	struct quota_cache cache = {.head = 0, .tail = 0};
+	ufs_set_quota(before.used + 1024 * 1024, quota_evict, &cache);
+	bool is_ok = true;
+	for (int i = 0; i < 12 && is_ok; ++i) {
+		char *name = cache.names[cache.tail % 16];
+		snprintf(name, 8, "q%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		is_ok = fd != -1 && ufs_write(fd, data, size) == size &&
+			ufs_close(fd) == 0;
+		++cache.tail;
+	}
+	unit_check(is_ok, "writes succeed with eviction");
+	ufs_get_memory_stats(&after);
+	unit_check(after.evictions > before.evictions &&
+		   after.used <= after.quota, "evictions are counted");
+	fd = ufs_open("q11", 0);
+	unit_check(fd != -1 && ufs_pread(fd, data, size, 0) == size,
+		   "the newest file is intact");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("q0", 0) == -1, "the oldest file is evicted");
+
+	while (cache.head != cache.tail)
+		ufs_delete(cache.names[cache.head++ % 16]);
+	ufs_set_quota(0, NULL, NULL);
+	ufs_get_memory_stats(&after);
+	unit_check(after.used == before.used, "all is freed");
+	free(data);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_ITERATIONS = 2000,
+	SHARED_SIZE = 64 * 1024,
+};
+
+static void *
+test_threads_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32], buf[256], out[256];
+	sprintf(name, "thread%d", id);
+	bool ok = true;
+
+	int shared = ufs_open("shared", 0);
+	int own = ufs_open(name, UFS_CREATE);
+	ok = ok && shared != -1 && own != -1;
+	for (int i = 0; ok && i < THREAD_ITERATIONS; ++i) {
+		/* Parallel readers of one file. */
+		int offset = (i * 977 + id * 131) % (SHARED_SIZE - 256);
+		ok = ufs_pread(shared, out, 256, offset) == 256;
+		for (int j = 0; ok && j < 256; ++j)
+			ok = out[j] == (char)((offset + j) % 251);
+		/* Writers of different files. */
+		memset(buf, 'a' + id, sizeof(buf));
+		ok = ok && ufs_write(own, buf, sizeof(buf)) == sizeof(buf);
+		/* Creation and deletion of the same name. */
+		int fd = ufs_open("churn", UFS_CREATE);
+		ok = ok && fd != -1 && ufs_close(fd) == 0;
+		if (ufs_delete("churn") != 0)
+			ok = ok && ufs_errno() == UFS_ERR_NO_FILE;
+	}
+	ok = ok && ufs_seek(own, 0, UFS_SEEK_SET) == 0;
+	for (int i = 0; ok && i < THREAD_ITERATIONS; ++i) {
+		ok = ufs_read(own, out, sizeof(out)) == sizeof(out);
+		for (int j = 0; ok && j < (int)sizeof(out); ++j)
+			ok = out[j] == 'a' + id;
+	}
+	ok = ok && ufs_close(own) == 0 && ufs_close(shared) == 0;
+	ok = ok && ufs_delete(name) == 0;
+	/* The error code is per thread. */
+	ok = ok && ufs_close(-1) == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+	return ok ? NULL : arg;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < SHARED_SIZE; ++i) {
+		char c = i % 251;
+		unit_fail_if(ufs_write(fd, &c, 1) != 1);
+	}
+	unit_fail_if(ufs_seek(fd, 1000, UFS_SEEK_SET) != 1000);
+	unit_fail_if(ufs_read(fd, NULL, 0) != 0);
+	unit_fail_if(ufs_seek(fd, 0, -1) != -1);
+
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_threads_worker,
+					    (void *)(intptr_t)(i + 1)) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *rc;
+		unit_fail_if(pthread_join(threads[i], &rc) != 0);
+		ok = ok && rc == NULL;
+	}
+	unit_check(ok, "all threads are fine");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "errno of the main thread is its own");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+	ufs_delete("churn");
+
+	unit_test_finish();
+}
+
+static int
+test_list_count(const char *filename, void *ctx)
+{
+	int *count = ctx;
+	if (strncmp(filename, "listed", 6) != 0)
+		return 0;
+	++*count;
+	return strcmp(filename, "listed_stop") == 0;
+}
+
+static void
+test_list(void)
+{
+	unit_test_start();
+
+	const char *names[] = {"listed1", "listed2", "listed3", "deleted"};
+	int fds[4];
+	for (int i = 0; i < 4; ++i) {
+		fds[i] = ufs_open(names[i], UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_fail_if(ufs_delete("deleted") != 0);
+	int count = 0;
+	unit_check(ufs_list(test_list_count, &count) == 0 && count == 3,
+		   "all visible files are listed, deleted are not");
+	int fd = ufs_open("listed_stop", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	count = 0;
+	unit_check(ufs_list(test_list_count, &count) == 1 && count <= 4,
+		   "the callback stops the listing");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("listed_stop") != 0);
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(ufs_close(fds[i]) != 0);
+		if (i < 3)
+			unit_fail_if(ufs_delete(names[i]) != 0);
+	}
+
+	unit_test_finish();
+}
+
+/** Count the entries of a directory, and check one of them. */
+static int
+test_dirs_count(const char *path, const char *name, bool is_dir)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	bool is_found = false;
+	const struct ufs_dirent *entry;
+	while ((entry = ufs_readdir(dir)) != NULL) {
+		++count;
+		is_found = is_found || (strcmp(entry->name, name) == 0 &&
+					entry->is_dir == is_dir);
+	}
+	ufs_closedir(dir);
+	return is_found ? count : -1;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of an existing path");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir without a parent");
+	unit_check(ufs_mkdir("a//b") == -1 && ufs_mkdir("a/..") == -1 &&
+		   ufs_mkdir("a/") == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "bad paths");
+	unit_fail_if(ufs_mkdir("a/b") != 0);
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a directory");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_check(ufs_open("a/b/file/x", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "a file is not a directory");
+	unit_check(ufs_open("a/c/file", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no parent");
+	unit_check(ufs_open("a", 0) == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "a directory can't be opened");
+	unit_check(ufs_delete("a") == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "a directory can't be deleted as a file");
+
+	unit_fail_if(ufs_mkdir("a/d") != 0);
+	unit_check(test_dirs_count("a", "b", true) == 2 &&
+		   test_dirs_count("a/b", "file", false) == 1,
+		   "entries are listed");
+	unit_check(test_dirs_count("", "a", true) >= 1, "the root is listed");
+	unit_check(ufs_opendir("a/b/file") == NULL &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "opendir of a file");
+	unit_check(ufs_rmdir("a/b") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "rmdir of a non-empty directory");
+
+	/* A moved directory takes the whole subtree. */
+	unit_check(ufs_rename("a/b", "a/b/c") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "no move into itself");
+	unit_check(ufs_rename("a/b", "a/d") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "no move onto a directory");
+	unit_check(ufs_rename("a/b", "a/d/moved") == 0, "move a directory");
+	unit_check(ufs_open("a/b/file", 0) == -1, "the old path is gone");
+	int fd2 = ufs_open("a/d/moved/file", 0);
+	char buf[8];
+	unit_check(fd2 != -1 && ufs_read(fd2, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "the file is at the new path");
+	unit_check(ufs_write(fd, "more", 4) == 4 &&
+		   ufs_pread(fd2, buf, 8, 0) == 8 &&
+		   memcmp(buf, "datamore", 8) == 0,
+		   "an opened descriptor survives the move");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(test_dirs_count("a", "d", true) == 1 &&
+		   test_dirs_count("a/d", "moved", true) == 1,
+		   "the directories are updated");
+
+	/* A file replaces a file, the old one lives while opened. */
+	fd2 = ufs_open("a/other", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_rename("a/d/moved/file", "a/other") == 0,
+		   "move a file onto a file");
+	unit_check(ufs_seek(fd2, 0, UFS_SEEK_END) == 0 &&
+		   ufs_write(fd2, "x", 1) == 1, "the replaced file is opened");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("a/other", 0);
+	unit_check(fd2 != -1 && ufs_seek(fd2, 0, UFS_SEEK_END) == 8,
+		   "the moved file has the path");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* Directories survive an image. */
+	const char *path = "/tmp/userfs_dirs.img";
+	unit_check(ufs_save(path) == 0, "save");
+	unit_fail_if(ufs_delete("a/other") != 0);
+	unit_fail_if(ufs_rmdir("a/d/moved") != 0);
+	unit_fail_if(ufs_rmdir("a/d") != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	unit_check(test_dirs_count("", "a", true) == -1, "all removed");
+	unit_check(ufs_load(path) == 0, "load");
+	unit_check(test_dirs_count("a/d", "moved", true) == 1 &&
+		   test_dirs_count("a", "other", false) == 2,
+		   "the tree is restored");
+	unit_fail_if(ufs_delete("a/other") != 0);
+	unit_fail_if(ufs_rmdir("a/d/moved") != 0);
+	unit_fail_if(ufs_rmdir("a/d") != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	remove(path);
+
+	unit_test_finish();
+}
+
+/** Drop the image and the log of a journal. */
+static void
+test_journal_remove(const char *path)
+{
+	char log_path[256];
+	sprintf(log_path, "%s.log", path);
+	remove(path);
+	remove(log_path);
+}
+
+/** Read a whole file of userfs, -1 if there is no such file. */
+static ssize_t
+test_journal_read(const char *name, char *buf, size_t size)
+{
+	int fd = ufs_open(name, 0);
+	if (fd == -1)
+		return -1;
+	ssize_t rc = ufs_read(fd, buf, size);
+	ufs_close(fd);
+	return rc;
+}
+
+/** Delete the files of test_journal(), as a restart would. */
+static void
+test_journal_wipe(void)
+{
+	unit_fail_if(ufs_delete("jd/a") != 0);
+	unit_fail_if(ufs_delete("c") != 0);
+	ufs_delete("x");
+	unit_fail_if(ufs_rmdir("jd") != 0);
+}
+
+static void
+test_journal(void)
+{
+	unit_test_start();
+
+	const char *path = "/tmp/userfs_journal.img";
+	char log_path[256], old_path[272];
+	sprintf(log_path, "%s.log", path);
+	sprintf(old_path, "%s.old", log_path);
+	test_journal_remove(path);
+	unit_check(ufs_journal_open(path, 1, 0) == 0, "open a new journal");
+	unit_check(ufs_journal_open(path, 1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "only one journal");
+
+	unit_fail_if(ufs_mkdir("jd") != 0);
+	int fd = ufs_open("jd/a", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "hello", 5) != 5);
+	unit_fail_if(ufs_pwrite(fd, " world", 6, 5) != 6);
+	struct ufs_view *view;
+	unit_fail_if(ufs_view_reserve(fd, 11, 5, &view) != 5);
+	int iovcnt;
+	const struct iovec *iov = ufs_view_iov(view, &iovcnt);
+	memcpy(iov[0].iov_base, "!!!##", 5);
+	unit_fail_if(ufs_view_commit(view, 3) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	char buf[10000], out[10000];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	fd = ufs_open("b", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_resize(fd, 6000) != 0);
+	unit_fail_if(ufs_clone("b", "jd/c") != 0);
+	unit_fail_if(ufs_rename("jd/c", "c") != 0);
+	/* Writes into a deleted file are not restored. */
+	unit_fail_if(ufs_delete("b") != 0);
+	unit_fail_if(ufs_pwrite(fd, "deleted", 7, 0) != 7);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	struct ufs_journal_stats stats;
+	ufs_get_journal_stats(&stats);
+	unit_check(stats.records >= 11 && stats.commits >= 11 &&
+		   stats.checkpoints == 1, "changes are logged and committed");
+	unit_check(ufs_journal_close() == 0, "close");
+
+	/* A restart: the memory is empty, the files are on disk. */
+	test_journal_wipe();
+	unit_check(ufs_journal_open(path, 1, 0) == 0, "reopen");
+	ufs_get_journal_stats(&stats);
+	unit_check(stats.replayed >= 11, "the log is replayed");
+	unit_check(test_journal_read("jd/a", out, sizeof(out)) == 14 &&
+		   memcmp(out, "hello world!!!", 14) == 0, "writes are restored");
+	unit_check(test_journal_read("c", out, sizeof(out)) == 6000 &&
+		   memcmp(out, buf, 6000) == 0,
+		   "resize, clone and rename are restored");
+	unit_check(test_journal_read("b", out, sizeof(out)) == -1,
+		   "deletion is restored");
+
+	/* A checkpoint starts an empty log. */
+	unit_check(ufs_checkpoint() == 0, "checkpoint");
+	ufs_get_journal_stats(&stats);
+	unit_check(stats.checkpoints == 2 && stats.log_size < 1000,
+		   "the log is truncated");
+	unit_check(call_under_view(ufs_checkpoint) == 0,
+		   "checkpoint does not wait for a view under the namespace lock");
+	fd = ufs_open("c", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1 || ufs_pwrite(fd, "new", 3, 0) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_journal_close() != 0);
+	test_journal_wipe();
+	unit_fail_if(ufs_journal_open(path, 8, 0) != 0);
+	unit_check(test_journal_read("c", out, sizeof(out)) == 6000 &&
+		   memcmp(out, "new", 3) == 0 && memcmp(out + 3, buf + 3, 100) == 0,
+		   "the checkpoint and the log after it are restored");
+
+	/*
+	 * A crash between the new image and the new log of a
+	 * checkpoint leaves the old log, its records are in the image.
+	 */
+	fd = ufs_open("x", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_close(fd) != 0);
+	unit_fail_if(ufs_journal_sync() != 0);
+	unit_fail_if(link(log_path, old_path) != 0);
+	unit_fail_if(ufs_checkpoint() != 0);
+	unit_fail_if(ufs_mkdir("jd/after") != 0);
+	unit_fail_if(ufs_journal_close() != 0);
+	unit_fail_if(rename(old_path, log_path) != 0);
+	unit_fail_if(ufs_rmdir("jd/after") != 0);
+	test_journal_wipe();
+	unit_check(ufs_journal_open(path, 1, 0) == 0, "a stale log is skipped");
+	unit_check(test_journal_read("x", out, sizeof(out)) == 0 &&
+		   ufs_rmdir("jd/after") == -1, "the image is restored");
+	unit_fail_if(ufs_journal_close() != 0);
+	test_journal_wipe();
+
+	remove(path);
+	unit_check(ufs_journal_open(path, 1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "a log without its image");
+	test_journal_remove(path);
+
+	unit_test_finish();
+}
+
+/**
+ * Workload of test_journal_crash(): appends of 64 byte records to
+ * one file, and creation and deletion of other files. The number
+ * of the last durable step goes into the pipe.
+ */
+static void
+test_journal_crash_child(const char *path, unsigned group_size, int out)
+{
+	if (ufs_journal_open(path, group_size, 64 * 1024) != 0)
+		_exit(1);
+	int fd = ufs_open("crash", UFS_CREATE);
+	if (fd == -1)
+		_exit(1);
+	char record[64], name[32];
+	for (int i = 0;; ++i) {
+		memset(record, i, sizeof(record));
+		if (ufs_write(fd, record, sizeof(record)) != sizeof(record))
+			_exit(1);
+		if (i % 10 == 0) {
+			sprintf(name, "crash_%d", i);
+			int fd2 = ufs_open(name, UFS_CREATE);
+			if (fd2 == -1 || ufs_close(fd2) != 0)
+				_exit(1);
+		}
+		if (i % 10 == 0 && i >= 20) {
+			sprintf(name, "crash_%d", i - 20);
+			if (ufs_delete(name) != 0)
+				_exit(1);
+		}
+		if (group_size > 1 && i % 16 != 15)
+			continue;
+		if (group_size > 1 && ufs_journal_sync() != 0)
+			_exit(1);
+		if (write(out, &i, sizeof(i)) != sizeof(i))
+			_exit(1);
+	}
+}
+
+/**
+ * Kill a process writing through a journal at some point, and
+ * check that the recovery restores all the changes it reported
+ * durable, and the files are as after some prefix of its steps.
+ */
+static void
+test_journal_crash(unsigned group_size, int reports)
+{
+	const char *path = "/tmp/userfs_crash.img";
+	test_journal_remove(path);
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		close(fds[0]);
+		test_journal_crash_child(path, group_size, fds[1]);
+	}
+	close(fds[1]);
+	int durable = -1, step, count = 0;
+	while (count < reports && read(fds[0], &step, sizeof(step)) == sizeof(step)) {
+		durable = step;
+		++count;
+	}
+	kill(pid, SIGKILL);
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	while (read(fds[0], &step, sizeof(step)) == sizeof(step))
+		durable = step;
+	close(fds[0]);
+	unit_msg("group of %u, killed after step %d", group_size, durable);
+	unit_fail_if(count < reports);
+
+	/* A torn record of a write cut by the crash ends the log. */
+	char log_path[256];
+	sprintf(log_path, "%s.log", path);
+	int log_fd = open(log_path, O_WRONLY | O_APPEND);
+	unit_fail_if(log_fd < 0);
+	uint32_t torn[4] = {1000, 12345, 0, 0};
+	unit_fail_if(write(log_fd, torn, sizeof(torn)) != sizeof(torn));
+	close(log_fd);
+
+	unit_check(ufs_journal_open(path, 1, 0) == 0, "recovery");
+	int fd = ufs_open("crash", 0);
+	unit_fail_if(fd == -1);
+	ssize_t size = ufs_seek(fd, 0, UFS_SEEK_END);
+	int steps = size / 64;
+	unit_check(size % 64 == 0 && steps > durable,
+		   "all durable changes are restored");
+	char record[64];
+	bool ok = true;
+	for (int i = 0; i < steps && ok; ++i) {
+		ok = ufs_pread(fd, record, 64, i * 64) == 64;
+		for (int k = 0; k < 64 && ok; ++k)
+			ok = record[k] == (char)i;
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	/* Step steps - 1 can be done in part. */
+	char name[32];
+	for (int i = 0; i < steps && ok; i += 10) {
+		sprintf(name, "crash_%d", i);
+		fd = ufs_open(name, 0);
+		if (i + 20 < steps - 1)
+			ok = fd == -1;
+		else if (i < steps - 1)
+			ok = fd != -1;
+		if (fd != -1)
+			ufs_close(fd);
+	}
+	unit_check(ok, "the files are as after a prefix of the changes");
+	unit_fail_if(ufs_journal_close() != 0);
+
+	unit_fail_if(ufs_delete("crash") != 0);
+	for (int i = 0; i < steps; i += 10) {
+		sprintf(name, "crash_%d", i);
+		ufs_delete(name);
+	}
+	test_journal_remove(path);
+}
+
+static void
+test_journal_crashes(void)
+{
+	unit_test_start();
+
+	test_journal_crash(1, 50);
+	test_journal_crash(1, 500);
+	test_journal_crash(8, 20);
+	test_journal_crash(8, 100);
+
+	unit_test_finish();
+}
+
 static void
 test_delete(void)
 {
@@ -441,6 +1922,60 @@ test_resize(void)
 #endif
 }
 
+static void
+test_resize_big(void)
+{
+#ifdef NEED_RESIZE
+	unit_test_start();
+
+	const int size = 3 * 1024 * 1024;
+	char *out = malloc(size);
+	unit_fail_if(out == NULL);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "head", 4) != 4);
+	unit_check(ufs_resize(fd, size) == 0, "grow to many blocks");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size, "the size is set");
+	int is_zero = 1;
+	unit_fail_if(ufs_pread(fd, out, size, 0) != size);
+	for (int i = 4; i < size && is_zero; ++i)
+		is_zero = out[i] == 0;
+	unit_check(memcmp(out, "head", 4) == 0 && is_zero,
+		   "the old data is kept, the new bytes are zeros");
+
+	/* A shrink of a clone does not touch the source. */
+	unit_fail_if(ufs_pwrite(fd, "tail", 4, size - 4) != 4);
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	unit_check(ufs_resize(copy, 2) == 0, "shrink a clone");
+	unit_check(ufs_resize(copy, 8) == 0 &&
+		   ufs_pread(copy, out, 8, 0) == 8 &&
+		   memcmp(out, "he\0\0\0\0\0\0", 8) == 0,
+		   "grow after shrink reads zeros");
+	unit_check(ufs_pread(fd, out, 4, size - 4) == 4 &&
+		   memcmp(out, "tail", 4) == 0, "the source is intact");
+
+	/* Regrowth does not move a descriptor back behind the shrink. */
+	unit_fail_if(ufs_seek(fd, size, UFS_SEEK_SET) != size);
+	int other = ufs_open("file", 0);
+	unit_fail_if(other == -1);
+	unit_fail_if(ufs_resize(other, 10) != 0);
+	unit_fail_if(ufs_resize(other, size) != 0);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 10,
+		   "the descriptor is at the smallest size");
+
+	unit_fail_if(ufs_close(other) != 0);
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(out);
+
+	unit_test_finish();
+#endif
+}
+
 int
 main(void)
 {
@@ -449,11 +1984,30 @@ main(void)
 	test_open();
 	test_close();
 	test_io();
+	test_positional_io();
+	test_block_borders();
+	test_buffered();
+	test_views();
+	test_image();
+	test_clone();
+	test_dedup();
+	test_vectored();
+	test_ring();
+	test_compression();
+	test_quota();
+	test_sparse();
+	test_list();
+	test_dirs();
+	test_journal();
+	test_journal_crashes();
 	test_delete();
 	test_stress_open();
+	test_descriptor_reuse();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_resize_big();
+	test_threads();
 
 	unit_test_finish();
 	return 0;
@@ -0,0 +1,393 @@
+#define FUSE_USE_VERSION 31
+
+#include "userfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/**
+ * FUSE daemon, mounting userfs as a directory of regular files,
+ * for running fio, the Assignment1 sorter and the like against
+ * it. Usage:
+ *
+ *     ./ufs_fuse [--image=path [--journal]] [fuse options] mountpoint
+ *
+ * With --image the files are loaded from the image on mount, if
+ * it exists, and saved into it on unmount. With --journal too the
+ * changes go into a log next to the image, and survive a crash,
+ * fsync waits for them to be durable. -o direct_io takes the
+ * kernel page cache out of the data path, so each read and write
+ * reaches userfs, but then files can not be mapped.
+ *
+ * Paths are userfs paths, and the root is the mount point.
+ * Attributes which userfs does not keep (owner, mode, times) are
+ * constant.
+ */
+
+struct ufs_fuse_options {
+	const char *image;
+	int is_journaled;
+};
+
+static struct ufs_fuse_options options;
+static time_t mount_time;
+
+static const struct fuse_opt ufs_fuse_opts[] = {
+	{"--image=%s", offsetof(struct ufs_fuse_options, image), 1},
+	{"--journal", offsetof(struct ufs_fuse_options, is_journaled), 1},
+	FUSE_OPT_END
+};
+
+/** The last userfs error as a negative errno. */
+static int
+ufs_fuse_error(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_FILE:
+		return -ENOENT;
+	case UFS_ERR_NO_MEM:
+		return -ENOSPC;
+	case UFS_ERR_NO_PERMISSION:
+		return -EACCES;
+	case UFS_ERR_INVALID_ARG:
+		return -EINVAL;
+	case UFS_ERR_EXISTS:
+		return -EEXIST;
+	case UFS_ERR_NOT_DIR:
+		return -ENOTDIR;
+	case UFS_ERR_IS_DIR:
+		return -EISDIR;
+	case UFS_ERR_NOT_EMPTY:
+		return -ENOTEMPTY;
+	case UFS_ERR_IO:
+		return -EIO;
+	default:
+		return -ENOSYS;
+	}
+}
+
+/** Name of a file by its path, NULL for the root. */
+static const char *
+ufs_fuse_name(const char *path)
+{
+	return path[1] == 0 ? NULL : path + 1;
+}
+
+static void
+ufs_fuse_stat_init(struct stat *st, mode_t mode)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	memset(st, 0, sizeof(*st));
+	st->st_mode = mode;
+	st->st_nlink = mode & S_IFDIR ? 2 : 1;
+	st->st_uid = ctx->uid;
+	st->st_gid = ctx->gid;
+	st->st_atime = st->st_mtime = st->st_ctime = mount_time;
+}
+
+static int
+ufs_fuse_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL) {
+		ufs_fuse_stat_init(st, S_IFDIR | 0755);
+		return 0;
+	}
+	int fd = fi != NULL ? (int)fi->fh : ufs_open(name, 0);
+	if (fd < 0 && ufs_errno() == UFS_ERR_IS_DIR) {
+		ufs_fuse_stat_init(st, S_IFDIR | 0755);
+		return 0;
+	}
+	if (fd < 0)
+		return ufs_fuse_error();
+	struct ufs_file_stats stats;
+	int rc = ufs_file_stats(fd, &stats);
+	if (fi == NULL)
+		ufs_close(fd);
+	if (rc != 0)
+		return ufs_fuse_error();
+	ufs_fuse_stat_init(st, S_IFREG | 0644);
+	st->st_size = stats.logical_bytes;
+	st->st_blksize = 4096;
+	st->st_blocks = (stats.physical_bytes + 511) / 512;
+	return 0;
+}
+
+static int
+ufs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		 off_t offset, struct fuse_file_info *fi,
+		 enum fuse_readdir_flags flags)
+{
+	(void)offset;
+	(void)fi;
+	(void)flags;
+	const char *name = ufs_fuse_name(path);
+	struct ufs_dir *dir = ufs_opendir(name != NULL ? name : "");
+	if (dir == NULL)
+		return ufs_fuse_error();
+	/* All the entries in one go, the offsets are not used. */
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	const struct ufs_dirent *entry;
+	while ((entry = ufs_readdir(dir)) != NULL &&
+	       filler(buf, entry->name, NULL, 0, 0) == 0)
+		;
+	ufs_closedir(dir);
+	return 0;
+}
+
+static int
+ufs_fuse_mkdir(const char *path, mode_t mode)
+{
+	(void)mode;
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EEXIST;
+	return ufs_mkdir(name) == 0 ? 0 : ufs_fuse_error();
+}
+
+static int
+ufs_fuse_rmdir(const char *path)
+{
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EBUSY;
+	return ufs_rmdir(name) == 0 ? 0 : ufs_fuse_error();
+}
+
+static int
+ufs_fuse_open_flags(int flags)
+{
+	switch (flags & O_ACCMODE) {
+	case O_RDONLY:
+		return UFS_READ_ONLY;
+	case O_WRONLY:
+		return UFS_WRITE_ONLY;
+	default:
+		return UFS_READ_WRITE;
+	}
+}
+
+static int
+ufs_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EISDIR;
+	int fd = ufs_open(name, ufs_fuse_open_flags(fi->flags));
+	if (fd < 0)
+		return ufs_fuse_error();
+	if ((fi->flags & O_TRUNC) && ufs_resize(fd, 0) != 0) {
+		int rc = ufs_fuse_error();
+		ufs_close(fd);
+		return rc;
+	}
+	fi->fh = fd;
+	return 0;
+}
+
+static int
+ufs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	(void)mode;
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EISDIR;
+	int fd = ufs_open(name, UFS_CREATE | ufs_fuse_open_flags(fi->flags));
+	if (fd < 0)
+		return ufs_fuse_error();
+	fi->fh = fd;
+	return 0;
+}
+
+static int
+ufs_fuse_read(const char *path, char *buf, size_t size, off_t offset,
+	      struct fuse_file_info *fi)
+{
+	(void)path;
+	ssize_t rc = ufs_pread(fi->fh, buf, size, offset);
+	return rc < 0 ? ufs_fuse_error() : (int)rc;
+}
+
+static int
+ufs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
+	       struct fuse_file_info *fi)
+{
+	(void)path;
+	ssize_t rc = ufs_pwrite(fi->fh, buf, size, offset);
+	return rc < 0 ? ufs_fuse_error() : (int)rc;
+}
+
+static int
+ufs_fuse_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EISDIR;
+	int fd = fi != NULL ? (int)fi->fh : ufs_open(name, UFS_READ_WRITE);
+	if (fd < 0)
+		return ufs_fuse_error();
+	int rc = ufs_resize(fd, size) == 0 ? 0 : ufs_fuse_error();
+	if (fi == NULL)
+		ufs_close(fd);
+	return rc;
+}
+
+static int
+ufs_fuse_unlink(const char *path)
+{
+	const char *name = ufs_fuse_name(path);
+	if (name == NULL)
+		return -EISDIR;
+	return ufs_delete(name) == 0 ? 0 : ufs_fuse_error();
+}
+
+static int
+ufs_fuse_rename(const char *from, const char *to, unsigned int flags)
+{
+	const char *src = ufs_fuse_name(from);
+	const char *dst = ufs_fuse_name(to);
+	if (src == NULL || dst == NULL)
+		return -EBUSY;
+	if (flags & RENAME_EXCHANGE)
+		return -EINVAL;
+	if (flags & RENAME_NOREPLACE) {
+		int fd = ufs_open(dst, 0);
+		if (fd >= 0)
+			ufs_close(fd);
+		if (fd >= 0 || ufs_errno() == UFS_ERR_IS_DIR)
+			return -EEXIST;
+	}
+	return ufs_rename(src, dst) == 0 ? 0 : ufs_fuse_error();
+}
+
+static int
+ufs_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;
+	return ufs_close(fi->fh) == 0 ? 0 : ufs_fuse_error();
+}
+
+/** Times are not kept, but touch and cp -p expect success. */
+static int
+ufs_fuse_utimens(const char *path, const struct timespec tv[2],
+		 struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)tv;
+	(void)fi;
+	return 0;
+}
+
+/** Without a journal the data is in memory, there is nothing to sync. */
+static int
+ufs_fuse_fsync(const char *path, int is_datasync, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)is_datasync;
+	(void)fi;
+	if (!options.is_journaled)
+		return 0;
+	return ufs_journal_sync() == 0 ? 0 : ufs_fuse_error();
+}
+
+static int
+ufs_fuse_statfs(const char *path, struct statvfs *st)
+{
+	(void)path;
+	struct ufs_memory_stats stats;
+	ufs_get_memory_stats(&stats);
+	/* Without a quota the limit is the machine memory. */
+	size_t total = stats.quota;
+	if (total == 0)
+		total = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = st->f_frsize = 4096;
+	st->f_blocks = total / 4096;
+	st->f_bfree = st->f_bavail =
+		total > stats.used ? (total - stats.used) / 4096 : 0;
+	st->f_namemax = 255;
+	return 0;
+}
+
+static void *
+ufs_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void)conn;
+	/* Inode numbers mean nothing, names are the identity. */
+	cfg->use_ino = 0;
+	mount_time = time(NULL);
+	if (options.image == NULL) {
+		options.is_journaled = 0;
+		return NULL;
+	}
+	/* A group of 64, fsync makes the rest durable. */
+	if (options.is_journaled &&
+	    ufs_journal_open(options.image, 64, 64 * 1024 * 1024) != 0) {
+		fprintf(stderr, "ufs_fuse: can't open the journal of %s\n",
+			options.image);
+		/* Saving the empty tree would overwrite the image. */
+		options.is_journaled = 0;
+		options.image = NULL;
+	} else if (!options.is_journaled &&
+		   access(options.image, F_OK) == 0 &&
+		   ufs_load(options.image) != 0)
+		fprintf(stderr, "ufs_fuse: can't load %s\n", options.image);
+	return NULL;
+}
+
+static void
+ufs_fuse_destroy(void *private_data)
+{
+	(void)private_data;
+	if (options.is_journaled) {
+		if (ufs_checkpoint() != 0 || ufs_journal_close() != 0)
+			fprintf(stderr, "ufs_fuse: can't checkpoint %s\n",
+				options.image);
+	} else if (options.image != NULL && ufs_save(options.image) != 0)
+		fprintf(stderr, "ufs_fuse: can't save %s\n", options.image);
+}
+
+static const struct fuse_operations ufs_fuse_ops = {
+	.getattr = ufs_fuse_getattr,
+	.readdir = ufs_fuse_readdir,
+	.mkdir = ufs_fuse_mkdir,
+	.rmdir = ufs_fuse_rmdir,
+	.open = ufs_fuse_open,
+	.create = ufs_fuse_create,
+	.read = ufs_fuse_read,
+	.write = ufs_fuse_write,
+	.truncate = ufs_fuse_truncate,
+	.unlink = ufs_fuse_unlink,
+	.rename = ufs_fuse_rename,
+	.release = ufs_fuse_release,
+	.utimens = ufs_fuse_utimens,
+	.fsync = ufs_fuse_fsync,
+	.statfs = ufs_fuse_statfs,
+	.init = ufs_fuse_init,
+	.destroy = ufs_fuse_destroy,
+};
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &options, ufs_fuse_opts, NULL) != 0)
+		return 1;
+	int rc = fuse_main(args.argc, args.argv, &ufs_fuse_ops, NULL);
+	fuse_opt_free_args(&args);
+	return rc;
+}
@@ -1,45 +1,183 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "lz.h"
+#include "slab.h"
 #include "userfs.h"
 
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 
+/**
+ * Blocks of a file grow: block i is UFS_MIN_BLOCK_SIZE << i bytes
+ * until UFS_MAX_BLOCK_SIZE is reached, and all the next blocks are
+ * of the maximal size. Small files stay small, and big ones are
+ * made of a few big blocks, so sequential I/O rarely crosses a
+ * block border. Both sizes must be powers of 2.
+ */
+#ifndef UFS_MIN_BLOCK_SIZE
+#define UFS_MIN_BLOCK_SIZE (4 * 1024)
+#endif
+#ifndef UFS_MAX_BLOCK_SIZE
+#define UFS_MAX_BLOCK_SIZE (1024 * 1024)
+#endif
+
 enum {
-    BLOCK_SIZE = 512,
     MAX_FILE_SIZE = 1024 * 1024 * 100,
+    /** Number of block sizes, from the minimal to the maximal. */
+    BLOCK_CLASS_COUNT = 64,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+_Static_assert((UFS_MIN_BLOCK_SIZE & (UFS_MIN_BLOCK_SIZE - 1)) == 0 &&
+               (UFS_MAX_BLOCK_SIZE & (UFS_MAX_BLOCK_SIZE - 1)) == 0 &&
+               UFS_MIN_BLOCK_SIZE <= UFS_MAX_BLOCK_SIZE,
+               "block sizes must be powers of 2, min <= max");
+
+/**
+ * Error code of the last failed call. Each thread has its own,
+ * as errno does.
+ */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
 struct block {
     /** Block memory. */
     char *memory;
-    /** How many bytes are occupied. */
-    int occupied;
-    /** Next block in the file. */
-    struct block *next;
-    /** Previous block in the file. */
-    struct block *prev;
 
     /* PUT HERE OTHER MEMBERS */
-    int idx;
     int block_size;
+    /** Slab of this header. */
+    struct slab *slab;
+    /** Slab of the memory, or NULL if the memory is in an image. */
+    struct slab *memory_slab;
+    /** Image mapping the memory belongs to, or NULL. */
+    struct ufs_image *image;
+    /**
+     * How many files share the block after clones. A shared block
+     * is copied on the first write into it.
+     */
+    int refs;
+    /** Hash of the content, valid when the block is in dedup_table. */
+    uint64_t dedup_hash;
+    /** Next block in the dedup_table bucket. */
+    struct block *dedup_next;
+    int is_dedup_indexed;
+    /**
+     * Compressed content, when the memory is given back to save
+     * space. Then memory is NULL.
+     */
+    char *compressed;
+    uint32_t compressed_size;
+    /** How many first bytes of the block are compressed. */
+    uint32_t compressed_used;
+};
+
+/**
+ * Hash table of full blocks by content, used to store equal blocks
+ * once. A block in the table is never changed in place: a writer
+ * removes it from here first, or copies it if it is shared.
+ */
+struct dedup_table {
+    /** Chains of blocks linked by dedup_next. */
+    struct block **buckets;
+    /** Number of buckets, a power of 2. */
+    size_t capacity;
+    size_t count;
 };
 
+static struct dedup_table dedup_table = {NULL, 0, 0};
+static int dedup_enabled = 0;
+static struct ufs_dedup_stats dedup_stats;
+/** Protects dedup_table and dedup_stats. */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * A mapped snapshot image. Blocks restored from it point right
+ * into the mapping, which lives until the last such block is freed.
+ */
+struct ufs_image {
+    void *base;
+    size_t size;
+    /** Number of blocks pointing into the mapping. */
+    size_t block_refs;
+};
+
+/** Block headers and block memory of each size live in slabs. */
+static struct slab_pool block_pool;
+static struct slab_pool block_memory_pools[BLOCK_CLASS_COUNT];
+static pthread_once_t block_pools_once = PTHREAD_ONCE_INIT;
+
+/** Number of growing blocks, before they reach the maximal size. */
+static inline size_t block_growing_count(void) {
+    return __builtin_ctzll(UFS_MAX_BLOCK_SIZE / UFS_MIN_BLOCK_SIZE);
+}
+
+/** Size class of block number @a i, an index in block_memory_pools. */
+static inline size_t block_class(size_t i) {
+    return MIN(i, block_growing_count());
+}
+
+static inline size_t block_size(size_t i) {
+    return (size_t)UFS_MIN_BLOCK_SIZE << block_class(i);
+}
+
+/** File offset of the first byte of block number @a i. */
+static inline size_t block_start(size_t i) {
+    size_t growing = block_growing_count();
+    if (i < growing) {
+        return (size_t)UFS_MIN_BLOCK_SIZE * ((1ULL << i) - 1);
+    }
+    return (size_t)(UFS_MAX_BLOCK_SIZE - UFS_MIN_BLOCK_SIZE) + (i - growing) * UFS_MAX_BLOCK_SIZE;
+}
+
+/** Number of the block containing a file offset, O(1). */
+static inline size_t block_by_offset(size_t offset) {
+    if (offset < UFS_MAX_BLOCK_SIZE - UFS_MIN_BLOCK_SIZE) {
+        // Growing blocks end at MIN * (2^(i+1) - 1)
+        return 63 - __builtin_clzll(offset / UFS_MIN_BLOCK_SIZE + 1);
+    }
+    return block_growing_count() + (offset - (UFS_MAX_BLOCK_SIZE - UFS_MIN_BLOCK_SIZE)) / UFS_MAX_BLOCK_SIZE;
+}
+
+/** Number of blocks needed to store @a size bytes. */
+static inline size_t block_count_for(size_t size) {
+    return size ? block_by_offset(size - 1) + 1 : 0;
+}
+
 struct file {
-    /** Double-linked list of file blocks. */
-    struct block *block_list;
     /**
-     * Last block in the list above for fast access to the end
-     * of file.
+     * Block map of the file. blocks[i] keeps the bytes starting
+     * from block_start(i), so a block by any offset is found in
+     * O(1) without walking through the previous blocks. NULL is a
+     * hole, which reads as zeros and gets memory on first write.
+     */
+    struct block **blocks;
+    /** How many blocks are in the map. */
+    size_t block_count;
+    /** Allocated size of the map. */
+    size_t block_capacity;
+    /** File size in bytes. */
+    size_t size;
+    /**
+     * Protects the block map and the size. Readers of the file go
+     * in parallel, a writer is exclusive.
+     */
+    pthread_rwlock_t lock;
+    /**
+     * How many file descriptors are opened on the file. Changed
+     * atomically under namespace_lock, at least for read.
      */
-    struct block *last_block;
-    /** How many file descriptors are opened on the file. */
     int refs;
     /** File name. */
     char *name;
@@ -49,19 +187,133 @@ struct file {
 
     /* PUT HERE OTHER MEMBERS */
     int planed_to_delete;
+    /** Number of compressed blocks in the map. */
+    size_t compressed_blocks;
+    /** Opened descriptors, to clamp them on truncation. */
+    struct filedesc *descs;
+    /**
+     * Protects the descriptor list. Not the file lock, which can
+     * be held by a view of the thread closing a descriptor.
+     */
+    pthread_mutex_t descs_lock;
+    /** Closed files are in an LRU list, the coldest are compressed first. */
+    struct file *lru_prev;
+    struct file *lru_next;
+    int is_in_lru;
     int deleted;
+    /** Hash of the name, to skip strcmp on most probes. */
+    uint32_t name_hash;
+    /**
+     * Directory of the entry, NULL when the entry is out of the
+     * namespace: deleted, or a copy in a snapshot.
+     */
+    struct file *parent;
+    /** Entries of a directory, linked by sibling_prev/next. */
+    struct file *children;
+    struct file *sibling_prev;
+    struct file *sibling_next;
+    size_t child_count;
+    /** A directory has no data, its entries are in children. */
+    int is_dir;
+    /** Number of the file in the journal records, never reused. */
+    uint64_t id;
+    /**
+     * Bumped by each change of the data or the size, under the
+     * write lock. Data read ahead by a descriptor is valid while
+     * the version is the same.
+     */
+    uint64_t version;
 };
 
+/**
+ * The root directory, "". It is not in the name index, and is
+ * never freed.
+ */
+static struct file root_dir = {.name = "", .is_dir = 1};
+
 /** List of all files. */
 static struct file *file_list = NULL;
+/** The last file number given. */
+static uint64_t file_id_max = 0;
+
+/**
+ * Protects file_list, file_index and planed_to_delete flags.
+ * Lookups go in parallel, creation and deletion are exclusive.
+ */
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Closed files, the most recently closed first. When block memory
+ * is over the budget, files from the tail are compressed.
+ */
+static struct file *lru_head = NULL;
+static struct file *lru_tail = NULL;
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Block memory budget in bytes, 0 - unlimited. */
+static size_t memory_budget = 0;
+/** Only one thread compresses at a time. */
+static pthread_mutex_t compressor_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ufs_compression_stats compression_stats;
+
+/**
+ * Open addressing (linear probing) hash table of files by name.
+ * The global one has the files visible by name, each snapshot has
+ * its own. A file planned to be deleted is removed from here, but
+ * stays in file_list until its last descriptor is closed.
+ */
+struct file_index {
+    /** Slots: NULL - empty, FILE_INDEX_TOMBSTONE - removed. */
+    struct file **slots;
+    /** Number of slots, a power of 2. */
+    uint32_t capacity;
+    /** Number of files in the table. */
+    uint32_t count;
+    /** Number of tombstone slots. */
+    uint32_t tombstones;
+};
+
+static struct file file_index_tombstone;
+#define FILE_INDEX_TOMBSTONE (&file_index_tombstone)
+
+static struct file_index file_index = {NULL, 0, 0, 0};
 
 struct filedesc {
     struct file *file;
 
     /* PUT HERE OTHER MEMBERS */
-    struct block *block_node;
-    int block_offset;
+    /** Byte position of the descriptor in the file. */
+    size_t pos;
+    /**
+     * Protects the position, when the same descriptor is used by
+     * several threads.
+     */
+    pthread_mutex_t pos_lock;
     int cnt_flags;
+    /**
+     * Smallest size the file was truncated to since the last use
+     * of the descriptor, or SIZE_MAX. A truncation can't take
+     * pos_lock under the file lock, so it leaves the bound here,
+     * and the descriptor applies it to its position on next use.
+     */
+    size_t pos_bound;
+    /** Descriptors of a file are in its list. */
+    struct filedesc *file_prev;
+    struct filedesc *file_next;
+    /**
+     * Data read ahead for small sequential reads, or small
+     * sequential writes of a UFS_BUFFERED descriptor, which are
+     * not in the file yet. NULL until needed. Protected by
+     * pos_lock, as the fields below.
+     */
+    char *buf;
+    /** File range of the buffer data. */
+    size_t buf_offset;
+    size_t buf_size;
+    int buf_is_dirty;
+    /** File version of the read ahead data. */
+    uint64_t buf_version;
+    /** End of the last read or write, to detect sequential access. */
+    size_t seq_end;
 };
 
 /**
@@ -71,9 +323,40 @@ struct filedesc {
  * taken by next ufs_open() call.
  */
 static struct filedesc **file_descriptors = NULL;
+/** Index of the last used descriptor + 1. */
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
 
+enum {
+    /** Minimal capacity of the descriptor table, one bitmap word. */
+    FD_TABLE_MIN_CAPACITY = 64,
+    /** Size of a descriptor buffer. */
+    FILEDESC_BUF_SIZE = 64 * 1024,
+    /**
+     * Reads and writes smaller than this go through the buffer.
+     * Not more than a block, so the rest of a write which fills
+     * the buffer fits the next one.
+     */
+    FILEDESC_SMALL_IO = MIN(4 * 1024, UFS_MIN_BLOCK_SIZE),
+};
+
+/**
+ * Two-level bitmap of free descriptor slots, used to find the
+ * lowest free one with a couple of find-first-set instructions.
+ * A bit in fd_free_bits is set when the slot is free. A bit in
+ * fd_free_summary is set when the corresponding word of
+ * fd_free_bits has any free slot. One summary word covers 4096
+ * descriptors.
+ */
+static uint64_t *fd_free_bits = NULL;
+static uint64_t *fd_free_summary = NULL;
+
+/**
+ * Protects the descriptor table and the bitmaps. Lookups go in
+ * parallel, open and close are exclusive.
+ */
+static pthread_rwlock_t fd_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 void assign_error_code(enum ufs_error_code u_e_c) {
 	// Assigns the specified error code to the global variable ufs_error_code
 	ufs_error_code = u_e_c;
@@ -84,7 +367,375 @@ enum ufs_error_code ufs_errno() {
 	return ufs_error_code; 
 }
 
+/**
+ * Memory of files, blocks and block maps, in bytes. Data of blocks
+ * restored from an image lives in the mapping and is not counted.
+ */
+static size_t memory_used = 0;
+static size_t memory_data = 0;
+static size_t memory_metadata = 0;
+/** Limit of memory_used, 0 - unlimited. */
+static size_t memory_quota = 0;
+static size_t quota_failures = 0;
+static size_t evictions = 0;
+static ufs_evict_f evict_handler = NULL;
+static void *evict_ctx = NULL;
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+/** How much the last failed charge of this thread was over the quota. */
+static __thread size_t memory_shortage = 0;
+
+/**
+ * Account memory of data and metadata. A checked charge fails,
+ * when it would take the memory over the quota.
+ * @retval -1 Over the quota, the memory is not charged.
+ */
+static int memory_charge(size_t data, size_t metadata, bool is_checked) {
+    size_t bytes = data + metadata;
+    size_t used = __atomic_load_n(&memory_used, __ATOMIC_RELAXED);
+    do {
+        size_t quota = __atomic_load_n(&memory_quota, __ATOMIC_RELAXED);
+        if (is_checked && quota && used + bytes > quota) {
+            memory_shortage = used + bytes - quota;
+            __atomic_add_fetch(&quota_failures, 1, __ATOMIC_RELAXED);
+            assign_error_code(UFS_ERR_NO_MEM);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&memory_used, &used, used + bytes, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    __atomic_add_fetch(&memory_data, data, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memory_metadata, metadata, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void memory_uncharge(size_t data, size_t metadata) {
+    __atomic_sub_fetch(&memory_used, data + metadata, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory_data, data, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory_metadata, metadata, __ATOMIC_RELAXED);
+}
+
+/**
+ * Give the eviction handler a chance to free memory after a call
+ * failed by the quota. Must be called without any userfs locks,
+ * the handler can delete files.
+ * @retval true The handler was called, the call can be retried.
+ */
+static bool memory_evict(void) {
+    size_t need = memory_shortage;
+    memory_shortage = 0;
+    if (!need || ufs_error_code != UFS_ERR_NO_MEM) {
+        return false;
+    }
+    pthread_mutex_lock(&evict_lock);
+    ufs_evict_f handler = evict_handler;
+    void *ctx = evict_ctx;
+    pthread_mutex_unlock(&evict_lock);
+    if (!handler) {
+        return false;
+    }
+    __atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+    handler(need, ctx);
+    return true;
+}
+
+void ufs_set_quota(size_t bytes, ufs_evict_f handler, void *ctx) {
+    __atomic_store_n(&memory_quota, bytes, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&evict_lock);
+    evict_handler = handler;
+    evict_ctx = ctx;
+    pthread_mutex_unlock(&evict_lock);
+}
+
+void ufs_get_memory_stats(struct ufs_memory_stats *stats) {
+    stats->used = __atomic_load_n(&memory_used, __ATOMIC_RELAXED);
+    stats->data_bytes = __atomic_load_n(&memory_data, __ATOMIC_RELAXED);
+    stats->metadata_bytes = __atomic_load_n(&memory_metadata, __ATOMIC_RELAXED);
+    stats->quota = __atomic_load_n(&memory_quota, __ATOMIC_RELAXED);
+    stats->quota_failures = __atomic_load_n(&quota_failures, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+}
+
+/**
+ * Journal of changes, NULL when they are not journaled. Each
+ * change appends a redo record under the lock which orders it
+ * against other changes of the same files, and the record is
+ * committed at the end of the call, without userfs locks.
+ */
+static struct journal *journal = NULL;
+/** Path of the checkpoint image. */
+static char *journal_image_path = NULL;
+/** Size of the log which triggers a checkpoint, 0 - never. */
+static size_t journal_checkpoint_size = 0;
+static size_t journal_checkpoints = 0;
+static size_t journal_replayed = 0;
+/** The last record of the calling thread, not committed yet. */
+static __thread uint64_t journal_lsn = 0;
+
+/** Checkpoints go one at a time. */
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Background thread making checkpoints when the log is big. */
+static pthread_t checkpointer;
+static int has_checkpointer = 0;
+static int is_checkpoint_wanted = 0;
+static int is_checkpointer_stopping = 0;
+static pthread_mutex_t checkpointer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpointer_cond = PTHREAD_COND_INITIALIZER;
+
+/** Types of redo records. */
+enum {
+    /** A file or a directory of the checkpoint, found by the path. */
+    REDO_BIND,
+    /** Creation of a file at the path, or of a directory if arg is 1. */
+    REDO_CREATE,
+    /** Deletion of a file or a directory. */
+    REDO_DELETE,
+    /** Move of an entry to the path. */
+    REDO_RENAME,
+    /** Copy of file number arg under the path. */
+    REDO_CLONE,
+    /** Write of the data at offset arg. */
+    REDO_WRITE,
+    /** Resize to arg bytes. */
+    REDO_RESIZE,
+};
+
+/**
+ * Head of a redo record, followed by a zero-terminated path or by
+ * the data of a write. Files are named by numbers, which survive
+ * renames and are not reused by new files with the same path.
+ */
+struct redo_head {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t id;
+    uint64_t arg;
+};
+
+/** Append a redo record, if the changes are journaled. */
+static void redo_log(uint32_t type, uint64_t id, uint64_t arg, const struct iovec *iov, int iovcnt) {
+    if (!journal) {
+        return;
+    }
+    struct redo_head head = {type, 0, id, arg};
+    journal_lsn = journal_append(journal, &head, sizeof(head), iov, iovcnt);
+}
+
+static void redo_log_path(uint32_t type, uint64_t id, uint64_t arg, const char *path) {
+    struct iovec iov = {(void *)path, strlen(path) + 1};
+    redo_log(type, id, arg, &iov, 1);
+}
+
+/**
+ * Commit the records of the call, if their group is full, and
+ * wake the checkpointer up if the log is too big.
+ * @retval -1 The changes are made, but can't be made durable.
+ */
+static int journal_finish(void) {
+    uint64_t lsn = journal_lsn;
+    if (!lsn) {
+        return 0;
+    }
+    journal_lsn = 0;
+    if (journal_commit(journal, lsn, false) != 0) {
+        assign_error_code(UFS_ERR_IO);
+        return -1;
+    }
+    if (journal_checkpoint_size) {
+        struct journal_stats stats;
+        journal_get_stats(journal, &stats);
+        if (stats.size >= journal_checkpoint_size) {
+            pthread_mutex_lock(&checkpointer_lock);
+            is_checkpoint_wanted = 1;
+            pthread_cond_signal(&checkpointer_cond);
+            pthread_mutex_unlock(&checkpointer_lock);
+        }
+    }
+    return 0;
+}
+
+static void fd_mark_free(int fd) {
+    fd_free_bits[fd / 64] |= 1ULL << (fd % 64);
+    fd_free_summary[fd / 4096] |= 1ULL << (fd / 64 % 64);
+}
+
+static void fd_mark_used(int fd) {
+    fd_free_bits[fd / 64] &= ~(1ULL << (fd % 64));
+    if (!fd_free_bits[fd / 64]) {
+        fd_free_summary[fd / 4096] &= ~(1ULL << (fd / 64 % 64));
+    }
+}
+
+/** Lowest free slot, or -1 if the table is full. */
+static int fd_find_free(void) {
+    int summary_words = (file_descriptor_capacity + 4095) / 4096;
+    for (int i = 0; i < summary_words; i++) {
+        if (fd_free_summary[i]) {
+            int word = i * 64 + __builtin_ctzll(fd_free_summary[i]);
+            return word * 64 + __builtin_ctzll(fd_free_bits[word]);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Grow or shrink the descriptor table. All the slots from
+ * file_descriptor_count are free, so shrinking drops only free
+ * slots.
+ */
+static int fd_table_resize(int new_capacity) {
+    int old_capacity = file_descriptor_capacity;
+    int words = new_capacity / 64;
+    int summary_words = (words + 63) / 64;
+    struct filedesc **descriptors = realloc(file_descriptors, new_capacity * sizeof(struct filedesc *));
+    if (!descriptors) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    file_descriptors = descriptors;
+    uint64_t *bits = realloc(fd_free_bits, words * sizeof(uint64_t));
+    uint64_t *summary = realloc(fd_free_summary, summary_words * sizeof(uint64_t));
+    if (bits) {
+        fd_free_bits = bits;
+    }
+    if (summary) {
+        fd_free_summary = summary;
+    }
+    if (!bits || !summary) {
+        // A shrink can't fail, so this is a grow and the old size is still valid
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    if (new_capacity > old_capacity) {
+        memset(file_descriptors + old_capacity, 0, (new_capacity - old_capacity) * sizeof(struct filedesc *));
+        memset(fd_free_bits + old_capacity / 64, 0xff, (new_capacity - old_capacity) / 8);
+    }
+    // Rebuild the summary, it is tiny
+    memset(fd_free_summary, 0, summary_words * sizeof(uint64_t));
+    for (int i = 0; i < words; i++) {
+        if (fd_free_bits[i]) {
+            fd_free_summary[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+    file_descriptor_capacity = new_capacity;
+    return 0;
+}
+
+/** FNV-1a hash of the first @a len bytes of a file name. */
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Find a file by the first @a len bytes of a name in an index. */
+static struct file *file_index_find_n(struct file_index *index, const char *filename, size_t len) {
+    if (!index->count) {
+        return NULL;
+    }
+    uint32_t hash = name_hash(filename, len);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        struct file *file = index->slots[i];
+        if (!file) {
+            return NULL;
+        }
+        if (file != FILE_INDEX_TOMBSTONE && file->name_hash == hash &&
+            !strncmp(file->name, filename, len) && !file->name[len]) {
+            return file;
+        }
+    }
+}
+
+/** Find a file by its name in an index. */
+static struct file *file_index_find(struct file_index *index, const char *filename) {
+    return file_index_find_n(index, filename, strlen(filename));
+}
+
+/** Rebuild the table with a new capacity, dropping tombstones. */
+static int file_index_rehash(struct file_index *index, uint32_t new_capacity) {
+    struct file **slots = calloc(new_capacity, sizeof(struct file *));
+    if (!slots) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    uint32_t mask = new_capacity - 1;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        struct file *file = index->slots[i];
+        if (!file || file == FILE_INDEX_TOMBSTONE) {
+            continue;
+        }
+        uint32_t j = file->name_hash & mask;
+        while (slots[j]) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = file;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = new_capacity;
+    index->tombstones = 0;
+    return 0;
+}
+
+/**
+ * Make room for @a extra more files, so the next insertions of
+ * that many can't fail, even after removals.
+ */
+static int file_index_reserve(struct file_index *index, uint32_t extra) {
+    if ((index->count + index->tombstones + extra + 1) * 4 <= index->capacity * 3) {
+        return 0;
+    }
+    uint32_t new_capacity = index->capacity ? index->capacity : 16;
+    while ((index->count + extra + 1) * 4 > new_capacity * 3) {
+        new_capacity *= 2;
+    }
+    return file_index_rehash(index, new_capacity);
+}
+
+/** Add a file, which is known to be absent in the table. */
+static int file_index_insert(struct file_index *index, struct file *file) {
+    // Keep the load (including tombstones) under 3/4 for short probes
+    if ((index->count + index->tombstones + 1) * 4 > index->capacity * 3) {
+        uint32_t new_capacity = index->capacity ? index->capacity : 16;
+        if ((index->count + 1) * 2 > new_capacity) {
+            new_capacity *= 2;
+        }
+        if (file_index_rehash(index, new_capacity) != 0) {
+            return -1;
+        }
+    }
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = file->name_hash & mask;
+    while (index->slots[i] && index->slots[i] != FILE_INDEX_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (index->slots[i] == FILE_INDEX_TOMBSTONE) {
+        index->tombstones--;
+    }
+    index->slots[i] = file;
+    index->count++;
+    return 0;
+}
+
+/** Remove a file from the table. It has to be there. */
+static void file_index_remove(struct file_index *index, struct file *file) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = file->name_hash & mask;
+    while (index->slots[i] != file) {
+        i = (i + 1) & mask;
+    }
+    index->slots[i] = FILE_INDEX_TOMBSTONE;
+    index->count--;
+    index->tombstones++;
+}
+
 struct file *new_file(const char *filename) {
+    size_t charge = sizeof(struct file) + strlen(filename) + 1;
+    if (memory_charge(0, charge, true) != 0) {
+        return NULL;
+    }
     // Allocates memory for a new file
     struct file *file = malloc(sizeof(struct file));
     if (file) {
@@ -92,22 +743,37 @@ struct file *new_file(const char *filename) {
         file->name = strdup(filename);
 		if (file->name) {
 			// Initializes the file attributes
-			file->block_list = NULL;
-			file->last_block = NULL;
+			file->blocks = NULL;
+			file->block_count = 0;
+			file->block_capacity = 0;
+			file->size = 0;
+			pthread_rwlock_init(&file->lock, NULL);
 			file->refs = 0;
 			file->prev = NULL;
 			file->next = file_list;
 			file->planed_to_delete = 0;
 			file->deleted = 0;
+			file->compressed_blocks = 0;
+			file->descs = NULL;
+			pthread_mutex_init(&file->descs_lock, NULL);
+			file->is_in_lru = 0;
+			file->name_hash = name_hash(filename, strlen(filename));
+			file->parent = NULL;
+			file->children = NULL;
+			file->child_count = 0;
+			file->is_dir = 0;
+			file->id = __atomic_add_fetch(&file_id_max, 1, __ATOMIC_RELAXED);
 		} else {
 			// Frees the allocated memory and assigns UFS_ERR_NO_MEM error code if strdup fails
 			free(file);
+			memory_uncharge(0, charge);
 			assign_error_code(UFS_ERR_NO_MEM);
 			return NULL;
 		}
 	}
 	else {
 		// Assigns UFS_ERR_NO_MEM error code if memory allocation fails
+		memory_uncharge(0, charge);
 		assign_error_code(UFS_ERR_NO_MEM);
         return NULL;
 	}
@@ -116,15 +782,188 @@ struct file *new_file(const char *filename) {
     return file;
 }
 
-int ufs_open(const char *filename, int cnt_flags) {
-    // Find the file with the given filename
-    struct file *file = file_list;
-	while (file) {
-        if (!file->planed_to_delete && !strcmp(file->name, filename)) {
-            break;
+static void free_file(struct file *file);
+static void file_destroy(struct file *file);
+static int filedesc_open(struct file *file, int cnt_flags);
+static void filedesc_unlink(struct filedesc *filedesc);
+
+/** Add a file to the file list. namespace_lock is held for write. */
+static void file_list_add(struct file *file) {
+    file->prev = NULL;
+    file->next = file_list;
+    if (file_list) {
+        file_list->prev = file;
+    }
+    file_list = file;
+}
+
+/**
+ * Check a path of a new entry: components are separated by single
+ * slashes, and none of them is empty, "." or "..".
+ */
+static int path_is_valid(const char *path) {
+    const char *component = path;
+    for (const char *p = path;; p++) {
+        if (*p && *p != '/') {
+            continue;
+        }
+        size_t len = p - component;
+        if (len == 0 || (len == 1 && component[0] == '.') ||
+            (len == 2 && component[0] == '.' && component[1] == '.')) {
+            return 0;
+        }
+        if (!*p) {
+            return 1;
         }
-		file = file->next;
+        component = p + 1;
+    }
+}
+
+/**
+ * Directory of the entry with the path in an index, found by its
+ * full path. namespace_lock is held.
+ * @retval NULL No such directory, the error is set.
+ */
+static struct file *dir_of_path(struct file_index *index, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return &root_dir;
+    }
+    struct file *dir = file_index_find_n(index, path, slash - path);
+    if (!dir) {
+        assign_error_code(UFS_ERR_NO_FILE);
+        return NULL;
+    }
+    if (!dir->is_dir) {
+        assign_error_code(UFS_ERR_NOT_DIR);
+        return NULL;
+    }
+    return dir;
+}
+
+/** Directory to create an entry in, with the path checked. */
+static struct file *dir_for_new(const char *path) {
+    if (!path_is_valid(path)) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return NULL;
+    }
+    return dir_of_path(&file_index, path);
+}
+
+/** Add an entry to a directory. namespace_lock is held for write. */
+static void dir_link(struct file *dir, struct file *file) {
+    file->parent = dir;
+    file->sibling_prev = NULL;
+    file->sibling_next = dir->children;
+    if (dir->children) {
+        dir->children->sibling_prev = file;
+    }
+    dir->children = file;
+    dir->child_count++;
+}
+
+/** Remove an entry from its directory. namespace_lock is held for write. */
+static void dir_unlink(struct file *file) {
+    struct file *dir = file->parent;
+    if (file->sibling_prev) {
+        file->sibling_prev->sibling_next = file->sibling_next;
+    } else {
+        dir->children = file->sibling_next;
+    }
+    if (file->sibling_next) {
+        file->sibling_next->sibling_prev = file->sibling_prev;
+    }
+    dir->child_count--;
+    file->parent = NULL;
+}
+
+static void lru_remove_locked(struct file *file) {
+    if (!file->is_in_lru) {
+        return;
+    }
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        lru_tail = file->lru_prev;
+    }
+    file->is_in_lru = 0;
+}
+
+/** An opened or freed file is not a candidate for compression. */
+static void lru_remove(struct file *file) {
+    pthread_mutex_lock(&lru_lock);
+    lru_remove_locked(file);
+    pthread_mutex_unlock(&lru_lock);
+}
+
+/** Make a file the most recent one. lru_lock is held. */
+static void lru_add_locked(struct file *file) {
+    lru_remove_locked(file);
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = file;
+    } else {
+        lru_tail = file;
+    }
+    lru_head = file;
+    file->is_in_lru = 1;
+}
+
+/**
+ * A closed file becomes the most recent one. The reference count
+ * is checked under lru_lock, so a close racing with an open can't
+ * put the opened file here after the open removed it.
+ */
+static void lru_add(struct file *file) {
+    pthread_mutex_lock(&lru_lock);
+    if (__atomic_load_n(&file->refs, __ATOMIC_ACQUIRE) != 0) {
+        pthread_mutex_unlock(&lru_lock);
+        return;
     }
+    lru_add_locked(file);
+    pthread_mutex_unlock(&lru_lock);
+}
+
+/**
+ * Drop a reference of an opened file. The last reference of a
+ * deleted file frees it.
+ */
+static void file_unref(struct file *file) {
+    // Deletion sets the flag under the write lock, so it can't change here
+    pthread_rwlock_rdlock(&namespace_lock);
+    int refs = __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    int is_last = refs == 0 && file->planed_to_delete;
+    if (refs == 0 && !file->planed_to_delete) {
+        lru_add(file);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    if (is_last) {
+        // The file is invisible by name, nobody can take it again
+        pthread_rwlock_wrlock(&namespace_lock);
+        free_file(file);
+        pthread_rwlock_unlock(&namespace_lock);
+    }
+}
+
+static int file_try_open(const char *filename, int cnt_flags) {
+    // Find the file with the given filename
+    pthread_rwlock_rdlock(&namespace_lock);
+    struct file *file = file_index_find(&file_index, filename);
+    if (file && file->is_dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_IS_DIR);
+        return -1;
+    }
+    if (file) {
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
 
     if (!file) {
         // If the file does not exist
@@ -132,321 +971,2849 @@ int ufs_open(const char *filename, int cnt_flags) {
             // Check if UFS_CREATE flag is not set
 			assign_error_code(UFS_ERR_NO_FILE);
 			return -1;
-		} else {
+		}
+        pthread_rwlock_wrlock(&namespace_lock);
+        // Another thread could create it while the lock was free
+        file = file_index_find(&file_index, filename);
+        if (!file) {
             // Create a new file
-			file = new_file(filename);
+            struct file *dir = dir_for_new(filename);
+			file = dir ? new_file(filename) : NULL;
 			if (!file) {
+				pthread_rwlock_unlock(&namespace_lock);
 				return -1;
 			}
 
-			// Add the new file to the file list
-			if (file_list) {
-				file_list->prev = file;
+			if (file_index_insert(&file_index, file) != 0) {
+				pthread_rwlock_unlock(&namespace_lock);
+				file_destroy(file);
+				return -1;
 			}
-			file_list = file;
-		}
-	}
 
-    // Find an available file descriptor slot
-    int fd = -1;
-	for (int i = 0; i < file_descriptor_count; i++) {
-		if (!file_descriptors[i]) {
-			fd = i;
-			break;
+			file_list_add(file);
+			dir_link(dir, file);
+			redo_log_path(REDO_CREATE, file->id, 0, filename);
+		} else if (file->is_dir) {
+			pthread_rwlock_unlock(&namespace_lock);
+			assign_error_code(UFS_ERR_IS_DIR);
+			return -1;
 		}
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+        pthread_rwlock_unlock(&namespace_lock);
 	}
+    lru_remove(file);
+    return filedesc_open(file, cnt_flags);
+}
 
-	// If no available slot is found, use the next index
-	if (fd == -1) {
-		fd = file_descriptor_count;
-	}
+int ufs_open(const char *filename, int cnt_flags) {
+    memory_shortage = 0;
+    int fd = file_try_open(filename, cnt_flags);
+    if (fd < 0 && memory_evict()) {
+        fd = file_try_open(filename, cnt_flags);
+    }
+    if (fd >= 0 && journal_finish() != 0) {
+        ufs_close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    // Increase the file descriptor count if necessary and resize the file descriptors array
-    if (fd == file_descriptor_count) {
-    	file_descriptor_count++;
-		if (fd >= file_descriptor_capacity) {
-			// Calculate the new capacity for the file descriptors array
-			int new_capacity = (!file_descriptor_capacity) ? 1 : file_descriptor_capacity * 2;
-
-			// Reallocate memory for the file descriptors array with the new capacity
-			struct filedesc** new_descriptors = realloc(file_descriptors, new_capacity * sizeof(struct filedesc *));
-			if (new_descriptors) {
-				// Initialize the newly allocated memory with zeros
-				memset(new_descriptors + file_descriptor_capacity, 0, (new_capacity - file_descriptor_capacity) * sizeof(struct filedesc *));
-				file_descriptors = new_descriptors;
-				file_descriptor_capacity = new_capacity;
-			} else {
-				// Assign UFS_ERR_NO_MEM error code if memory reallocation fails
-				assign_error_code(UFS_ERR_NO_MEM);
-				return -1;
-			}
-		}
-	}
+/** Remove a descriptor from the list of its file. */
+static void filedesc_unlink(struct filedesc *filedesc) {
+    struct file *file = filedesc->file;
+    pthread_mutex_lock(&file->descs_lock);
+    if (filedesc->file_prev) {
+        filedesc->file_prev->file_next = filedesc->file_next;
+    } else {
+        file->descs = filedesc->file_next;
+    }
+    if (filedesc->file_next) {
+        filedesc->file_next->file_prev = filedesc->file_prev;
+    }
+    pthread_mutex_unlock(&file->descs_lock);
+}
+
+/**
+ * Position of a descriptor, moved back to the smallest size the
+ * file was truncated to since the last call. pos_lock is held.
+ */
+static size_t filedesc_pos(struct filedesc *filedesc) {
+    size_t bound = __atomic_exchange_n(&filedesc->pos_bound, SIZE_MAX, __ATOMIC_ACQ_REL);
+    if (bound < filedesc->pos) {
+        filedesc->pos = bound;
+    }
+    return filedesc->pos;
+}
 
+/**
+ * Open a descriptor on a file, which is already referenced for it.
+ * The reference is dropped on failure.
+ */
+static int filedesc_open(struct file *file, int cnt_flags) {
     // Create a new file descriptor for the file
     struct filedesc *filedesc = malloc(sizeof(struct filedesc));
     if (filedesc) {
         // Initialize the file descriptor attributes
         filedesc->file = file;
-        filedesc->block_node = file->block_list;
-        filedesc->block_offset = 0;
+        filedesc->pos = 0;
+        pthread_mutex_init(&filedesc->pos_lock, NULL);
         filedesc->cnt_flags = cnt_flags;
+        filedesc->pos_bound = SIZE_MAX;
+        filedesc->buf = NULL;
+        filedesc->buf_offset = 0;
+        filedesc->buf_size = 0;
+        filedesc->buf_is_dirty = 0;
+        filedesc->buf_version = 0;
+        filedesc->seq_end = 0;
+        pthread_mutex_lock(&file->descs_lock);
+        filedesc->file_prev = NULL;
+        filedesc->file_next = file->descs;
+        if (file->descs) {
+            file->descs->file_prev = filedesc;
+        }
+        file->descs = filedesc;
+        pthread_mutex_unlock(&file->descs_lock);
     } else {
         assign_error_code(UFS_ERR_NO_MEM);
+        file_unref(file);
 		return -1;
 	}
 
+    // Take the lowest free descriptor slot, grow the table if there is none
+    pthread_rwlock_wrlock(&fd_table_lock);
+    int fd = fd_find_free();
+    if (fd == -1) {
+        int new_capacity = file_descriptor_capacity ? file_descriptor_capacity * 2 : FD_TABLE_MIN_CAPACITY;
+        if (fd_table_resize(new_capacity) != 0) {
+            pthread_rwlock_unlock(&fd_table_lock);
+            filedesc_unlink(filedesc);
+            pthread_mutex_destroy(&filedesc->pos_lock);
+            free(filedesc);
+            file_unref(file);
+            return -1;
+        }
+        fd = fd_find_free();
+    }
+
     // Assign the file descriptor to the file descriptors array at the corresponding index
     file_descriptors[fd] = filedesc;
-    file->refs++;
+    fd_mark_used(fd);
+    if (fd >= file_descriptor_count) {
+        file_descriptor_count = fd + 1;
+    }
+    pthread_rwlock_unlock(&fd_table_lock);
 
     return fd;
 }
 
-struct block *new_block_node() {
-    // Allocates memory for a new block node
-    struct block *block_node = malloc(sizeof(struct block));
-    if (block_node) {
-		// Initializes the block node attributes
-		block_node->memory = malloc(BLOCK_SIZE);
-		block_node->occupied = 0;
-		block_node->next = NULL;
-		block_node->prev = NULL;
-		block_node->idx = 0;
-		block_node->block_size = BLOCK_SIZE;
-	} else {
-		// Assigns UFS_ERR_NO_MEM error code if memory allocation fails
-		assign_error_code(UFS_ERR_NO_MEM);
+static void block_pools_create(void) {
+    slab_pool_create(&block_pool, sizeof(struct block), 1, 16 * 1024);
+    for (size_t i = 0; i <= block_growing_count(); i++) {
+        slab_pool_create(&block_memory_pools[i], (size_t)UFS_MIN_BLOCK_SIZE << i, 1, 256 * 1024);
+    }
+}
+
+/** Allocate block number @a i of a file. */
+struct block *new_block_node(size_t i) {
+    pthread_once(&block_pools_once, block_pools_create);
+    if (memory_charge(block_size(i), sizeof(struct block), true) != 0) {
         return NULL;
-	}
-	
-    // Returns the new block node
+    }
+    struct slab *slab;
+    struct block *block_node = slab_alloc(&block_pool, &slab);
+    if (!block_node) {
+        memory_uncharge(block_size(i), sizeof(struct block));
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    block_node->slab = slab;
+    block_node->image = NULL;
+    block_node->refs = 1;
+    block_node->is_dedup_indexed = 0;
+    block_node->compressed = NULL;
+    block_node->block_size = block_size(i);
+    block_node->memory = slab_alloc(&block_memory_pools[block_class(i)], &block_node->memory_slab);
+    if (!block_node->memory) {
+        slab_free(&block_pool, slab, block_node);
+        memory_uncharge(block_size(i), sizeof(struct block));
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
     return block_node;
 }
 
-ssize_t ufs_write(int fd, const char *buf, size_t size) {
-    ssize_t bytes_cnt = 0;
+/** Return a block and its memory to the slabs. */
+static void dedup_remove(struct block *block_node);
+
+static void free_block_node(struct block *block_node, size_t i) {
+    if (__atomic_load_n(&block_node->is_dedup_indexed, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&dedup_lock);
+        dedup_remove(block_node);
+        pthread_mutex_unlock(&dedup_lock);
+    }
+    struct ufs_image *image = block_node->image;
+    if (block_node->compressed) {
+        __atomic_sub_fetch(&compression_stats.compressed_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compression_stats.original_bytes, block_node->compressed_used, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compression_stats.compressed_bytes, block_node->compressed_size, __ATOMIC_RELAXED);
+        free(block_node->compressed);
+        memory_uncharge(block_node->compressed_size, 0);
+    } else if (image) {
+        if (__atomic_sub_fetch(&image->block_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            munmap(image->base, image->size);
+            free(image);
+        }
+    } else {
+        slab_free(&block_memory_pools[block_class(i)], block_node->memory_slab, block_node->memory);
+        memory_uncharge(block_size(i), 0);
+    }
+    slab_free(&block_pool, block_node->slab, block_node);
+    memory_uncharge(0, sizeof(struct block));
+}
+
+/** Drop a file's reference of block number @a i. */
+static void block_unref(struct block *block_node, size_t i) {
+    if (__atomic_sub_fetch(&block_node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_block_node(block_node, i);
+    }
+}
 
-	// Check if the file descriptor is valid
+/** Check a descriptor number and return the descriptor. fd_table_lock is held. */
+static struct filedesc *lookup_filedesc(int fd) {
     if (fd < 0 || fd >= file_descriptor_count || !file_descriptors[fd]) {
         assign_error_code(UFS_ERR_NO_FILE);
-        return -1;
+        return NULL;
     }
+    return file_descriptors[fd];
+}
 
-    // Get the file descriptor and check if it has write permissions
-    struct filedesc *filedesc = file_descriptors[fd];
-    if (filedesc->cnt_flags & UFS_READ_ONLY) {
-        assign_error_code(UFS_ERR_NO_PERMISSION);
-        return -1;
-    }
+/**
+ * Check a descriptor number and return the descriptor. It stays
+ * valid until the descriptor is closed, which the caller must not
+ * do in parallel with using it.
+ */
+static struct filedesc *get_filedesc(int fd) {
+    pthread_rwlock_rdlock(&fd_table_lock);
+    struct filedesc *filedesc = lookup_filedesc(fd);
+    pthread_rwlock_unlock(&fd_table_lock);
+    return filedesc;
+}
 
-    // Get the file associated with the file descriptor
-    struct file *file = filedesc->file;
+/**
+ * Make the block map of the file have at least @a count blocks.
+ * The new blocks are holes.
+ */
+static int file_reserve_blocks(struct file *file, size_t count) {
+    if (count > file->block_capacity) {
+        // Grow the map geometrically, so appends are amortized O(1)
+        size_t new_capacity = MAX(file->block_capacity * 2, 8);
+        new_capacity = MAX(new_capacity, count);
+        size_t charge = (new_capacity - file->block_capacity) * sizeof(struct block *);
+        if (memory_charge(0, charge, true) != 0) {
+            return -1;
+        }
+        struct block **blocks = realloc(file->blocks, new_capacity * sizeof(struct block *));
+        if (!blocks) {
+            memory_uncharge(0, charge);
+            assign_error_code(UFS_ERR_NO_MEM);
+            return -1;
+        }
+        file->blocks = blocks;
+        file->block_capacity = new_capacity;
+    }
+    while (file->block_count < count) {
+        file->blocks[file->block_count++] = NULL;
+    }
+    return 0;
+}
 
-    // Create a new block if the file doesn't have a block list
-    if (!file->block_list) {
-        file->block_list = new_block_node();
-        if (!file->block_list) {
+/**
+ * Attach memory to the holes of a byte range, which is going to
+ * be written. The bytes of a new block out of the range, but
+ * inside the file, are zeroed.
+ */
+static int file_fill_holes(struct file *file, size_t begin, size_t end) {
+    if (begin >= end) {
+        return 0;
+    }
+    size_t last = block_by_offset(end - 1);
+    for (size_t i = block_by_offset(begin); i <= last; i++) {
+        if (file->blocks[i]) {
+            continue;
+        }
+        struct block *block_node = new_block_node(i);
+        if (!block_node) {
             return -1;
         }
-        file->last_block = file->block_list;
+        size_t start = block_start(i);
+        size_t stop = MIN(start + block_size(i), MAX(file->size, end));
+        if (begin > start) {
+            memset(block_node->memory, 0, begin - start);
+        }
+        if (end < stop) {
+            memset(block_node->memory + (end - start), 0, stop - end);
+        }
+        file->blocks[i] = block_node;
     }
+    return 0;
+}
 
-    // Get the current block node from the file descriptor
-    struct block *block_node = filedesc->block_node;
-    if (!block_node) {
-        block_node = filedesc->block_node = file->block_list;
+/**
+ * Make the existing blocks of a byte range private to the file,
+ * copying the shared ones and the ones mapped from an image, which
+ * is read only. The file is locked for write, so the block can't
+ * get new sharers meanwhile.
+ */
+static int file_own_blocks(struct file *file, size_t begin, size_t end) {
+    if (begin >= end) {
+        return 0;
+    }
+    size_t last = MIN(block_by_offset(end - 1) + 1, file->block_count);
+    for (size_t i = block_by_offset(begin); i < last; i++) {
+        struct block *old = file->blocks[i];
+        if (!old) {
+            continue;
+        }
+        if (old->image) {
+            // Dirty pages of the mapping would be memory out of the quota, a copy is charged
+        } else if (__atomic_load_n(&old->is_dedup_indexed, __ATOMIC_ACQUIRE)) {
+            // Nobody can find and share the block while the table is locked
+            pthread_mutex_lock(&dedup_lock);
+            int is_own = __atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) == 1;
+            if (is_own) {
+                dedup_remove(old);
+            }
+            pthread_mutex_unlock(&dedup_lock);
+            if (is_own) {
+                continue;
+            }
+        } else if (__atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) == 1) {
+            continue;
+        }
+        struct block *copy = new_block_node(i);
+        if (!copy) {
+            return -1;
+        }
+        // Bytes after the file end are not used, they are not copied
+        size_t start = block_start(i);
+        if (start < file->size) {
+            memcpy(copy->memory, old->memory, MIN(block_size(i), file->size - start));
+        }
+        file->blocks[i] = copy;
+        block_unref(old, i);
     }
+    return 0;
+}
 
-    // Check if writing the data would exceed the maximum file size
-    if (filedesc->block_offset + size + filedesc->block_node->idx * BLOCK_SIZE > MAX_FILE_SIZE) {
+/**
+ * Unpack block number @a i of a file. A shared block is unpacked
+ * into a private copy, so its other owners are not touched. The
+ * file is locked for write.
+ */
+static int file_decompress_block(struct file *file, size_t i) {
+    struct block *old = file->blocks[i];
+    struct block *target = old;
+    char *memory;
+    struct slab *memory_slab;
+    if (__atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) == 1) {
+        if (memory_charge(block_size(i), 0, true) != 0) {
+            return -1;
+        }
+        memory = slab_alloc(&block_memory_pools[block_class(i)], &memory_slab);
+        if (!memory) {
+            memory_uncharge(block_size(i), 0);
+        }
+    } else {
+        target = new_block_node(i);
+        memory = target ? target->memory : NULL;
+    }
+    if (!memory) {
         assign_error_code(UFS_ERR_NO_MEM);
         return -1;
     }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    // The data is made by this process, it can't be corrupted
+    lz_decompress(old->compressed, old->compressed_size, memory, old->compressed_used);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    __atomic_add_fetch(&compression_stats.decompressions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compression_stats.decompress_time_ns,
+                       (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec), __ATOMIC_RELAXED);
+    if (target == old) {
+        __atomic_sub_fetch(&compression_stats.compressed_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compression_stats.original_bytes, old->compressed_used, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compression_stats.compressed_bytes, old->compressed_size, __ATOMIC_RELAXED);
+        free(old->compressed);
+        memory_uncharge(old->compressed_size, 0);
+        old->compressed = NULL;
+        old->memory = memory;
+        old->memory_slab = memory_slab;
+    } else {
+        file->blocks[i] = target;
+        block_unref(old, i);
+    }
+    file->compressed_blocks--;
+    return 0;
+}
 
-    int offset = filedesc->block_offset;
-
-    // Write the data to the blocks
-    while (size) {
-        if (offset == BLOCK_SIZE) {
-            // Create a new block node if the current block is full
-            struct block *_block_node = new_block_node();
-            if (!_block_node) {
-                return -1;
-            }
+/** Unpack the blocks of a byte range. The file is locked for write. */
+static int file_decompress_range(struct file *file, size_t begin, size_t end) {
+    if (!file->compressed_blocks || begin >= end) {
+        return 0;
+    }
+    size_t last = MIN(block_by_offset(end - 1) + 1, file->block_count);
+    for (size_t i = block_by_offset(begin); i < last; i++) {
+        if (file->blocks[i] && file->blocks[i]->compressed && file_decompress_block(file, i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-            _block_node->idx = block_node->idx + 1;
-            _block_node->prev = block_node;
-            if (block_node == file->last_block) {
-                file->last_block = _block_node;
-            }
-            block_node->next = _block_node;
-            block_node = _block_node;
+static int file_range_is_compressed(struct file *file, size_t begin, size_t end) {
+    if (!file->compressed_blocks || begin >= end) {
+        return 0;
+    }
+    size_t last = MIN(block_by_offset(end - 1) + 1, file->block_count);
+    for (size_t i = block_by_offset(begin); i < last; i++) {
+        if (file->blocks[i] && file->blocks[i]->compressed) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-            offset = 0;
+/**
+ * Lock a file for read with the blocks of a byte range unpacked.
+ * Unpacking needs the write lock, but hot files have nothing to
+ * unpack, and take only the read lock.
+ * @retval -1 No memory, the file is not locked.
+ */
+static int file_rdlock_range(struct file *file, size_t begin, size_t end) {
+    bool is_evicted = false;
+    memory_shortage = 0;
+    while (1) {
+        pthread_rwlock_rdlock(&file->lock);
+        if (!file_range_is_compressed(file, begin, end)) {
+            return 0;
+        }
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_wrlock(&file->lock);
+        int rc = file_decompress_range(file, begin, end);
+        pthread_rwlock_unlock(&file->lock);
+        if (rc != 0 && (is_evicted || !(is_evicted = memory_evict()))) {
+            return -1;
         }
+    }
+}
 
-        int writable_bytes = BLOCK_SIZE - offset;
-        if (writable_bytes > size) {
-            writable_bytes = size;
+/**
+ * Compress the private blocks of a file. Shared, mapped and
+ * deduplicated blocks are left as is. The file is locked for
+ * write.
+ * @param buf Buffer of lz_bound(UFS_MAX_BLOCK_SIZE) bytes.
+ */
+static void file_compress(struct file *file, char *buf) {
+    for (size_t i = 0; i < file->block_count; i++) {
+        struct block *block_node = file->blocks[i];
+        size_t start = block_start(i);
+        if (!block_node || block_node->compressed || block_node->image || start >= file->size ||
+            __atomic_load_n(&block_node->refs, __ATOMIC_ACQUIRE) != 1 ||
+            __atomic_load_n(&block_node->is_dedup_indexed, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        // Only the bytes before the file end are kept
+        size_t used = MIN(block_size(i), file->size - start);
+        size_t size = lz_compress(block_node->memory, used, buf, lz_bound(UFS_MAX_BLOCK_SIZE));
+        if (size == 0 || size > used / 8 * 7) {
+            continue;
         }
+        char *compressed = malloc(size);
+        if (!compressed) {
+            return;
+        }
+        memcpy(compressed, buf, size);
+        memory_charge(size, 0, false);
+        slab_free(&block_memory_pools[block_class(i)], block_node->memory_slab, block_node->memory);
+        memory_uncharge(block_size(i), 0);
+        block_node->memory = NULL;
+        block_node->memory_slab = NULL;
+        block_node->compressed = compressed;
+        block_node->compressed_size = size;
+        block_node->compressed_used = used;
+        file->compressed_blocks++;
+        __atomic_add_fetch(&compression_stats.compressions, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compression_stats.compressed_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compression_stats.original_bytes, used, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compression_stats.compressed_bytes, size, __ATOMIC_RELAXED);
+    }
+}
 
-        // Copy the data to the block
-        memcpy(block_node->memory + offset, buf + bytes_cnt, writable_bytes);
-        offset += writable_bytes;
-        bytes_cnt += writable_bytes;
-        size -= writable_bytes;
+/** Bytes of uncompressed block memory, taken from the slabs. */
+static size_t block_memory_used(void) {
+    size_t used = 0;
+    for (size_t i = 0; i <= block_growing_count(); i++) {
+        used += slab_pool_used_bytes(&block_memory_pools[i]);
+    }
+    return used;
+}
 
-        // Update the occupied size of the block if necessary
-        if (offset > block_node->occupied) {
-            block_node->occupied = offset;
+/** Compress the coldest closed files until the memory fits the budget. */
+static void compress_cold_files(void) {
+    size_t budget = __atomic_load_n(&memory_budget, __ATOMIC_RELAXED);
+    if (!budget || pthread_mutex_trylock(&compressor_lock) != 0) {
+        return;
+    }
+    pthread_once(&block_pools_once, block_pools_create);
+    char *buf = NULL;
+    // The first busy file moved to the head, it is met again after a round
+    struct file *first_busy = NULL;
+    // Files can't be freed while the namespace is locked
+    pthread_rwlock_rdlock(&namespace_lock);
+    while (block_memory_used() > budget) {
+        if (!buf && !(buf = malloc(lz_bound(UFS_MAX_BLOCK_SIZE)))) {
+            break;
+        }
+        pthread_mutex_lock(&lru_lock);
+        struct file *file = lru_tail;
+        if (!file || file == first_busy) {
+            pthread_mutex_unlock(&lru_lock);
+            break;
+        }
+        lru_remove_locked(file);
+        // An opened file is not compressed, the open takes it out of here
+        if (__atomic_load_n(&file->refs, __ATOMIC_ACQUIRE) != 0) {
+            pthread_mutex_unlock(&lru_lock);
+            continue;
         }
+        /*
+         * The lock is not waited for: its holder can wait for the
+         * namespace lock, which is held here.
+         */
+        if (pthread_rwlock_trywrlock(&file->lock) != 0) {
+            lru_add_locked(file);
+            first_busy = first_busy ? first_busy : file;
+            pthread_mutex_unlock(&lru_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lru_lock);
+        file_compress(file, buf);
+        pthread_rwlock_unlock(&file->lock);
     }
+    pthread_rwlock_unlock(&namespace_lock);
+    pthread_mutex_unlock(&compressor_lock);
+    free(buf);
+}
 
-    // Update the block node and offset in the file descriptor
-    filedesc->block_node = block_node;
-    filedesc->block_offset = offset;
+void ufs_set_memory_budget(size_t bytes) {
+    __atomic_store_n(&memory_budget, bytes, __ATOMIC_RELAXED);
+    compress_cold_files();
+}
 
-    return bytes_cnt;
+void ufs_get_compression_stats(struct ufs_compression_stats *stats) {
+    stats->compressed_blocks = __atomic_load_n(&compression_stats.compressed_blocks, __ATOMIC_RELAXED);
+    stats->original_bytes = __atomic_load_n(&compression_stats.original_bytes, __ATOMIC_RELAXED);
+    stats->compressed_bytes = __atomic_load_n(&compression_stats.compressed_bytes, __ATOMIC_RELAXED);
+    stats->compressions = __atomic_load_n(&compression_stats.compressions, __ATOMIC_RELAXED);
+    stats->decompressions = __atomic_load_n(&compression_stats.decompressions, __ATOMIC_RELAXED);
+    stats->decompress_time_ns = __atomic_load_n(&compression_stats.decompress_time_ns, __ATOMIC_RELAXED);
+    stats->memory_used = block_memory_used();
 }
 
-ssize_t ufs_read(int fd, char *buf, size_t size) {
-    ssize_t bytes = 0;
-    
-	// Check if the file descriptor is valid
-    if (fd < 0 || fd >= file_descriptor_count || !file_descriptors[fd]) {
-        assign_error_code(UFS_ERR_NO_FILE);
-        return -1;
+/** Fast non-cryptographic hash of a block, 8 bytes per step. */
+static uint64_t dedup_hash(const char *data, size_t size) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
     }
-
-    // Get the file descriptor and check if it has read permissions
-    struct filedesc *filedesc = file_descriptors[fd];
-    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
-        assign_error_code(UFS_ERR_NO_PERMISSION);
-        return -1;
+    for (; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 0x100000001B3ULL;
     }
+    return h ^ (h >> 29);
+}
 
-    // Get the current block node from the file descriptor
-    struct block *block_node = filedesc->block_node;
-    if (!block_node) {
-        block_node = filedesc->block_node = filedesc->file->block_list;
+/** Remove a block from the table. dedup_lock is held. */
+static void dedup_remove(struct block *block_node) {
+    struct block **link = &dedup_table.buckets[block_node->dedup_hash & (dedup_table.capacity - 1)];
+    while (*link != block_node) {
+        link = &(*link)->dedup_next;
     }
+    *link = block_node->dedup_next;
+    __atomic_store_n(&block_node->is_dedup_indexed, 0, __ATOMIC_RELEASE);
+    dedup_table.count--;
+    dedup_stats.unique_bytes -= block_node->block_size;
+}
 
-    int offset = filedesc->block_offset;
-
-    // Read data from the blocks
-    while (block_node && size) {
-        if (offset == BLOCK_SIZE) {
-            block_node = block_node->next;
-            offset = 0;
+/** Add a block with a known hash. dedup_lock is held. */
+static void dedup_insert(struct block *block_node) {
+    if (dedup_table.count >= dedup_table.capacity) {
+        // Keep the chains short, a failed grow only makes them longer
+        size_t new_capacity = dedup_table.capacity ? dedup_table.capacity * 2 : 256;
+        struct block **buckets = calloc(new_capacity, sizeof(struct block *));
+        if (buckets) {
+            for (size_t i = 0; i < dedup_table.capacity; i++) {
+                struct block *b = dedup_table.buckets[i];
+                while (b) {
+                    struct block *next = b->dedup_next;
+                    b->dedup_next = buckets[b->dedup_hash & (new_capacity - 1)];
+                    buckets[b->dedup_hash & (new_capacity - 1)] = b;
+                    b = next;
+                }
+            }
+            free(dedup_table.buckets);
+            dedup_table.buckets = buckets;
+            dedup_table.capacity = new_capacity;
+        } else if (!dedup_table.capacity) {
+            return;
         }
+    }
+    struct block **bucket = &dedup_table.buckets[block_node->dedup_hash & (dedup_table.capacity - 1)];
+    block_node->dedup_next = *bucket;
+    *bucket = block_node;
+    __atomic_store_n(&block_node->is_dedup_indexed, 1, __ATOMIC_RELEASE);
+    dedup_table.count++;
+    dedup_stats.unique_bytes += block_node->block_size;
+}
 
-        if (!(block_node->occupied - offset)) {
+/**
+ * Replace block number @a i of a file with an equal block from the
+ * table, or add it there. The file is locked for write.
+ */
+static void file_dedup_block(struct file *file, size_t i) {
+    struct block *block_node = file->blocks[i];
+    if (__atomic_load_n(&block_node->is_dedup_indexed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t hash = dedup_hash(block_node->memory, block_node->block_size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_mutex_lock(&dedup_lock);
+    dedup_stats.blocks_hashed++;
+    dedup_stats.bytes_hashed += block_node->block_size;
+    dedup_stats.hash_time_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+    struct block *twin = NULL;
+    if (dedup_table.capacity) {
+        twin = dedup_table.buckets[hash & (dedup_table.capacity - 1)];
+    }
+    for (; twin; twin = twin->dedup_next) {
+        // Equal hashes are verified by bytes, and a block being freed is skipped
+        if (twin->dedup_hash != hash || twin->block_size != block_node->block_size ||
+            memcmp(twin->memory, block_node->memory, block_node->block_size) != 0) {
+            continue;
+        }
+        int refs = __atomic_load_n(&twin->refs, __ATOMIC_ACQUIRE);
+        while (refs > 0 && !__atomic_compare_exchange_n(&twin->refs, &refs, refs + 1, 0,
+                                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        }
+        if (refs > 0) {
             break;
-        } 
-		
-		int place_holder = MIN(block_node->occupied - offset, size);
-
-        // Copy the data from the block to the buffer
-        memcpy(buf + bytes, block_node->memory + offset, place_holder);
-        bytes += place_holder;
-        offset += place_holder;
-        size -= place_holder;
+        }
+    }
+    if (twin) {
+        dedup_stats.duplicates++;
+        dedup_stats.bytes_saved += block_node->block_size;
+    } else {
+        block_node->dedup_hash = hash;
+        dedup_insert(block_node);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    if (twin) {
+        file->blocks[i] = twin;
+        block_unref(block_node, i);
     }
-
-    // Update the block node and offset in the file descriptor
-    filedesc->block_offset = offset;
-    filedesc->block_node = block_node;
-
-    return bytes;
 }
 
-int ufs_close(int fd) {
-    struct filedesc *filedesc;
-    // Check if the file descriptor is out of range or not associated with a file
-    if (fd < 0 || fd >= file_descriptor_count || !file_descriptors[fd]) {
-        assign_error_code(UFS_ERR_NO_FILE);
-		return -1;
+/**
+ * Deduplicate the blocks which end inside of a just written byte
+ * range and are full. A block is hashed once, when its last byte
+ * is written. The file is locked for write.
+ */
+static void file_dedup_range(struct file *file, size_t begin, size_t end) {
+    if (!__atomic_load_n(&dedup_enabled, __ATOMIC_RELAXED) || begin >= end) {
+        return;
     }
-	filedesc = file_descriptors[fd];
-
-    struct file *file = filedesc->file;
-    // Decrease the reference count of the file and check if it's planned for deletion
-    if (!(--file->refs) && file->planed_to_delete) {
-		// Adjust the linked list pointers to remove the file from the list
-		if (file->prev) {
-            file->prev->next = file->next;
-		}
-        else {
-            file_list = file->next;
-		}
-
-        if (file->next) {
-			file->next->prev = file->prev;
-		}
-
-		// Delete the file and free its resources
-		ufs_delete(file->name);
-		free(file);
+    size_t last = block_by_offset(end - 1);
+    for (size_t i = block_by_offset(begin); i <= last; i++) {
+        size_t block_end = block_start(i) + block_size(i);
+        if (file->blocks[i] && block_end <= end && block_end <= file->size) {
+            file_dedup_block(file, i);
+        }
     }
+}
 
-    // Free the file descriptor and set it to NULL
-    free(filedesc);
-    file_descriptors[fd] = NULL;
+void ufs_set_dedup(int is_enabled) {
+    __atomic_store_n(&dedup_enabled, is_enabled, __ATOMIC_RELAXED);
+}
 
-    return 0;
+void ufs_get_dedup_stats(struct ufs_dedup_stats *stats) {
+    pthread_mutex_lock(&dedup_lock);
+    *stats = dedup_stats;
+    pthread_mutex_unlock(&dedup_lock);
 }
 
-int ufs_delete(const char *filename) {
-    struct file *file = file_list;
-    // Find the file with the matching name in the file list
-	while (file) {
-        if (!file->planed_to_delete && !strcmp(file->name, filename)) {
-            break;
+/** Fill a range with zeros. Holes are zeros already. */
+static void file_zero_range(struct file *file, size_t begin, size_t end) {
+    size_t i = block_by_offset(begin);
+    end = MIN(end, block_start(file->block_count));
+    while (begin < end) {
+        size_t offset = begin - block_start(i);
+        size_t part = MIN(block_size(i) - offset, end - begin);
+        if (file->blocks[i]) {
+            memset(file->blocks[i]->memory + offset, 0, part);
         }
-		file = file->next;
+        begin += part;
+        i++;
     }
+}
 
-    // If the file is not found, return an error
-    if (!file) {
-        assign_error_code(UFS_ERR_NO_FILE);
+/**
+ * Total size of an iovec array.
+ * @retval -1 Bad count, or the total does not fit ssize_t.
+ */
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *total) {
+    if (iovcnt < 0 || iovcnt > UFS_IOV_MAX) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
         return -1;
     }
+    *total = 0;
+    for (int v = 0; v < iovcnt; v++) {
+        if (iov[v].iov_len > (size_t)SSIZE_MAX - *total) {
+            assign_error_code(UFS_ERR_INVALID_ARG);
+            return -1;
+        }
+        *total += iov[v].iov_len;
+    }
+    return 0;
+}
 
-    // Check if there are any references to the file
-    if (file->refs > 0) {
-        // Set the planned deletion flag for the file
-        file->planed_to_delete = 1;
-    } else {
-        // Remove the file from the list by adjusting the linked list pointers
-        if (file->prev) {
-            file->prev->next = file->next;
-		} else {
-            file_list = file->next;
-		}
-
-        if (file->next) { 
-			file->next->prev = file->prev;
-		}
+/**
+ * Write the buffers into a file one after another from an offset,
+ * growing it if necessary. The file is locked once for all of them.
+ */
+static ssize_t file_try_writev(struct file *file, const struct iovec *iov, int iovcnt, size_t offset) {
+    size_t size;
+    if (iov_total(iov, iovcnt, &size) != 0) {
+        return -1;
+    }
+    // Check if writing the data would exceed the maximum file size
+    if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    // An empty write changes nothing, even past the end
+    if (size == 0) {
+        return 0;
+    }
+    size_t end = offset + size;
+    pthread_rwlock_wrlock(&file->lock);
+    if (file_reserve_blocks(file, block_count_for(end)) != 0 ||
+        file_fill_holes(file, offset, end) != 0 ||
+        file_decompress_range(file, MIN(offset, file->size), end) != 0 ||
+        file_own_blocks(file, MIN(offset, file->size), end) != 0) {
+        pthread_rwlock_unlock(&file->lock);
+        return -1;
+    }
+    // A gap between the old end and the offset reads as zeros
+    if (offset > file->size) {
+        file_zero_range(file, file->size, offset);
+    }
 
-        // Delete the blocks associated with the file and free the resources
-		struct block *block_to_delete = file->block_list;
-        while (block_to_delete) {
-			// Store the reference to the next block before freeing the current block
-			struct block *next_block = block_to_delete->next;
+    // Copy the data to the blocks, starting right from the needed one
+    size_t i = block_by_offset(offset);
+    size_t block_offset = offset - block_start(i);
+    for (int v = 0; v < iovcnt; v++) {
+        const char *src = iov[v].iov_base;
+        size_t len = iov[v].iov_len;
+        while (len > 0) {
+            size_t writable_bytes = MIN(block_size(i) - block_offset, len);
+            memcpy(file->blocks[i]->memory + block_offset, src, writable_bytes);
+            src += writable_bytes;
+            len -= writable_bytes;
+            block_offset += writable_bytes;
+            if (block_offset == block_size(i)) {
+                block_offset = 0;
+                i++;
+            }
+        }
+    }
+    size_t old_size = file->size;
+    if (end > file->size) {
+        file->size = end;
+    }
+    file_dedup_range(file, MIN(offset, old_size), end);
+    redo_log(REDO_WRITE, file->id, offset, iov, iovcnt);
+    __atomic_add_fetch(&file->version, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&file->lock);
+    return size;
+}
 
-			// Free the memory allocated for the block's data
-			free(block_to_delete->memory);
+/** Write the buffers, retried once after an eviction. */
+static ssize_t file_writev(struct file *file, const struct iovec *iov, int iovcnt, size_t offset) {
+    memory_shortage = 0;
+    ssize_t rc = file_try_writev(file, iov, iovcnt, offset);
+    if (rc < 0 && memory_evict()) {
+        rc = file_try_writev(file, iov, iovcnt, offset);
+    }
+    if (rc >= 0 && journal_finish() != 0) {
+        return -1;
+    }
+    return rc;
+}
 
-			// Free the block node itself
-			free(block_to_delete);
+/** Write into a file at an offset, growing it if necessary. */
+static ssize_t file_write(struct file *file, const char *buf, size_t size, size_t offset) {
+    struct iovec iov = {(void *)buf, size};
+    return file_writev(file, &iov, 1, offset);
+}
 
-			// Move to the next block node
-			block_to_delete = next_block;
-    	}
-        free(file->name);
-        free(file);
+/**
+ * Read from a file at an offset into the buffers one after
+ * another, until the file end.
+ */
+static ssize_t file_readv(struct file *file, const struct iovec *iov, int iovcnt, size_t offset) {
+    size_t size;
+    if (iov_total(iov, iovcnt, &size) != 0 ||
+        file_rdlock_range(file, offset, offset + MIN(size, MAX_FILE_SIZE)) != 0) {
+        return -1;
+    }
+    if (offset >= file->size) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+    size = MIN(size, file->size - offset);
+
+    // Copy the data from the blocks, starting right from the needed one
+    size_t bytes = 0;
+    size_t i = block_by_offset(offset);
+    size_t block_offset = offset - block_start(i);
+    for (int v = 0; v < iovcnt && bytes < size; v++) {
+        char *dst = iov[v].iov_base;
+        size_t len = MIN(iov[v].iov_len, size - bytes);
+        bytes += len;
+        while (len > 0) {
+            size_t place_holder = MIN(block_size(i) - block_offset, len);
+            if (file->blocks[i]) {
+                memcpy(dst, file->blocks[i]->memory + block_offset, place_holder);
+            } else {
+                memset(dst, 0, place_holder);
+            }
+            dst += place_holder;
+            len -= place_holder;
+            block_offset += place_holder;
+            if (block_offset == block_size(i)) {
+                block_offset = 0;
+                i++;
+            }
+        }
     }
+    pthread_rwlock_unlock(&file->lock);
+    return bytes;
+}
 
+/** Read from a file at an offset. */
+static ssize_t file_read(struct file *file, char *buf, size_t size, size_t offset) {
+    struct iovec iov = {buf, size};
+    return file_readv(file, &iov, 1, offset);
+}
+
+/**
+ * Tell if an access of a descriptor starts where the previous one
+ * ended, and remember where this one ends. pos_lock is held.
+ */
+static bool filedesc_is_sequential(struct filedesc *filedesc, size_t offset, size_t size) {
+    bool is_sequential = offset == filedesc->seq_end;
+    filedesc->seq_end = offset + size;
+    return is_sequential;
+}
+
+/** Give a descriptor its buffer, if it has none. pos_lock is held. */
+static bool filedesc_has_buf(struct filedesc *filedesc) {
+    if (!filedesc->buf) {
+        filedesc->buf = malloc(FILEDESC_BUF_SIZE);
+    }
+    return filedesc->buf != NULL;
+}
+
+/**
+ * Put the buffered writes of a descriptor into the file. On
+ * failure they stay in the buffer. pos_lock is held.
+ */
+static int filedesc_flush(struct filedesc *filedesc) {
+    if (!filedesc->buf_is_dirty) {
+        return 0;
+    }
+    if (file_write(filedesc->file, filedesc->buf, filedesc->buf_size, filedesc->buf_offset) < 0) {
+        return -1;
+    }
+    filedesc->buf_is_dirty = 0;
+    filedesc->buf_size = 0;
+    return 0;
+}
+
+/** Flush a UFS_BUFFERED descriptor before a call which is not buffered. */
+static int filedesc_sync(struct filedesc *filedesc) {
+    if (!(filedesc->cnt_flags & UFS_BUFFERED)) {
+        return 0;
+    }
+    pthread_mutex_lock(&filedesc->pos_lock);
+    int rc = filedesc_flush(filedesc);
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return rc;
+}
+
+/**
+ * Write through a descriptor. Small sequential writes of a
+ * UFS_BUFFERED descriptor are gathered in the buffer, which ends
+ * with the block of its start. The write which fills it puts the
+ * whole buffer into the file by one call, so the file is locked,
+ * checked for holes, copies and compression and logged once per
+ * block instead of once per write. pos_lock is held.
+ */
+static ssize_t filedesc_write(struct filedesc *filedesc, const char *buf, size_t size, size_t offset) {
+    bool is_sequential = filedesc_is_sequential(filedesc, offset, size);
+    if (!(filedesc->cnt_flags & UFS_BUFFERED) || !is_sequential || size >= FILEDESC_SMALL_IO ||
+        offset > MAX_FILE_SIZE - size || !filedesc_has_buf(filedesc) ||
+        (filedesc->buf_is_dirty && offset != filedesc->buf_offset + filedesc->buf_size)) {
+        if (filedesc_flush(filedesc) != 0) {
+            return -1;
+        }
+        return file_write(filedesc->file, buf, size, offset);
+    }
+    if (!filedesc->buf_is_dirty) {
+        filedesc->buf_offset = offset;
+        filedesc->buf_size = 0;
+        filedesc->buf_is_dirty = 1;
+    }
+    size_t i = block_by_offset(filedesc->buf_offset);
+    size_t limit = MIN(block_start(i) + block_size(i) - filedesc->buf_offset, FILEDESC_BUF_SIZE);
+    size_t room = limit - filedesc->buf_size;
+    if (size < room) {
+        memcpy(filedesc->buf + filedesc->buf_size, buf, size);
+        filedesc->buf_size += size;
+        return size;
+    }
+    // On failure nothing of this write is done, the buffer is kept
+    struct iovec iov[2] = {{filedesc->buf, filedesc->buf_size}, {(void *)buf, room}};
+    if (file_writev(filedesc->file, iov, 2, filedesc->buf_offset) < 0) {
+        return -1;
+    }
+    // The rest is smaller than any block, it starts the next buffer
+    filedesc->buf_offset += limit;
+    filedesc->buf_size = size - room;
+    filedesc->buf_is_dirty = filedesc->buf_size > 0;
+    memcpy(filedesc->buf, buf + room, filedesc->buf_size);
+    return size;
+}
+
+/**
+ * Read through a descriptor. Small sequential reads are served
+ * from the buffer. A miss fills it with FILEDESC_BUF_SIZE bytes
+ * from the read offset, so the next blocks are unpacked and copied
+ * ahead by one pass under the file lock, and the next reads take
+ * no file lock at all. pos_lock is held.
+ */
+static ssize_t filedesc_read(struct filedesc *filedesc, char *buf, size_t size, size_t offset) {
+    struct file *file = filedesc->file;
+    bool is_sequential = filedesc_is_sequential(filedesc, offset, size);
+    if (filedesc_flush(filedesc) != 0) {
+        return -1;
+    }
+    if (!is_sequential || size == 0 || size >= FILEDESC_SMALL_IO) {
+        return file_read(file, buf, size, offset);
+    }
+    uint64_t version = __atomic_load_n(&file->version, __ATOMIC_ACQUIRE);
+    if (filedesc->buf_size > 0 && version == filedesc->buf_version && offset >= filedesc->buf_offset &&
+        offset + size <= filedesc->buf_offset + filedesc->buf_size) {
+        memcpy(buf, filedesc->buf + (offset - filedesc->buf_offset), size);
+        return size;
+    }
+    if (!filedesc_has_buf(filedesc)) {
+        return file_read(file, buf, size, offset);
+    }
+    ssize_t rc = file_read(file, filedesc->buf, FILEDESC_BUF_SIZE, offset);
+    if (rc < 0) {
+        filedesc->buf_size = 0;
+        return -1;
+    }
+    // The data is of the version only if no change came during the read
+    filedesc->buf_offset = offset;
+    filedesc->buf_version = version;
+    filedesc->buf_size = __atomic_load_n(&file->version, __ATOMIC_ACQUIRE) == version ? rc : 0;
+    size = MIN(size, (size_t)rc);
+    memcpy(buf, filedesc->buf, size);
+    return size;
+}
+
+ssize_t ufs_write(int fd, const char *buf, size_t size) {
+    // Get the file descriptor and check if it has write permissions
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+
+    pthread_mutex_lock(&filedesc->pos_lock);
+    ssize_t bytes_cnt = filedesc_write(filedesc, buf, size, filedesc_pos(filedesc));
+    if (bytes_cnt > 0) {
+        filedesc->pos += bytes_cnt;
+    }
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return bytes_cnt;
+}
+
+ssize_t ufs_read(int fd, char *buf, size_t size) {
+    // Get the file descriptor and check if it has read permissions
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+
+    pthread_mutex_lock(&filedesc->pos_lock);
+    ssize_t bytes = filedesc_read(filedesc, buf, size, filedesc_pos(filedesc));
+    if (bytes > 0) {
+        filedesc->pos += bytes;
+    }
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return bytes;
+}
+
+ssize_t ufs_pwrite(int fd, const char *buf, size_t size, size_t offset) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (!(filedesc->cnt_flags & UFS_BUFFERED)) {
+        return file_write(filedesc->file, buf, size, offset);
+    }
+    pthread_mutex_lock(&filedesc->pos_lock);
+    ssize_t rc = filedesc_write(filedesc, buf, size, offset);
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return rc;
+}
+
+ssize_t ufs_pread(int fd, char *buf, size_t size, size_t offset) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    // Big reads and parallel reads of one descriptor go without the read ahead
+    if (filedesc->cnt_flags & UFS_BUFFERED) {
+        pthread_mutex_lock(&filedesc->pos_lock);
+    } else if (size >= FILEDESC_SMALL_IO || pthread_mutex_trylock(&filedesc->pos_lock) != 0) {
+        return file_read(filedesc->file, buf, size, offset);
+    }
+    ssize_t rc = filedesc_read(filedesc, buf, size, offset);
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return rc;
+}
+
+ssize_t ufs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    pthread_mutex_lock(&filedesc->pos_lock);
+    ssize_t bytes = filedesc_flush(filedesc) != 0 ? -1 :
+                    file_readv(filedesc->file, iov, iovcnt, filedesc_pos(filedesc));
+    if (bytes > 0) {
+        filedesc->pos += bytes;
+    }
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return bytes;
+}
+
+ssize_t ufs_writev(int fd, const struct iovec *iov, int iovcnt) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    pthread_mutex_lock(&filedesc->pos_lock);
+    ssize_t bytes = filedesc_flush(filedesc) != 0 ? -1 :
+                    file_writev(filedesc->file, iov, iovcnt, filedesc_pos(filedesc));
+    if (bytes > 0) {
+        filedesc->pos += bytes;
+    }
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return bytes;
+}
+
+ssize_t ufs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    return file_readv(filedesc->file, iov, iovcnt, offset);
+}
+
+ssize_t ufs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    return file_writev(filedesc->file, iov, iovcnt, offset);
+}
+
+ssize_t ufs_seek(int fd, ssize_t offset, int whence) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    ssize_t base;
+    pthread_mutex_lock(&filedesc->pos_lock);
+    switch (whence) {
+    case UFS_SEEK_SET:
+        base = 0;
+        break;
+    case UFS_SEEK_CUR:
+        base = filedesc_pos(filedesc);
+        break;
+    case UFS_SEEK_END:
+        if (filedesc_flush(filedesc) != 0) {
+            pthread_mutex_unlock(&filedesc->pos_lock);
+            return -1;
+        }
+        pthread_rwlock_rdlock(&filedesc->file->lock);
+        base = filedesc->file->size;
+        pthread_rwlock_unlock(&filedesc->file->lock);
+        break;
+    default:
+        base = -1;
+        break;
+    }
+    if (base < 0 || base + offset < 0) {
+        pthread_mutex_unlock(&filedesc->pos_lock);
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    filedesc->pos = base + offset;
+    ssize_t pos = filedesc->pos;
+    pthread_mutex_unlock(&filedesc->pos_lock);
+    return pos;
+}
+
+int ufs_file_stats(int fd, struct ufs_file_stats *stats) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc || filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    // The name is changed by a rename under namespace_lock
+    pthread_rwlock_rdlock(&namespace_lock);
+    pthread_rwlock_rdlock(&file->lock);
+    stats->logical_bytes = file->size;
+    stats->physical_bytes = 0;
+    stats->hole_bytes = 0;
+    stats->metadata_bytes = sizeof(struct file) + strlen(file->name) + 1 +
+                            file->block_capacity * sizeof(struct block *);
+    pthread_rwlock_unlock(&namespace_lock);
+    for (size_t i = 0; i < file->block_count; i++) {
+        struct block *block_node = file->blocks[i];
+        if (!block_node) {
+            size_t start = block_start(i);
+            if (start < file->size) {
+                stats->hole_bytes += MIN(block_size(i), file->size - start);
+            }
+            continue;
+        }
+        if (block_node->compressed) {
+            stats->physical_bytes += block_node->compressed_size;
+        } else {
+            stats->physical_bytes += block_size(i);
+        }
+        stats->metadata_bytes += sizeof(struct block);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    return 0;
+}
+
+/** Drop the blocks of a file behind its new smaller size. */
+static void file_truncate(struct file *file, size_t new_size) {
+    size_t count = block_count_for(new_size);
+    while (file->block_count > count) {
+        size_t i = --file->block_count;
+        if (file->blocks[i]) {
+            file->compressed_blocks -= file->blocks[i]->compressed != NULL;
+            block_unref(file->blocks[i], i);
+        }
+    }
+    // The map is given back after a big shrink, with a gap against flapping
+    if (file->block_capacity > 8 && count <= file->block_capacity / 4) {
+        size_t new_capacity = MAX(count * 2, 8);
+        struct block **blocks = realloc(file->blocks, new_capacity * sizeof(struct block *));
+        if (blocks) {
+            memory_uncharge(0, (file->block_capacity - new_capacity) * sizeof(struct block *));
+            file->blocks = blocks;
+            file->block_capacity = new_capacity;
+        }
+    }
+    file->size = new_size;
+    // Only the descriptors of this file are visited
+    pthread_mutex_lock(&file->descs_lock);
+    for (struct filedesc *d = file->descs; d; d = d->file_next) {
+        size_t bound = __atomic_load_n(&d->pos_bound, __ATOMIC_ACQUIRE);
+        while (new_size < bound &&
+               !__atomic_compare_exchange_n(&d->pos_bound, &bound, new_size, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+        }
+    }
+    pthread_mutex_unlock(&file->descs_lock);
+}
+
+/**
+ * Grow a file up to a bigger size. The block map is extended once
+ * with holes, so the growth costs no block memory. On failure the
+ * file stays as it was.
+ */
+static int file_grow(struct file *file, size_t new_size) {
+    size_t old_count = file->block_count;
+    if (file_reserve_blocks(file, block_count_for(new_size)) != 0 ||
+        file_decompress_range(file, file->size, new_size) != 0 ||
+        file_own_blocks(file, file->size, new_size) != 0) {
+        // Only holes were added
+        file->block_count = old_count;
+        return -1;
+    }
+    file_zero_range(file, file->size, new_size);
+    file->size = new_size;
+    return 0;
+}
+
+static int file_resize(struct file *file, size_t new_size) {
+    int rc = 0;
+    pthread_rwlock_wrlock(&file->lock);
+    if (new_size > file->size) {
+        rc = file_grow(file, new_size);
+    } else if (new_size < file->size) {
+        file_truncate(file, new_size);
+    }
+    if (rc == 0) {
+        redo_log(REDO_RESIZE, file->id, new_size, NULL, 0);
+        __atomic_add_fetch(&file->version, 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    return rc;
+}
+
+int ufs_resize(int fd, size_t new_size) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (new_size > MAX_FILE_SIZE) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    if (filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    memory_shortage = 0;
+    int rc = file_resize(file, new_size);
+    if (rc != 0 && memory_evict()) {
+        rc = file_resize(file, new_size);
+    }
+    if (rc == 0 && journal_finish() != 0) {
+        return -1;
+    }
+    return rc;
+}
+
+/**
+ * Zeros for read views of holes. It is never written, and is not
+ * const to stay in bss, where the untouched pages cost nothing.
+ */
+static char zero_block[UFS_MAX_BLOCK_SIZE];
+
+struct ufs_view {
+    /** The file, referenced and locked while the view lives. */
+    struct file *file;
+    /** File range of the view. */
+    size_t offset;
+    size_t size;
+    /** Write views hold the file lock for write. */
+    int is_write;
+    int iovcnt;
+    /** Pieces of the range, one per block. */
+    struct iovec iov[];
+};
+
+/** Make a view of [offset, offset + size) of existing blocks. */
+static struct ufs_view *file_view_new(struct file *file, size_t offset, size_t size, int is_write) {
+    size_t first = block_by_offset(offset);
+    int iovcnt = size ? block_by_offset(offset + size - 1) - first + 1 : 0;
+    struct ufs_view *view = malloc(sizeof(struct ufs_view) + iovcnt * sizeof(struct iovec));
+    if (!view) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    view->file = file;
+    view->offset = offset;
+    view->size = size;
+    view->is_write = is_write;
+    view->iovcnt = iovcnt;
+    size_t block_offset = offset - block_start(first);
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t part = MIN(block_size(first + i) - block_offset, size - done);
+        struct block *block_node = file->blocks[first + i];
+        // Only read views see holes, they are shown by a shared zero block
+        view->iov[i].iov_base = (block_node ? block_node->memory : zero_block) + block_offset;
+        view->iov[i].iov_len = part;
+        done += part;
+        block_offset = 0;
+    }
+    return view;
+}
+
+ssize_t ufs_view_read(int fd, size_t offset, size_t size, struct ufs_view **view) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_WRITE_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    // The descriptor keeps the file alive, so it is safe to add a reference without the namespace lock
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    if (file_rdlock_range(file, offset, offset + MIN(size, MAX_FILE_SIZE)) != 0) {
+        file_unref(file);
+        return -1;
+    }
+    size = offset < file->size ? MIN(size, file->size - offset) : 0;
+    *view = file_view_new(file, offset, size, 0);
+    if (!*view) {
+        pthread_rwlock_unlock(&file->lock);
+        file_unref(file);
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * Lock a file for write and make a write view of a range, with
+ * the blocks allocated and private.
+ */
+static int file_view_reserve(struct file *file, size_t offset, size_t size, struct ufs_view **view) {
+    pthread_rwlock_wrlock(&file->lock);
+    if (file_reserve_blocks(file, block_count_for(offset + size)) != 0 ||
+        file_fill_holes(file, offset, offset + size) != 0 ||
+        file_decompress_range(file, MIN(offset, file->size), offset + size) != 0 ||
+        file_own_blocks(file, MIN(offset, file->size), offset + size) != 0 ||
+        !(*view = file_view_new(file, offset, size, 1))) {
+        pthread_rwlock_unlock(&file->lock);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t ufs_view_reserve(int fd, size_t offset, size_t size, struct ufs_view **view) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    if (filedesc->cnt_flags & UFS_READ_ONLY) {
+        assign_error_code(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+    if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    if (filedesc_sync(filedesc) != 0) {
+        return -1;
+    }
+    struct file *file = filedesc->file;
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    memory_shortage = 0;
+    if (file_view_reserve(file, offset, size, view) != 0 &&
+        (!memory_evict() || file_view_reserve(file, offset, size, view) != 0)) {
+        file_unref(file);
+        return -1;
+    }
+    return size;
+}
+
+const struct iovec *ufs_view_iov(const struct ufs_view *view, int *iovcnt) {
+    *iovcnt = view->iovcnt;
+    return view->iov;
+}
+
+int ufs_view_commit(struct ufs_view *view, size_t size) {
+    if (!view->is_write || size > view->size) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    struct file *file = view->file;
+    if (size > 0) {
+        // A gap between the old end and the view reads as zeros
+        size_t old_size = file->size;
+        if (view->offset > file->size) {
+            file_zero_range(file, file->size, view->offset);
+        }
+        file->size = MAX(file->size, view->offset + size);
+        file_dedup_range(file, MIN(view->offset, old_size), view->offset + size);
+        if (journal) {
+            // Only the committed bytes are logged, the pieces are clipped
+            int iovcnt = 0;
+            for (size_t done = 0; done < size; iovcnt++) {
+                view->iov[iovcnt].iov_len = MIN(view->iov[iovcnt].iov_len, size - done);
+                done += view->iov[iovcnt].iov_len;
+            }
+            redo_log(REDO_WRITE, file->id, view->offset, view->iov, iovcnt);
+        }
+    }
+    // The view could change the data in place, even without a commit
+    __atomic_add_fetch(&file->version, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&file->lock);
+    file_unref(file);
+    free(view);
+    return journal_finish();
+}
+
+void ufs_view_release(struct ufs_view *view) {
+    if (view->is_write) {
+        ufs_view_commit(view, 0);
+        return;
+    }
+    pthread_rwlock_unlock(&view->file->lock);
+    file_unref(view->file);
+    free(view);
+}
+
+/**
+ * Unlink a file from the file list and free it with all its blocks.
+ * namespace_lock is held for write.
+ */
+static void free_file(struct file *file) {
+    // Remove the file from the list by adjusting the linked list pointers
+    if (file->prev) {
+        file->prev->next = file->next;
+    } else {
+        file_list = file->next;
+    }
+
+    if (file->next) {
+        file->next->prev = file->prev;
+    }
+    lru_remove(file);
+    file_destroy(file);
+}
+
+/** Free a file, which is not in the file list, with all its blocks. */
+static void file_destroy(struct file *file) {
+    // Delete the blocks associated with the file and free the resources
+    for (size_t i = 0; i < file->block_count; i++) {
+        if (file->blocks[i]) {
+            block_unref(file->blocks[i], i);
+        }
+    }
+    free(file->blocks);
+    memory_uncharge(0, sizeof(struct file) + strlen(file->name) + 1 + file->block_capacity * sizeof(struct block *));
+    pthread_rwlock_destroy(&file->lock);
+    pthread_mutex_destroy(&file->descs_lock);
+    free(file->name);
+    free(file);
+}
+
+int ufs_close(int fd) {
+    // Buffered writes go into the file before the descriptor is gone, the table is not locked meanwhile
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    int rc = filedesc_sync(filedesc);
+
+    // Check if the file descriptor is out of range or not associated with a file
+    pthread_rwlock_wrlock(&fd_table_lock);
+    filedesc = lookup_filedesc(fd);
+    if (!filedesc) {
+        pthread_rwlock_unlock(&fd_table_lock);
+		return -1;
+    }
+
+    // Set the slot to NULL, it can be taken by the next ufs_open()
+    file_descriptors[fd] = NULL;
+    fd_mark_free(fd);
+
+    // Move the end of used descriptors back, each slot is passed once after being used
+    while (file_descriptor_count > 0 && !file_descriptors[file_descriptor_count - 1]) {
+        file_descriptor_count--;
+    }
+    // Shrink the table after mass closes, with a gap to not flap on the border
+    int new_capacity = file_descriptor_capacity;
+    while (new_capacity > FD_TABLE_MIN_CAPACITY && file_descriptor_count <= new_capacity / 4) {
+        new_capacity /= 2;
+    }
+    if (new_capacity != file_descriptor_capacity) {
+        fd_table_resize(new_capacity);
+    }
+    pthread_rwlock_unlock(&fd_table_lock);
+
+    // Decrease the reference count of the file, a deleted file is freed by the last close
+    filedesc_unlink(filedesc);
+    file_unref(filedesc->file);
+    pthread_mutex_destroy(&filedesc->pos_lock);
+    free(filedesc->buf);
+    free(filedesc);
+    compress_cold_files();
+
+    return rc;
+}
+
+int ufs_flush(int fd) {
+    struct filedesc *filedesc = get_filedesc(fd);
+    if (!filedesc) {
+        return -1;
+    }
+    return filedesc_sync(filedesc);
+}
+
+int ufs_delete(const char *filename) {
+    // Find the file with the matching name in the index
+    pthread_rwlock_wrlock(&namespace_lock);
+    struct file *file = file_index_find(&file_index, filename);
+
+    // If the file is not found, return an error
+    if (!file) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    if (file->is_dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_IS_DIR);
+        return -1;
+    }
+
+    // The name is free for a new file from now on
+    file_index_remove(&file_index, file);
+    dir_unlink(file);
+    redo_log(REDO_DELETE, file->id, 0, NULL, 0);
+
+    // Check if there are any references to the file
+    if (file->refs > 0) {
+        // Set the planned deletion flag for the file
+        file->planed_to_delete = 1;
+    } else {
+        free_file(file);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return journal_finish();
+}
+
+int ufs_list(ufs_list_f cb, void *ctx) {
+    int rc = 0;
+    pthread_rwlock_rdlock(&namespace_lock);
+    for (uint32_t i = 0; i < file_index.capacity && rc == 0; i++) {
+        struct file *file = file_index.slots[i];
+        if (file && file != FILE_INDEX_TOMBSTONE && !file->is_dir) {
+            rc = cb(file->name, ctx);
+        }
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    return rc;
+}
+
+static int dir_try_mkdir(const char *path) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    if (file_index_find(&file_index, path)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_EXISTS);
+        return -1;
+    }
+    struct file *parent = dir_for_new(path);
+    struct file *dir = parent ? new_file(path) : NULL;
+    if (!dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -1;
+    }
+    dir->is_dir = 1;
+    if (file_index_insert(&file_index, dir) != 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+        file_destroy(dir);
+        return -1;
+    }
+    file_list_add(dir);
+    dir_link(parent, dir);
+    redo_log_path(REDO_CREATE, dir->id, 1, path);
+    pthread_rwlock_unlock(&namespace_lock);
+    return 0;
+}
+
+int ufs_mkdir(const char *path) {
+    memory_shortage = 0;
+    int rc = dir_try_mkdir(path);
+    if (rc != 0 && memory_evict()) {
+        rc = dir_try_mkdir(path);
+    }
+    return rc == 0 ? journal_finish() : rc;
+}
+
+int ufs_rmdir(const char *path) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    struct file *dir = file_index_find(&file_index, path);
+    enum ufs_error_code error = UFS_ERR_NO_ERR;
+    if (!dir) {
+        error = UFS_ERR_NO_FILE;
+    } else if (!dir->is_dir) {
+        error = UFS_ERR_NOT_DIR;
+    } else if (dir->child_count > 0) {
+        error = UFS_ERR_NOT_EMPTY;
+    }
+    if (error != UFS_ERR_NO_ERR) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(error);
+        return -1;
+    }
+    file_index_remove(&file_index, dir);
+    dir_unlink(dir);
+    redo_log(REDO_DELETE, dir->id, 0, NULL, 0);
+    free_file(dir);
+    pthread_rwlock_unlock(&namespace_lock);
+    return journal_finish();
+}
+
+/** Next entry of the subtree of @a root in pre-order, NULL after the last. */
+static struct file *subtree_next(struct file *root, struct file *file) {
+    if (file->children) {
+        return file->children;
+    }
+    for (; file != root; file = file->parent) {
+        if (file->sibling_next) {
+            return file->sibling_next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Move an entry with its subtree to a new path. The new names are
+ * allocated and the index has room before anything is changed, so
+ * a failure leaves the namespace as is. namespace_lock is held for
+ * write.
+ */
+static int file_rename(const char *old_path, const char *new_path) {
+    struct file *src = file_index_find(&file_index, old_path);
+    if (!src) {
+        assign_error_code(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    if (!strcmp(old_path, new_path)) {
+        return 0;
+    }
+    struct file *dir = dir_for_new(new_path);
+    if (!dir) {
+        return -1;
+    }
+    size_t old_len = strlen(old_path), new_len = strlen(new_path);
+    if (src->is_dir && !strncmp(new_path, old_path, old_len) && new_path[old_len] == '/') {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    struct file *dst = file_index_find(&file_index, new_path);
+    if (dst && (dst->is_dir || src->is_dir)) {
+        assign_error_code(UFS_ERR_EXISTS);
+        return -1;
+    }
+    size_t count = 0;
+    for (struct file *f = src; f; f = subtree_next(src, f)) {
+        count++;
+    }
+    char **names = malloc(count * sizeof(char *));
+    if (!names) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    // Entries keep the part of the path after the moved one
+    size_t i = 0;
+    for (struct file *f = src; f; f = subtree_next(src, f), i++) {
+        size_t tail = strlen(f->name) - old_len;
+        names[i] = malloc(new_len + tail + 1);
+        if (!names[i]) {
+            break;
+        }
+        memcpy(names[i], new_path, new_len);
+        memcpy(names[i] + new_len, f->name + old_len, tail + 1);
+    }
+    if (i < count || file_index_reserve(&file_index, count) != 0) {
+        while (i > 0) {
+            free(names[--i]);
+        }
+        free(names);
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    // A replaced file is deleted, it lives on while opened
+    if (dst) {
+        file_index_remove(&file_index, dst);
+        dir_unlink(dst);
+        if (dst->refs > 0) {
+            dst->planed_to_delete = 1;
+        } else {
+            free_file(dst);
+        }
+    }
+    for (struct file *f = src; f; f = subtree_next(src, f)) {
+        file_index_remove(&file_index, f);
+    }
+    i = 0;
+    for (struct file *f = src; f; f = subtree_next(src, f), i++) {
+        size_t len = strlen(names[i]);
+        memory_uncharge(0, strlen(f->name) + 1);
+        memory_charge(0, len + 1, false);
+        free(f->name);
+        f->name = names[i];
+        f->name_hash = name_hash(f->name, len);
+        file_index_insert(&file_index, f);
+    }
+    free(names);
+    dir_unlink(src);
+    dir_link(dir, src);
+    redo_log_path(REDO_RENAME, src->id, 0, new_path);
+    return 0;
+}
+
+int ufs_rename(const char *old_path, const char *new_path) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    int rc = file_rename(old_path, new_path);
+    pthread_rwlock_unlock(&namespace_lock);
+    return rc == 0 ? journal_finish() : rc;
+}
+
+struct ufs_dir {
+    size_t count;
+    size_t pos;
+    /** Entries, followed by their names. */
+    struct ufs_dirent entries[];
+};
+
+struct ufs_dir *ufs_opendir(const char *path) {
+    pthread_rwlock_rdlock(&namespace_lock);
+    struct file *dir = *path ? file_index_find(&file_index, path) : &root_dir;
+    if (!dir || !dir->is_dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(dir ? UFS_ERR_NOT_DIR : UFS_ERR_NO_FILE);
+        return NULL;
+    }
+    // Names of the entries are after the directory path and a slash
+    size_t prefix = *path ? strlen(path) + 1 : 0;
+    size_t names_size = 0;
+    for (struct file *f = dir->children; f; f = f->sibling_next) {
+        names_size += strlen(f->name) - prefix + 1;
+    }
+    struct ufs_dir *result = malloc(sizeof(struct ufs_dir) + dir->child_count * sizeof(struct ufs_dirent) +
+                                    names_size);
+    if (!result) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    result->count = dir->child_count;
+    result->pos = 0;
+    char *names = (char *)&result->entries[result->count];
+    size_t i = 0;
+    for (struct file *f = dir->children; f; f = f->sibling_next, i++) {
+        size_t len = strlen(f->name) - prefix + 1;
+        memcpy(names, f->name + prefix, len);
+        result->entries[i].name = names;
+        result->entries[i].is_dir = f->is_dir;
+        names += len;
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    return result;
+}
+
+const struct ufs_dirent *ufs_readdir(struct ufs_dir *dir) {
+    return dir->pos < dir->count ? &dir->entries[dir->pos++] : NULL;
+}
+
+void ufs_closedir(struct ufs_dir *dir) {
+    free(dir);
+}
+
+/*
+ * Snapshot image layout. All offsets are from the image start,
+ * numbers are in the host byte order.
+ *
+ *   superblock
+ *   files       - struct image_file per file or directory
+ *   name index  - uint32_t slots, file number + 1, 0 for empty,
+ *                 same hash and probing as file_index
+ *   block map   - uint64_t data offset per block of each file
+ *   names       - zero-terminated names
+ *   data        - blocks, each page aligned and of its full size,
+ *                 so it can be used in place. Bytes after the file
+ *                 end are holes and take no disk space.
+ */
+
+#define IMAGE_MAGIC "UFSIMG\0\1"
+
+enum {
+    /** Version 2 has directories, version 1 images load too. */
+    IMAGE_VERSION = 2,
+    IMAGE_ALIGN = 4096,
+};
+
+/** Flags of an image_file. */
+enum {
+    IMAGE_FILE_DIR = 1,
+};
+
+struct image_superblock {
+    char magic[8];
+    uint32_t version;
+    uint32_t min_block_size;
+    uint32_t max_block_size;
+    uint32_t file_count;
+    uint32_t index_capacity;
+    /** Checkpoint number of a journal, 0 for ufs_save(). */
+    uint32_t epoch;
+    uint64_t files_offset;
+    uint64_t index_offset;
+    uint64_t block_map_offset;
+    uint64_t names_offset;
+    uint64_t image_size;
+};
+
+struct image_file {
+    uint64_t size;
+    /** Offset of the name from names_offset. */
+    uint64_t name_offset;
+    /** First entry of the file in the block map. */
+    uint64_t block_map;
+    uint64_t block_count;
+    uint32_t name_hash;
+    uint32_t flags;
+};
+
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) / align * align;
+}
+
+/** Write the whole buffer at an offset. */
+static int image_pwrite(int fd, const void *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t rc = pwrite(fd, buf, size, offset);
+        if (rc < 0) {
+            assign_error_code(UFS_ERR_IO);
+            return -1;
+        }
+        buf = (const char *)buf + rc;
+        size -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/**
+ * Wait until a busy file is unlocked. namespace_lock is held, and
+ * it is released: a view holder keeps the file locked across calls
+ * which take namespace_lock, so waiting under it could deadlock.
+ */
+static void file_wait_unlocked(struct file *file) {
+    // The reference keeps the file alive without the namespace lock
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&namespace_lock);
+    pthread_rwlock_rdlock(&file->lock);
+    pthread_rwlock_unlock(&file->lock);
+    file_unref(file);
+}
+
+/** Unlock the files of the namespace in the index slots before the end. */
+static void namespace_unlock_files(uint32_t end) {
+    for (uint32_t i = 0; i < end; i++) {
+        struct file *file = file_index.slots[i];
+        if (file && file != FILE_INDEX_TOMBSTONE) {
+            pthread_rwlock_unlock(&file->lock);
+        }
+    }
+}
+
+/**
+ * Lock the namespace, for write or for read, and all its files for
+ * read. A busy file is waited for with nothing locked, and then
+ * the locking starts over.
+ */
+static void namespace_lock_files(int is_write) {
+    while (1) {
+        if (is_write) {
+            pthread_rwlock_wrlock(&namespace_lock);
+        } else {
+            pthread_rwlock_rdlock(&namespace_lock);
+        }
+        uint32_t i = 0;
+        for (; i < file_index.capacity; i++) {
+            struct file *file = file_index.slots[i];
+            if (file && file != FILE_INDEX_TOMBSTONE && pthread_rwlock_tryrdlock(&file->lock) != 0) {
+                break;
+            }
+        }
+        if (i == file_index.capacity) {
+            return;
+        }
+        namespace_unlock_files(i);
+        file_wait_unlocked(file_index.slots[i]);
+    }
+}
+
+/**
+ * Save the files into an image. A checkpoint of the journal also
+ * starts a new log, while the files are still locked, so the log
+ * has exactly the changes made after the image.
+ */
+static int image_save(const char *path, uint32_t epoch, int is_checkpoint) {
+    // Creation and deletion wait, and the files are locked against writers
+    namespace_lock_files(0);
+    uint32_t count = file_index.count;
+    uint32_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    struct file **files = malloc((count + 1) * sizeof(struct file *));
+    uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+    if (!files || !slots) {
+        namespace_unlock_files(file_index.capacity);
+        pthread_rwlock_unlock(&namespace_lock);
+        free(files);
+        free(slots);
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    uint32_t n = 0;
+    size_t block_total = 0, names_size = 0;
+    for (uint32_t i = 0; i < file_index.capacity; i++) {
+        struct file *file = file_index.slots[i];
+        if (!file || file == FILE_INDEX_TOMBSTONE) {
+            continue;
+        }
+        files[n] = file;
+        uint32_t j = file->name_hash & (capacity - 1);
+        while (slots[j]) {
+            j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = ++n;
+        block_total += block_count_for(file->size);
+        names_size += strlen(file->name) + 1;
+    }
+
+    // Lay out the sections, the metadata goes in one buffer
+    struct image_superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, IMAGE_MAGIC, sizeof(sb.magic));
+    sb.version = IMAGE_VERSION;
+    sb.epoch = epoch;
+    sb.min_block_size = UFS_MIN_BLOCK_SIZE;
+    sb.max_block_size = UFS_MAX_BLOCK_SIZE;
+    sb.file_count = count;
+    sb.index_capacity = capacity;
+    sb.files_offset = sizeof(sb);
+    sb.index_offset = sb.files_offset + (size_t)count * sizeof(struct image_file);
+    sb.block_map_offset = sb.index_offset + (size_t)capacity * sizeof(uint32_t);
+    sb.names_offset = sb.block_map_offset + block_total * sizeof(uint64_t);
+    size_t data_offset = align_up(sb.names_offset + names_size, IMAGE_ALIGN);
+    char *meta = calloc(1, data_offset);
+    int rc = -1;
+    if (!meta) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        goto out;
+    }
+    struct image_file *image_files = (struct image_file *)(meta + sb.files_offset);
+    uint64_t *block_map = (uint64_t *)(meta + sb.block_map_offset);
+    memcpy(meta + sb.index_offset, slots, capacity * sizeof(uint32_t));
+    size_t offset = data_offset, name_offset = 0, map_pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct file *file = files[i];
+        struct image_file *f = &image_files[i];
+        f->size = file->size;
+        f->name_offset = name_offset;
+        f->block_map = map_pos;
+        f->block_count = block_count_for(file->size);
+        f->name_hash = file->name_hash;
+        f->flags = file->is_dir ? IMAGE_FILE_DIR : 0;
+        size_t len = strlen(file->name) + 1;
+        memcpy(meta + sb.names_offset + name_offset, file->name, len);
+        name_offset += len;
+        for (size_t b = 0; b < f->block_count; b++) {
+            // A hole takes no space, 0 is never an offset of data
+            if (!file->blocks[b]) {
+                block_map[map_pos++] = 0;
+                continue;
+            }
+            offset = align_up(offset, MIN(block_size(b), IMAGE_ALIGN));
+            block_map[map_pos++] = offset;
+            offset += block_size(b);
+        }
+    }
+    sb.image_size = offset;
+    memcpy(meta, &sb, sizeof(sb));
+
+    // Write a temporary file and rename it, so an old image is never half overwritten
+    char *tmp_path = malloc(strlen(path) + 5);
+    if (!tmp_path) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        goto out;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        assign_error_code(UFS_ERR_IO);
+        free(tmp_path);
+        goto out;
+    }
+    int is_ok = image_pwrite(fd, meta, data_offset, 0) == 0;
+    char *unpacked = NULL;
+    // Only the used bytes of each block are written, sequentially
+    for (uint32_t i = 0; i < count && is_ok; i++) {
+        struct file *file = files[i];
+        const struct image_file *f = &image_files[i];
+        for (size_t b = 0; b < f->block_count && is_ok; b++) {
+            if (!file->blocks[b]) {
+                continue;
+            }
+            size_t used = MIN(block_size(b), file->size - block_start(b));
+            const char *memory = file->blocks[b]->memory;
+            if (file->blocks[b]->compressed) {
+                // The file is locked for read, so the block is unpacked aside
+                if (!unpacked && !(unpacked = malloc(UFS_MAX_BLOCK_SIZE))) {
+                    assign_error_code(UFS_ERR_NO_MEM);
+                    is_ok = 0;
+                    break;
+                }
+                lz_decompress(file->blocks[b]->compressed, file->blocks[b]->compressed_size,
+                              unpacked, file->blocks[b]->compressed_used);
+                memory = unpacked;
+            }
+            is_ok = image_pwrite(fd, memory, used, block_map[f->block_map + b]) == 0;
+        }
+    }
+    free(unpacked);
+    if (is_ok && (ftruncate(fd, sb.image_size) != 0 || fsync(fd) != 0)) {
+        assign_error_code(UFS_ERR_IO);
+        is_ok = 0;
+    }
+    if (close(fd) != 0 && is_ok) {
+        assign_error_code(UFS_ERR_IO);
+        is_ok = 0;
+    }
+    if (is_ok && rename(tmp_path, path) != 0) {
+        assign_error_code(UFS_ERR_IO);
+        is_ok = 0;
+    }
+    if (!is_ok) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    // The image must be durable before the old log is dropped
+    if (is_ok && is_checkpoint && (journal_sync_dir(path) != 0 || journal_reset(journal, epoch) != 0)) {
+        assign_error_code(UFS_ERR_IO);
+        is_ok = 0;
+    }
+    // The new log names the files of the image by their numbers
+    for (uint32_t i = 0; i < count && is_ok && is_checkpoint; i++) {
+        redo_log_path(REDO_BIND, files[i]->id, 0, files[i]->name);
+    }
+    rc = is_ok ? 0 : -1;
+out:
+    for (uint32_t i = 0; i < count; i++) {
+        pthread_rwlock_unlock(&files[i]->lock);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    free(meta);
+    free(files);
+    free(slots);
+    return rc;
+}
+
+int ufs_save(const char *path) {
+    return image_save(path, 0, 0);
+}
+
+/** Check that the image sections are inside of it and consistent. */
+static int image_check(const char *base, size_t size) {
+    const struct image_superblock *sb = (const struct image_superblock *)base;
+    if (size < sizeof(*sb) || memcmp(sb->magic, IMAGE_MAGIC, sizeof(sb->magic)) != 0 ||
+        sb->version < 1 || sb->version > IMAGE_VERSION || sb->min_block_size != UFS_MIN_BLOCK_SIZE ||
+        sb->max_block_size != UFS_MAX_BLOCK_SIZE || sb->image_size != size ||
+        sb->index_capacity == 0 || (sb->index_capacity & (sb->index_capacity - 1)) != 0 ||
+        sb->index_capacity < sb->file_count ||
+        sb->files_offset + (uint64_t)sb->file_count * sizeof(struct image_file) > sb->index_offset ||
+        sb->index_offset + (uint64_t)sb->index_capacity * sizeof(uint32_t) > sb->block_map_offset ||
+        sb->block_map_offset > sb->names_offset || sb->names_offset > size) {
+        return -1;
+    }
+    const struct image_file *files = (const struct image_file *)(base + sb->files_offset);
+    const uint32_t *slots = (const uint32_t *)(base + sb->index_offset);
+    const uint64_t *block_map = (const uint64_t *)(base + sb->block_map_offset);
+    size_t map_size = (sb->names_offset - sb->block_map_offset) / sizeof(uint64_t);
+    size_t names_size = size - sb->names_offset;
+    // Each file is in the index exactly once
+    uint32_t indexed = 0;
+    for (uint32_t i = 0; i < sb->index_capacity; i++) {
+        if (slots[i] > sb->file_count) {
+            return -1;
+        }
+        indexed += slots[i] != 0;
+    }
+    char *seen = calloc(sb->file_count + 1, 1);
+    if (!seen || indexed != sb->file_count) {
+        free(seen);
+        return -1;
+    }
+    for (uint32_t i = 0; i < sb->index_capacity; i++) {
+        if (slots[i] && seen[slots[i] - 1]++) {
+            free(seen);
+            return -1;
+        }
+    }
+    free(seen);
+    for (uint32_t i = 0; i < sb->file_count; i++) {
+        const struct image_file *f = &files[i];
+        if (f->size > MAX_FILE_SIZE || f->block_count != block_count_for(f->size) ||
+            f->block_map > map_size || f->block_count > map_size - f->block_map ||
+            f->name_offset >= names_size ||
+            !memchr(base + sb->names_offset + f->name_offset, 0, names_size - f->name_offset)) {
+            return -1;
+        }
+        for (size_t b = 0; b < f->block_count; b++) {
+            uint64_t offset = block_map[f->block_map + b];
+            if (offset != 0 && (offset < sb->names_offset || offset > size || block_size(b) > size - offset)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Restore the files from an image.
+ * @param[out] epoch Checkpoint number of the image, if not NULL.
+ */
+static int image_load(const char *path, uint32_t *epoch) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        assign_error_code(UFS_ERR_IO);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        assign_error_code(UFS_ERR_IO);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    // Read only: the first write into a restored block copies it
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        assign_error_code(UFS_ERR_IO);
+        return -1;
+    }
+    struct ufs_image *image = malloc(sizeof(struct ufs_image));
+    if (!image) {
+        munmap(base, size);
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    image->base = base;
+    image->size = size;
+    image->block_refs = 0;
+    if (image_check(base, size) != 0) {
+        free(image);
+        munmap(base, size);
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    pthread_once(&block_pools_once, block_pools_create);
+    const struct image_superblock *sb = (const struct image_superblock *)base;
+    if (epoch) {
+        *epoch = sb->epoch;
+    }
+    const struct image_file *image_files = (const struct image_file *)(base + sb->files_offset);
+    const uint32_t *slots = (const uint32_t *)(base + sb->index_offset);
+    const uint64_t *block_map = (const uint64_t *)(base + sb->block_map_offset);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    if (file_index.count > 0) {
+        // Loading merges nothing, it restores a whole namespace
+        pthread_rwlock_unlock(&namespace_lock);
+        free(image);
+        munmap(base, size);
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    struct file **files = calloc(sb->file_count + 1, sizeof(struct file *));
+    struct file **index_slots = calloc(sb->index_capacity, sizeof(struct file *));
+    int is_ok = files && index_slots;
+    for (uint32_t i = 0; i < sb->file_count && is_ok; i++) {
+        const struct image_file *f = &image_files[i];
+        struct file *file = new_file(base + sb->names_offset + f->name_offset);
+        if (!file) {
+            is_ok = 0;
+            break;
+        }
+        files[i] = file;
+        file->is_dir = (f->flags & IMAGE_FILE_DIR) != 0;
+        file->size = f->size;
+        file->blocks = malloc((f->block_count + 1) * sizeof(struct block *));
+        is_ok = file->blocks != NULL;
+        if (is_ok) {
+            // The mapped data is the image's, only the map and headers are charged
+            file->block_capacity = f->block_count + 1;
+            memory_charge(0, file->block_capacity * sizeof(struct block *), false);
+        }
+        // Blocks point into the mapping, their data is read on the first touch
+        for (size_t b = 0; b < f->block_count && is_ok; b++) {
+            if (block_map[f->block_map + b] == 0) {
+                file->blocks[file->block_count++] = NULL;
+                continue;
+            }
+            struct slab *slab;
+            struct block *block = slab_alloc(&block_pool, &slab);
+            if (!block) {
+                is_ok = 0;
+                break;
+            }
+            block->slab = slab;
+            block->memory = base + block_map[f->block_map + b];
+            block->memory_slab = NULL;
+            block->image = image;
+            block->refs = 1;
+            block->is_dedup_indexed = 0;
+            block->compressed = NULL;
+            block->block_size = block_size(b);
+            memory_charge(0, sizeof(struct block), false);
+            image->block_refs++;
+            file->blocks[file->block_count++] = block;
+        }
+    }
+    enum ufs_error_code error = UFS_ERR_NO_MEM;
+    if (is_ok) {
+        // The stored index has the same layout as file_index, no rehash
+        for (uint32_t i = 0; i < sb->index_capacity; i++) {
+            index_slots[i] = slots[i] ? files[slots[i] - 1] : NULL;
+        }
+        // Each entry is in a directory of the image
+        struct file_index loaded = {index_slots, sb->index_capacity, sb->file_count, 0};
+        error = UFS_ERR_INVALID_ARG;
+        for (uint32_t i = 0; i < sb->file_count && is_ok; i++) {
+            is_ok = dir_of_path(&loaded, files[i]->name) != NULL;
+        }
+    }
+    if (!is_ok) {
+        // Free what is built, holding the mapping until the end
+        image->block_refs++;
+        for (uint32_t i = 0; i < sb->file_count && files && files[i]; i++) {
+            file_destroy(files[i]);
+        }
+        pthread_rwlock_unlock(&namespace_lock);
+        free(files);
+        free(index_slots);
+        if (--image->block_refs == 0) {
+            munmap(base, size);
+            free(image);
+        }
+        assign_error_code(error);
+        return -1;
+    }
+    free(file_index.slots);
+    file_index.slots = index_slots;
+    file_index.capacity = sb->index_capacity;
+    file_index.count = sb->file_count;
+    file_index.tombstones = 0;
+    for (uint32_t i = 0; i < sb->file_count; i++) {
+        file_list_add(files[i]);
+        dir_link(dir_of_path(&file_index, files[i]->name), files[i]);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    free(files);
+    if (image->block_refs == 0) {
+        // No blocks, the image is not needed
+        munmap(base, size);
+        free(image);
+    }
+    return 0;
+}
+
+int ufs_load(const char *path) {
+    return image_load(path, NULL);
+}
+
+/**
+ * Make a new file @a name sharing all the blocks of @a src. The
+ * source is locked for read at least.
+ */
+static struct file *file_clone(struct file *src, const char *name) {
+    struct file *file = new_file(name);
+    if (!file) {
+        return NULL;
+    }
+    size_t count = block_count_for(src->size);
+    if (memory_charge(0, MAX(count, 1) * sizeof(struct block *), true) != 0) {
+        file_destroy(file);
+        return NULL;
+    }
+    file->blocks = malloc(MAX(count, 1) * sizeof(struct block *));
+    if (!file->blocks) {
+        memory_uncharge(0, MAX(count, 1) * sizeof(struct block *));
+        file_destroy(file);
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    file->block_capacity = MAX(count, 1);
+    for (size_t i = 0; i < count; i++) {
+        file->blocks[i] = src->blocks[i];
+        if (src->blocks[i]) {
+            __atomic_add_fetch(&src->blocks[i]->refs, 1, __ATOMIC_ACQ_REL);
+            file->compressed_blocks += src->blocks[i]->compressed != NULL;
+        }
+    }
+    file->block_count = count;
+    file->size = src->size;
+    return file;
+}
+
+static int file_try_clone(const char *src_name, const char *dst_name) {
+retry:
+    pthread_rwlock_wrlock(&namespace_lock);
+    struct file *src = file_index_find(&file_index, src_name);
+    if (!src) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    if (src->is_dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_IS_DIR);
+        return -1;
+    }
+    if (file_index_find(&file_index, dst_name)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        assign_error_code(UFS_ERR_EXISTS);
+        return -1;
+    }
+    struct file *dir = dir_for_new(dst_name);
+    if (!dir) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -1;
+    }
+    // The source stays locked until the copy is logged, after its last write
+    if (pthread_rwlock_tryrdlock(&src->lock) != 0) {
+        file_wait_unlocked(src);
+        goto retry;
+    }
+    struct file *dst = file_clone(src, dst_name);
+    if (!dst || file_index_insert(&file_index, dst) != 0) {
+        pthread_rwlock_unlock(&src->lock);
+        pthread_rwlock_unlock(&namespace_lock);
+        if (dst) {
+            file_destroy(dst);
+        }
+        return -1;
+    }
+    file_list_add(dst);
+    dir_link(dir, dst);
+    redo_log_path(REDO_CLONE, dst->id, src->id, dst_name);
+    pthread_rwlock_unlock(&src->lock);
+    pthread_rwlock_unlock(&namespace_lock);
+    return 0;
+}
+
+int ufs_clone(const char *src_name, const char *dst_name) {
+    memory_shortage = 0;
+    int rc = file_try_clone(src_name, dst_name);
+    if (rc != 0 && memory_evict()) {
+        rc = file_try_clone(src_name, dst_name);
+    }
+    return rc == 0 ? journal_finish() : rc;
+}
+
+struct ufs_snapshot {
+    /** Clones of the files, invisible in the namespace. */
+    struct file_index index;
+};
+
+/** Drop the files of a snapshot. namespace_lock is held for write. */
+static void snapshot_drop_files(struct ufs_snapshot *snapshot) {
+    for (uint32_t i = 0; i < snapshot->index.capacity; i++) {
+        struct file *file = snapshot->index.slots[i];
+        if (!file || file == FILE_INDEX_TOMBSTONE) {
+            continue;
+        }
+        // Opened files live until the last close
+        if (file->refs > 0) {
+            file->planed_to_delete = 1;
+        } else {
+            free_file(file);
+        }
+    }
+    free(snapshot->index.slots);
+}
+
+struct ufs_snapshot *ufs_snapshot_create(void) {
+    struct ufs_snapshot *snapshot = calloc(1, sizeof(struct ufs_snapshot));
+    if (!snapshot) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    // All the files are locked together, so the snapshot is one point in time
+    namespace_lock_files(1);
+    int is_ok = 1;
+    for (uint32_t i = 0; i < file_index.capacity; i++) {
+        struct file *file = file_index.slots[i];
+        if (!file || file == FILE_INDEX_TOMBSTONE) {
+            continue;
+        }
+        // Snapshots have no directories, files are found by full paths
+        if (is_ok && !file->is_dir) {
+            struct file *copy = file_clone(file, file->name);
+            if (!copy || file_index_insert(&snapshot->index, copy) != 0) {
+                if (copy) {
+                    file_destroy(copy);
+                }
+                is_ok = 0;
+            } else {
+                file_list_add(copy);
+            }
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    if (!is_ok) {
+        snapshot_drop_files(snapshot);
+        free(snapshot);
+        snapshot = NULL;
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    return snapshot;
+}
+
+int ufs_snapshot_open(struct ufs_snapshot *snapshot, const char *filename) {
+    pthread_rwlock_rdlock(&namespace_lock);
+    struct file *file = file_index_find(&snapshot->index, filename);
+    if (file) {
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_rwlock_unlock(&namespace_lock);
+    if (!file) {
+        assign_error_code(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    return filedesc_open(file, UFS_READ_ONLY);
+}
+
+void ufs_snapshot_delete(struct ufs_snapshot *snapshot) {
+    pthread_rwlock_wrlock(&namespace_lock);
+    snapshot_drop_files(snapshot);
+    pthread_rwlock_unlock(&namespace_lock);
+    free(snapshot);
+}
+
+/**
+ * Files of a journal being replayed, by their numbers: open
+ * addressing with linear probing. Only the entries in the
+ * namespace are here, records of the others are skipped.
+ */
+struct redo_replay {
+    /** Slots: NULL - empty, FILE_INDEX_TOMBSTONE - removed. */
+    struct file **slots;
+    size_t capacity;
+    /** Slots taken by files and tombstones. */
+    size_t used;
+    /** The biggest file number in the records. */
+    uint64_t id_max;
+    /** A record failed, the error is set. */
+    int is_failed;
+};
+
+static struct file **redo_replay_slot(struct redo_replay *replay, uint64_t id) {
+    size_t i = (id * 0x9E3779B97F4A7C15ULL >> 32) & (replay->capacity - 1);
+    struct file **tombstone = NULL;
+    for (;; i = (i + 1) & (replay->capacity - 1)) {
+        struct file *file = replay->slots[i];
+        if (!file) {
+            return tombstone ? tombstone : &replay->slots[i];
+        }
+        if (file == FILE_INDEX_TOMBSTONE) {
+            tombstone = tombstone ? tombstone : &replay->slots[i];
+        } else if (file->id == id) {
+            return &replay->slots[i];
+        }
+    }
+}
+
+static struct file *redo_replay_find(struct redo_replay *replay, uint64_t id) {
+    if (!replay->capacity) {
+        return NULL;
+    }
+    struct file *file = *redo_replay_slot(replay, id);
+    return file != FILE_INDEX_TOMBSTONE ? file : NULL;
+}
+
+static void redo_replay_remove(struct redo_replay *replay, struct file *file) {
+    if (!replay->capacity) {
+        return;
+    }
+    struct file **slot = redo_replay_slot(replay, file->id);
+    if (*slot == file) {
+        *slot = FILE_INDEX_TOMBSTONE;
+    }
+}
+
+/** Give a file its number from the log, and add it to the table. */
+static int redo_replay_add(struct redo_replay *replay, struct file *file, uint64_t id) {
+    if ((replay->used + 1) * 2 > replay->capacity) {
+        struct redo_replay old = *replay;
+        replay->capacity = MAX(old.capacity * 2, 64);
+        replay->slots = calloc(replay->capacity, sizeof(struct file *));
+        if (!replay->slots) {
+            *replay = old;
+            assign_error_code(UFS_ERR_NO_MEM);
+            return -1;
+        }
+        replay->used = 0;
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i] && old.slots[i] != FILE_INDEX_TOMBSTONE) {
+                *redo_replay_slot(replay, old.slots[i]->id) = old.slots[i];
+                replay->used++;
+            }
+        }
+        free(old.slots);
+    }
+    file->id = id;
+    replay->id_max = MAX(replay->id_max, id);
+    struct file **slot = redo_replay_slot(replay, id);
+    replay->used += *slot == NULL;
+    *slot = file;
+    return 0;
+}
+
+/** Entry of the namespace by its path, or NULL. */
+static struct file *redo_replay_lookup(const char *path) {
+    pthread_rwlock_rdlock(&namespace_lock);
+    struct file *file = file_index_find(&file_index, path);
+    pthread_rwlock_unlock(&namespace_lock);
+    return file;
+}
+
+/**
+ * Apply a redo record. It runs before the journal is set, so the
+ * changes are not logged again.
+ */
+static int redo_replay_record(const char *body, size_t size, void *ctx) {
+    struct redo_replay *replay = ctx;
+    struct redo_head head;
+    if (size < sizeof(head)) {
+        goto bad;
+    }
+    memcpy(&head, body, sizeof(head));
+    const char *tail = body + sizeof(head);
+    size_t tail_size = size - sizeof(head);
+    int has_path = head.type == REDO_BIND || head.type == REDO_CREATE || head.type == REDO_RENAME ||
+                   head.type == REDO_CLONE;
+    if (has_path && (tail_size == 0 || tail[tail_size - 1] != 0)) {
+        goto bad;
+    }
+    struct file *file = redo_replay_find(replay, head.id);
+    int rc = 0;
+    switch (head.type) {
+    case REDO_BIND:
+        file = redo_replay_lookup(tail);
+        if (!file) {
+            goto bad;
+        }
+        return redo_replay_add(replay, file, head.id);
+    case REDO_CREATE:
+    case REDO_CLONE:
+        if (redo_replay_lookup(tail)) {
+            goto bad;
+        }
+        if (head.type == REDO_CLONE) {
+            struct file *src = redo_replay_find(replay, head.arg);
+            if (!src) {
+                goto bad;
+            }
+            rc = ufs_clone(src->name, tail);
+        } else if (head.arg) {
+            rc = ufs_mkdir(tail);
+        } else {
+            int fd = ufs_open(tail, UFS_CREATE);
+            rc = fd < 0 ? -1 : ufs_close(fd);
+        }
+        if (rc != 0) {
+            break;
+        }
+        return redo_replay_add(replay, redo_replay_lookup(tail), head.id);
+    case REDO_DELETE:
+        if (!file) {
+            goto bad;
+        }
+        redo_replay_remove(replay, file);
+        rc = file->is_dir ? ufs_rmdir(file->name) : ufs_delete(file->name);
+        break;
+    case REDO_RENAME: {
+        if (!file) {
+            goto bad;
+        }
+        // A replaced file is freed, and the old name is freed by the move
+        struct file *dst = redo_replay_lookup(tail);
+        if (dst && dst != file) {
+            redo_replay_remove(replay, dst);
+        }
+        char *old_path = strdup(file->name);
+        if (!old_path) {
+            assign_error_code(UFS_ERR_NO_MEM);
+            rc = -1;
+            break;
+        }
+        rc = ufs_rename(old_path, tail);
+        free(old_path);
+        break;
+    }
+    case REDO_WRITE:
+        // A file out of the namespace is not restored, nor its changes
+        if (file && file_write(file, tail, tail_size, head.arg) < 0) {
+            rc = -1;
+        }
+        break;
+    case REDO_RESIZE:
+        if (file && (head.arg > MAX_FILE_SIZE || file_resize(file, head.arg) != 0)) {
+            rc = -1;
+        }
+        break;
+    default:
+        goto bad;
+    }
+    replay->is_failed = rc != 0;
+    return rc;
+bad:
+    assign_error_code(UFS_ERR_INVALID_ARG);
+    replay->is_failed = 1;
+    return -1;
+}
+
+/**
+ * Make a checkpoint: an image of the next epoch and a new log.
+ * The records naming the files in it are committed at once.
+ */
+static int journal_checkpoint(void) {
+    pthread_mutex_lock(&checkpoint_lock);
+    int rc = image_save(journal_image_path, journal_epoch(journal) + 1, 1);
+    if (rc == 0) {
+        __atomic_add_fetch(&journal_checkpoints, 1, __ATOMIC_RELAXED);
+        if (journal_lsn && journal_commit(journal, journal_lsn, true) != 0) {
+            assign_error_code(UFS_ERR_IO);
+            rc = -1;
+        }
+    }
+    journal_lsn = 0;
+    pthread_mutex_unlock(&checkpoint_lock);
+    return rc;
+}
+
+static void *checkpointer_f(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&checkpointer_lock);
+    while (!is_checkpointer_stopping) {
+        if (!is_checkpoint_wanted) {
+            pthread_cond_wait(&checkpointer_cond, &checkpointer_lock);
+            continue;
+        }
+        is_checkpoint_wanted = 0;
+        pthread_mutex_unlock(&checkpointer_lock);
+        // A failure breaks the log, and the next change reports it
+        journal_checkpoint();
+        pthread_mutex_lock(&checkpointer_lock);
+    }
+    pthread_mutex_unlock(&checkpointer_lock);
+    return NULL;
+}
+
+int ufs_journal_open(const char *path, unsigned group_size, size_t checkpoint_size) {
+    if (journal) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    char *log_path = malloc(strlen(path) + 5);
+    journal_image_path = strdup(path);
+    if (!log_path || !journal_image_path) {
+        free(log_path);
+        free(journal_image_path);
+        journal_image_path = NULL;
+        assign_error_code(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    sprintf(log_path, "%s.log", path);
+    // Recovery: the last checkpoint and the changes after it
+    uint32_t epoch = 0;
+    int rc = 0;
+    if (access(path, F_OK) == 0) {
+        rc = image_load(path, &epoch);
+    }
+    struct redo_replay replay = {NULL, 0, 0, 0, 0};
+    size_t replayed = 0;
+    if (rc == 0 && journal_replay(log_path, epoch, redo_replay_record, &replay, &replayed) != 0) {
+        if (!replay.is_failed) {
+            assign_error_code(errno == EINVAL ? UFS_ERR_INVALID_ARG : UFS_ERR_IO);
+        }
+        rc = -1;
+    }
+    free(replay.slots);
+    uint64_t id_max = __atomic_load_n(&file_id_max, __ATOMIC_RELAXED);
+    while (id_max < replay.id_max &&
+           !__atomic_compare_exchange_n(&file_id_max, &id_max, replay.id_max, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+    journal_replayed = replayed;
+    journal_checkpoints = 0;
+    journal_checkpoint_size = checkpoint_size;
+    if (rc == 0 && !(journal = journal_new(log_path, group_size))) {
+        assign_error_code(UFS_ERR_NO_MEM);
+        rc = -1;
+    }
+    free(log_path);
+    // The first checkpoint drops the replayed log, and a torn tail of it
+    if (rc == 0 && image_save(path, epoch + 1, 1) != 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        journal_checkpoints = 1;
+        if (journal_lsn && journal_commit(journal, journal_lsn, true) != 0) {
+            assign_error_code(UFS_ERR_IO);
+            rc = -1;
+        }
+    }
+    journal_lsn = 0;
+    if (rc == 0 && checkpoint_size) {
+        is_checkpointer_stopping = 0;
+        is_checkpoint_wanted = 0;
+        has_checkpointer = pthread_create(&checkpointer, NULL, checkpointer_f, NULL) == 0;
+        if (!has_checkpointer) {
+            assign_error_code(UFS_ERR_NO_MEM);
+            rc = -1;
+        }
+    }
+    if (rc != 0) {
+        if (journal) {
+            journal_delete(journal);
+            journal = NULL;
+        }
+        free(journal_image_path);
+        journal_image_path = NULL;
+    }
+    return rc;
+}
+
+int ufs_journal_sync(void) {
+    if (!journal) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    journal_lsn = 0;
+    if (journal_commit(journal, journal_last_lsn(journal), true) != 0) {
+        assign_error_code(UFS_ERR_IO);
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int ufs_checkpoint(void) {
+    if (!journal) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    return journal_checkpoint();
+}
+
+int ufs_journal_close(void) {
+    if (!journal) {
+        assign_error_code(UFS_ERR_INVALID_ARG);
+        return -1;
+    }
+    if (has_checkpointer) {
+        pthread_mutex_lock(&checkpointer_lock);
+        is_checkpointer_stopping = 1;
+        pthread_cond_signal(&checkpointer_cond);
+        pthread_mutex_unlock(&checkpointer_lock);
+        pthread_join(checkpointer, NULL);
+        has_checkpointer = 0;
+    }
+    int rc = ufs_journal_sync();
+    journal_delete(journal);
+    journal = NULL;
+    free(journal_image_path);
+    journal_image_path = NULL;
+    return rc;
+}
+
+void ufs_get_journal_stats(struct ufs_journal_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->replayed = journal_replayed;
+    if (!journal) {
+        return;
+    }
+    struct journal_stats log_stats;
+    journal_get_stats(journal, &log_stats);
+    stats->records = log_stats.records;
+    stats->bytes = log_stats.bytes;
+    stats->commits = log_stats.commits;
+    stats->log_size = log_stats.size;
+    stats->checkpoints = __atomic_load_n(&journal_checkpoints, __ATOMIC_RELAXED);
+}
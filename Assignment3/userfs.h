@@ -1,12 +1,26 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks, indexed by
+ * block number, so any offset is reached in O(1).
+ *
+ * Files and directories are named by paths from the root, with
+ * components separated by single slashes: "dir/sub/file". The
+ * root itself is "". A path has no leading or trailing slash, and
+ * no empty, "." or ".." components. A file can be created only in
+ * an existing directory, and a name without slashes is in the
+ * root. A path is found by one hash probe at any depth.
+ *
+ * All the functions can be called from several threads. Lookups
+ * of names and reads of one file go in parallel, writes into
+ * different files too. A descriptor must not be closed while
+ * another thread uses it.
  */
 
 /**
@@ -17,9 +31,9 @@
        #define NEED_OPEN_FLAGS
  /*
  * To allow resize() functions define this:
-
- *      #define NEED_RESIZE
- 
+ */
+       #define NEED_RESIZE
+ /*
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
@@ -52,6 +66,15 @@ enum open_flags {
 	UFS_READ_WRITE = 8,
 
 #endif
+
+	/**
+	 * Gather small sequential writes of the descriptor in its
+	 * buffer, and put them into the file by whole blocks. The
+	 * other descriptors, ufs_save() and the journal see the data
+	 * after ufs_flush(), ufs_close() or any other call on the
+	 * descriptor, as with a stdio stream.
+	 */
+	UFS_BUFFERED = 16,
 };
 
 /** Possible errors from all functions. */
@@ -65,9 +88,29 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARG,
+	/** A system call failed, errno has the reason. */
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	/** A path component is a file, not a directory. */
+	UFS_ERR_NOT_DIR,
+	/** A file operation on a directory. */
+	UFS_ERR_IS_DIR,
+	/** Removal of a directory with entries. */
+	UFS_ERR_NOT_EMPTY,
 };
 
-/** Get code of the last error. */
+/** Origins of ufs_seek() offset. */
+enum ufs_seek_whence {
+	/** From the beginning of the file. */
+	UFS_SEEK_SET = 0,
+	/** From the current descriptor position. */
+	UFS_SEEK_CUR = 1,
+	/** From the end of the file. */
+	UFS_SEEK_END = 2,
+};
+
+/** Get code of the last error of the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -79,7 +122,10 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no parent directory to create it in.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
+ *     - UFS_ERR_NOT_DIR - the parent is a file.
+ *     - UFS_ERR_INVALID_ARG - bad path of a new file.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -113,15 +159,486 @@ ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
 /**
- * Close a file.
+ * Move the descriptor position. It is allowed to move beyond
+ * the file end. A write there leaves a gap of zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad @a whence or negative result.
+ */
+ssize_t
+ufs_seek(int fd, ssize_t offset, int whence);
+
+/** Space taken by a file. */
+struct ufs_file_stats {
+	/** File size. */
+	size_t logical_bytes;
+	/**
+	 * Memory of the blocks, compressed ones by their compressed
+	 * size. Blocks shared with clones are counted in each file.
+	 */
+	size_t physical_bytes;
+	/** Bytes of holes, which read as zeros and take no memory. */
+	size_t hole_bytes;
+	/** Memory of the file header, name, block map and block headers. */
+	size_t metadata_bytes;
+};
+
+/**
+ * Get the space taken by a file. A gap left by a write beyond the
+ * file end, or by growth with ufs_resize(), is a hole. Memory is
+ * given to a hole block on the first write into it.
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_file_stats(int fd, struct ufs_file_stats *stats);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and not changed. The block of the offset
+ * is found in O(1).
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write data to the file at the given offset. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the file would
+ *       become bigger than the maximal file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+enum {
+	/** Maximal number of buffers in one vectored call. */
+	UFS_IOV_MAX = 1024,
+};
+
+/**
+ * Read data from the file at the given offset into several
+ * buffers, filling them one after another. Like ufs_pread(), the
+ * descriptor position is not used and the start block is found in
+ * O(1). The file is locked once for all the buffers, so they see
+ * one state of the file.
+ * @param iov Buffers.
+ * @param iovcnt Number of buffers, not more than UFS_IOV_MAX.
+ *
+ * @retval >= 0 How many bytes were read, less than the total size
+ *     only at the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad @a iovcnt, or the total size
+ *       does not fit ssize_t.
+ */
+ssize_t
+ufs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/**
+ * Write several buffers one after another into the file at the
+ * given offset, in one call and atomically for other threads. The
+ * descriptor position is not used and not changed.
+ * @param iov Buffers.
+ * @param iovcnt Number of buffers, not more than UFS_IOV_MAX.
+ *
+ * @retval >= 0 How many bytes were written, always the total size.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the file would
+ *       become bigger than the maximal file size.
+ *     - UFS_ERR_INVALID_ARG - bad @a iovcnt, or the total size
+ *       does not fit ssize_t.
+ */
+ssize_t
+ufs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/** Like ufs_preadv(), but from the descriptor position, moving it. */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Like ufs_pwritev(), but at the descriptor position, moving it. */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Zero-copy access to a range of a file. A view points right into
+ * the file blocks, as a few pieces, one per block. It keeps the
+ * file alive and locked: a read view blocks writers of the file,
+ * a write view blocks everybody else. So views must be short
+ * living, and the thread holding a view must not read or write
+ * the same file by other means until the view is released.
+ */
+struct ufs_view;
+
+/**
+ * Get a read view of bytes [offset, offset + size) of the file,
+ * clipped by the file size. The descriptor position is not used.
+ * @param[out] view The view, to be freed by ufs_view_release().
+ *
+ * @retval >= 0 How many bytes are in the view.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is write-only.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_view_read(int fd, size_t offset, size_t size, struct ufs_view **view);
+
+/**
+ * Reserve bytes [offset, offset + size) of the file for writing in
+ * place. The blocks are allocated, but the file size is changed
+ * only by ufs_view_commit(). The descriptor position is not used.
+ * @param[out] view The view, to be committed or released.
+ *
+ * @retval >= 0 How many bytes are in the view, always @a size.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is read-only.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the file would
+ *       become bigger than the maximal file size.
+ */
+ssize_t
+ufs_view_reserve(int fd, size_t offset, size_t size, struct ufs_view **view);
+
+/** Pieces of a view, in file order. */
+const struct iovec *
+ufs_view_iov(const struct ufs_view *view, int *iovcnt);
+
+/**
+ * Publish the first @a size bytes of a write view and free it.
+ * The file grows if they end beyond its end.
+ * @retval 0 Success.
+ * @retval -1 Error occurred, the view is not freed.
+ *     - UFS_ERR_INVALID_ARG - a read view, or @a size is bigger
+ *       than the view.
+ */
+int
+ufs_view_commit(struct ufs_view *view, size_t size);
+
+/** Free a view. A write view is dropped without changes of the size. */
+void
+ufs_view_release(struct ufs_view *view);
+
+/**
+ * Make a copy of a file under a new name. The copy shares the
+ * memory of the source, and a block is copied only on the first
+ * write into it, by any of them. Costs O(number of blocks), no
+ * data is copied.
+ * @param src_name Name of the file to copy.
+ * @param dst_name Name of the copy, must not exist.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no source file, or no parent
+ *       directory of the destination.
+ *     - UFS_ERR_IS_DIR - the source is a directory.
+ *     - UFS_ERR_EXISTS - the destination exists.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src_name, const char *dst_name);
+
+/**
+ * Point-in-time copy of all the files visible by name. Built from
+ * clones, so it costs O(number of blocks) and shares the memory
+ * with the files until they are changed.
+ */
+struct ufs_snapshot;
+
+/**
+ * Take a snapshot. Writers of all the files wait until it is done.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot_create(void);
+
+/**
+ * Open a file of a snapshot by its name at the snapshot time. The
+ * descriptor is read-only and works with all the reading
+ * functions, including ufs_close().
+ * @retval >= 0 File descriptor.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file in the snapshot.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_open(struct ufs_snapshot *snapshot, const char *filename);
+
+/**
+ * Delete a snapshot. Its opened files live until they are closed.
+ */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snapshot);
+
+/** Counters of the deduplication, since the start. */
+struct ufs_dedup_stats {
+	/** Full blocks hashed on write. */
+	size_t blocks_hashed;
+	size_t bytes_hashed;
+	/** Time spent on hashing. */
+	unsigned long long hash_time_ns;
+	/** Blocks found equal to stored ones and replaced by them. */
+	size_t duplicates;
+	size_t bytes_saved;
+	/** Bytes in the distinct blocks indexed now. */
+	size_t unique_bytes;
+};
+
+/**
+ * Turn deduplication on or off, it is off by default. When on, a
+ * block is hashed when it is full and its last byte is written.
+ * If an equal block is stored already, the file shares it, as
+ * after ufs_clone(). Equal hashes are verified by bytes.
+ */
+void
+ufs_set_dedup(int is_enabled);
+
+void
+ufs_get_dedup_stats(struct ufs_dedup_stats *stats);
+
+/** State and counters of the compression of cold files. */
+struct ufs_compression_stats {
+	/** Blocks kept compressed now. */
+	size_t compressed_blocks;
+	/** Data bytes in them and their compressed size. */
+	size_t original_bytes;
+	size_t compressed_bytes;
+	/** Blocks compressed and decompressed since the start. */
+	size_t compressions;
+	size_t decompressions;
+	unsigned long long decompress_time_ns;
+	/** Bytes of uncompressed block memory now. */
+	size_t memory_used;
+};
+
+/**
+ * Set a budget of uncompressed block memory, 0 - unlimited, the
+ * default. When the memory is over the budget, blocks of the
+ * least recently closed files are compressed, on close and right
+ * now. Files with opened descriptors are not compressed. Reads
+ * and writes unpack the blocks they touch transparently.
+ */
+void
+ufs_set_memory_budget(size_t bytes);
+
+void
+ufs_get_compression_stats(struct ufs_compression_stats *stats);
+
+/**
+ * Eviction handler, called when a call fails by the quota.
+ * @param need Bytes the call was short of.
+ * @param ctx Context given to ufs_set_quota().
+ */
+typedef void (*ufs_evict_f)(size_t need, void *ctx);
+
+/** Memory charged to the quota and its counters. */
+struct ufs_memory_stats {
+	/** All charged bytes, data and metadata. */
+	size_t used;
+	/** Block memory, compressed blocks by their compressed size. */
+	size_t data_bytes;
+	/** Headers of files and blocks, names and block maps. */
+	size_t metadata_bytes;
+	size_t quota;
+	/** Allocations refused by the quota since the start. */
+	size_t quota_failures;
+	/** Calls of the eviction handler since the start. */
+	size_t evictions;
+};
+
+/**
+ * Limit the memory of files, 0 - unlimited, the default. Memory
+ * is always accounted, but with a quota an allocation which would
+ * go over it fails, and the call fails with UFS_ERR_NO_MEM. A
+ * quota below the used memory frees nothing by itself.
+ *
+ * If @a handler is set, a call failed by the quota calls it once
+ * and is retried. The handler runs in the failing thread without
+ * userfs locks, and can free memory by ufs_delete() of closed
+ * files. A deleted file which is still opened keeps its memory
+ * until the last close. The handler must not use the descriptor
+ * of the failed call.
+ */
+void
+ufs_set_quota(size_t bytes, ufs_evict_f handler, void *ctx);
+
+void
+ufs_get_memory_stats(struct ufs_memory_stats *stats);
+
+/**
+ * Save all the files and directories visible by name into an
+ * image file. The image is written into "<path>.tmp" and renamed,
+ * so an old image is replaced atomically. Writers of the files
+ * wait until the end.
+ * @param path Path of the image in the real file system.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_IO - can't write the image.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Restore the files from an image made by ufs_save(). There must
+ * be no files visible by name. The image is mapped, and the file
+ * blocks point right into it, so the data is read from the disk
+ * lazily, on the first access, and not copied into the heap.
+ * Changes of the files are not written to the image. The image
+ * file must not be truncated while it is used.
+ * @param path Path of the image in the real file system.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - not an image, or it was made with
+ *       other block sizes, or there are files already.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_IO - can't read the image.
+ */
+int
+ufs_load(const char *path);
+
+/**
+ * Make the changes of the files durable with a redo journal. The
+ * files are kept in a checkpoint image at @a path and a log at
+ * "<path>.log". Each write, resize, view commit, creation,
+ * deletion, rename and clone appends a record to the log. Records
+ * are committed by groups: a call returns when its record is
+ * written and synced, if @a group_size records are not durable,
+ * else at once, leaving the record for the next commit. So with
+ * @a group_size 1 each change is durable on return, and with N a
+ * crash loses at most the last N - 1 changes, for 1/N of the syncs.
+ * Concurrent calls share commits in any case.
+ *
+ * A checkpoint saves all the files into the image, like
+ * ufs_save(), and starts an empty log. It is made by
+ * ufs_checkpoint(), and by a background thread when the log grows
+ * over @a checkpoint_size bytes, if it is not 0.
+ *
+ * The open recovers the files: loads the image, if it exists,
+ * replays the log, up to a torn or broken record left by a crash,
+ * and makes a checkpoint. Without an image the files already in
+ * memory are the first checkpoint. The journal must be opened and
+ * closed when no other thread uses userfs.
+ *
+ * ufs_load() and snapshots are not journaled. A change which can't
+ * be made durable fails with UFS_ERR_IO, but stays in memory, and
+ * the journal fails all the next changes.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. The
+ *     files can be partially recovered.
+ *     - UFS_ERR_INVALID_ARG - the journal is opened, or the image
+ *       or the log is broken, or they do not match, or there are
+ *       files already with an image.
+ *     - UFS_ERR_IO - can't read or write the image or the log.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_journal_open(const char *path, unsigned group_size, size_t checkpoint_size);
+
+/**
+ * Commit all the records, making all the changes made so far
+ * durable.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no journal.
+ *     - UFS_ERR_IO - can't write the log.
+ */
+int
+ufs_journal_sync(void);
+
+/**
+ * Make a checkpoint now. Writers wait until the image is written.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no journal.
+ *     - UFS_ERR_IO - can't write the image or the log.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_checkpoint(void);
+
+/**
+ * Commit all the records and stop journaling. The files stay in
+ * memory, and the next ufs_journal_open() replays the log.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no journal.
+ *     - UFS_ERR_IO - can't write the log, the journal is closed.
+ */
+int
+ufs_journal_close(void);
+
+/** Counters of the journal since it was opened. */
+struct ufs_journal_stats {
+	/** Records appended, and bytes of them. */
+	size_t records;
+	size_t bytes;
+	/** Group commits, each is one write and one sync of the log. */
+	size_t commits;
+	/** Checkpoints, including the one of the open. */
+	size_t checkpoints;
+	/** Size of the log now. */
+	size_t log_size;
+	/** Records replayed by the open. */
+	size_t replayed;
+};
+
+void
+ufs_get_journal_stats(struct ufs_journal_stats *stats);
+
+/**
+ * Close a file. Buffered writes of the descriptor are put into the
+ * file first.
  * @param fd File descriptor from ufs_open().
  * @retval 0 Success.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - the buffered writes failed. The
+ *       descriptor is closed anyway, and they are lost.
  */
 int
 ufs_close(int fd);
 
+/**
+ * Put the buffered writes of a UFS_BUFFERED descriptor into the
+ * file. An error of the writes is returned here, by ufs_close(),
+ * or by the next call on the descriptor which needs them in the
+ * file, and the data stays in the buffer.
+ * @retval 0 Success, or nothing is buffered.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_flush(int fd);
+
 /**
  * Delete a file by its name. Note, that it is allowed to drop the
  * file even if there are opened descriptors. In such a case the
@@ -133,10 +650,209 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory.
+ * @param path Path of the new directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - a file or a directory has the path.
+ *     - UFS_ERR_NO_FILE - the parent directory does not exist.
+ *     - UFS_ERR_NOT_DIR - the parent is a file.
+ *     - UFS_ERR_INVALID_ARG - bad path.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Remove an empty directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * Move a file or a directory with all its entries to another
+ * path. A file replaces an existing file, a directory can't
+ * replace anything. Opened descriptors stay valid. Each entry
+ * under a moved directory is re-indexed, so the cost is linear
+ * in their number.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no @a old_path, or no parent of
+ *       @a new_path.
+ *     - UFS_ERR_NOT_DIR - the new parent is a file.
+ *     - UFS_ERR_EXISTS - @a new_path is a directory, or a
+ *       directory is moved onto a file.
+ *     - UFS_ERR_INVALID_ARG - bad @a new_path, or a directory is
+ *       moved into itself.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
+struct ufs_dir;
+
+struct ufs_dirent {
+	/** Name in the directory, the last path component. */
+	const char *name;
+	bool is_dir;
+};
+
+/**
+ * Open a directory for listing. The entries are copied at once,
+ * in O(entries of the directory), and later changes are not seen.
+ * @param path Path of the directory, "" for the root.
+ *
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is a file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Next entry of a directory, in no particular order. It lives
+ * until ufs_closedir().
+ * @retval NULL No more entries.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+void
+ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Callback of ufs_list().
+ * @retval 0 Continue.
+ * @retval != 0 Stop the listing.
+ */
+typedef int (*ufs_list_f)(const char *filename, void *ctx);
+
+/**
+ * Call @a cb for each file visible by name with its full path, in
+ * no particular order. Directories are not listed, and deleted
+ * files, opened or not, are not either. Creation
+ * and deletion wait until the end, so the callback must not
+ * create, delete, clone or rename files.
+ * @return The last value returned by @a cb, 0 if all are listed.
+ */
+int
+ufs_list(ufs_list_f cb, void *ctx);
+
+/**
+ * Submission and completion ring for batches of operations, like
+ * io_uring. A caller takes entries with ufs_ring_get_sqe(), fills
+ * them, and passes them to execution with ufs_ring_submit(). The
+ * results are collected with ufs_ring_wait(), in submission order.
+ *
+ * The entries of one submission are executed in order, in one go.
+ * Neighbour reads or writes of one descriptor, at its position or
+ * at contiguous offsets, are coalesced into one vectored call. A
+ * coalesced write is all or nothing, a coalesced read fills the
+ * buffers in order up to the file end.
+ *
+ * One thread submits into a ring, and one thread waits for it.
+ * Different rings are independent.
+ */
+struct ufs_ring;
+
+enum ufs_ring_op {
+	/** ufs_open(filename, flags). */
+	UFS_OP_OPEN,
+	/** ufs_close(fd). */
+	UFS_OP_CLOSE,
+	/** ufs_read(fd, buf, size). */
+	UFS_OP_READ,
+	/** ufs_write(fd, buf, size). */
+	UFS_OP_WRITE,
+	/** ufs_pread(fd, buf, size, offset). */
+	UFS_OP_PREAD,
+	/** ufs_pwrite(fd, buf, size, offset). */
+	UFS_OP_PWRITE,
+	/** ufs_delete(filename). */
+	UFS_OP_DELETE,
+};
+
+enum {
+	/**
+	 * Descriptor of the last UFS_OP_OPEN executed by the ring. It
+	 * allows to open a file, use and close it in one submission.
+	 */
+	UFS_RING_LAST_FD = -2,
+};
+
+/** Submission entry. */
+struct ufs_sqe {
+	enum ufs_ring_op op;
+	int fd;
+	int flags;
+	const char *filename;
+	char *buf;
+	size_t size;
+	size_t offset;
+	/** Returned in the completion as is. */
+	uint64_t user_data;
+};
+
+/** Completion entry. */
+struct ufs_cqe {
+	uint64_t user_data;
+	/** What the synchronous call would return. */
+	ssize_t result;
+	/** ufs_errno() after the call, if @a result is -1. */
+	enum ufs_error_code error;
+};
+
+/**
+ * Create a ring of @a entries, rounded up to a power of 2. With
+ * @a is_threaded the submissions are executed by a background
+ * thread, else by ufs_ring_submit() itself.
+ * @retval NULL No memory, or the thread is not created.
+ */
+struct ufs_ring *
+ufs_ring_new(unsigned entries, bool is_threaded);
+
+/** Wait for the submitted entries and free the ring. */
+void
+ufs_ring_delete(struct ufs_ring *ring);
+
+/**
+ * Take a free submission entry. Entries are busy from here till
+ * their completions are collected.
+ * @retval NULL The ring is full.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Submit all the entries taken since the last submission.
+ * @return Number of submitted entries.
+ */
+unsigned
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Collect up to @a max completions, waiting for at least
+ * @a min_count of them, but not more than are submitted.
+ * @return Number of collected completions.
+ */
+unsigned
+ufs_ring_wait(struct ufs_ring *ring, struct ufs_cqe *cqes, unsigned max,
+	      unsigned min_count);
+
 #ifdef NEED_RESIZE
 
 /**
@@ -147,11 +863,16 @@ ufs_delete(const char *filename);
  * the blocks are truncated. Opened file descriptors behind the
  * new file size should proceed from the new file end.
  *
+ * Growth only extends the block map with holes, and fails without
+ * changing the file. Shrinking costs the number of freed blocks
+ * and of the descriptors opened on this file.
+ *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
  * @retval 0 Success.
  * @retval -1 Error occurred.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is read-only.
  *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
  *       @a new_size is bigger than the current size.
  */